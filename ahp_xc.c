@@ -23,19 +23,25 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sys/time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AHP_XC_X86
+#endif
 #include "ahp_xc.h"
 
 #include "rs232.c"
 
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
+
 #ifndef AIRY
 #define AIRY 1.21966
 #endif
 #ifndef EULER
 #define EULER 2.71828182845904523536028747135266249775724709369995
 #endif
-static int32_t xc_current_input = 0;
-static int64_t sign = 1;
-static int64_t fill = 0;
+#define AHP_XC_MIN(a, b) ((a) < (b) ? (a) : (b))
 
 typedef struct  {
     ahp_xc_sample *sample;
@@ -45,44 +51,261 @@ typedef struct  {
     const char *data;
     double lag;
     double *lags;
+    int64_t *values;
+    unsigned char *packed;
+    int32_t *line_indexes;
+    double *line_lags;
+    ahp_xc_correlation_planes *planes;
+    uint32_t row;
+    int32_t phase_mode;
+    struct ahp_xc_context *context;
 } thread_argument;
 
-static uint64_t nthreads = 0;
-thread_argument *autocorrelation_thread_args = NULL;
-thread_argument *crosscorrelation_thread_args = NULL;
-static pthread_t *autocorrelation_threads = NULL;
-static pthread_t *crosscorrelation_threads = NULL;
-static pthread_mutex_t ahp_xc_mutex;
-static int32_t ahp_xc_mutexes_initialized = 0;
-
-static int32_t AHP_XC_MAX_THREADS = 1;
-static unsigned char *ahp_xc_test = NULL;
-static unsigned char *ahp_xc_leds = NULL;
-static ahp_xc_scan_request *ahp_xc_auto_channel = NULL;
-static ahp_xc_scan_request *ahp_xc_cross_channel = NULL;
-static uint32_t ahp_xc_bps = 0;
-static uint32_t ahp_xc_nlines = 0;
-static uint32_t ahp_xc_nbaselines = 0;
-static uint32_t ahp_xc_auto_lagsize = 0;
-static uint32_t ahp_xc_cross_lagsize = 0;
-static uint32_t ahp_xc_delaysize = 0;
-static uint32_t ahp_xc_flags = 0;
-static uint32_t ahp_xc_correlator_enabled = 1;
-static uint32_t ahp_xc_intensity_correlator_enabled = 0;
-static double ahp_xc_frequency = 1;
-static uint32_t ahp_xc_voltage = 0;
-static uint32_t ahp_xc_connected = 0;
-static uint32_t ahp_xc_detected = 0;
-static uint32_t ahp_xc_packetsize = 1344;
-static int32_t ahp_xc_baserate = XC_BASE_RATE;
-static baud_rate ahp_xc_rate = R_BASE;
-static uint32_t ahp_xc_correlation_order = 0;
-static char ahp_xc_comport[128];
-static char *ahp_xc_header = { 0 };
-static int ahp_xc_header_len = { 0 };
-static int ahp_xc_delaysize_len = { 0 };
-static unsigned char ahp_xc_capture_flags = 0;
-static unsigned char ahp_xc_max_lost_packets = 1;
+#define AHP_XC_POOL_MIN_CHUNK 4
+
+typedef struct {
+    void *(*job)(void *);
+    thread_argument *args;
+    uint32_t count;
+    uint32_t chunk;
+    uint32_t next;
+    uint32_t pending;
+    uint32_t active;
+    uint32_t generation;
+    uint32_t nworkers;
+    int32_t quit;
+    pthread_t *workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct ahp_xc_context *context;
+} worker_pool;
+
+typedef struct {
+    int32_t index;
+    int32_t capture;
+    int32_t order;
+    int64_t *delay;
+    int32_t *test;
+    int32_t *leds;
+    int32_t *voltage;
+    uint32_t lines;
+    uint64_t sent;
+    uint64_t suppressed;
+} device_shadow;
+
+#define AHP_XC_BASELINE_DENSE_MAX (1<<20)
+
+typedef struct {
+    uint32_t nlines;
+    uint32_t order;
+    uint32_t size;
+    int32_t hashed;
+    int32_t *slots;
+    int32_t *lines;
+    int32_t *sorted;
+    uint64_t *binomial;
+} baseline_table;
+
+typedef struct {
+    char *slots;
+    char *frame;
+    uint32_t slot_size;
+    uint32_t depth;
+    uint64_t head;
+    uint64_t tail;
+    uint32_t max_occupancy;
+    uint64_t packets;
+    uint64_t overflows;
+    uint64_t malformed;
+} packet_ring;
+
+
+#define AHP_XC_RECORD_MAGIC "AHPXCREC"
+#define AHP_XC_RECORD_VERSION 1
+#define AHP_XC_RECORD_INDEX_INTERVAL 256
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_len;
+    uint32_t packet_size;
+    uint32_t record_size;
+    uint32_t index_interval;
+    uint32_t data_offset;
+    uint64_t realtime_start;
+    uint64_t index_offset;
+    uint64_t index_count;
+} record_file_header;
+
+typedef struct {
+    uint64_t monotonic;
+    uint64_t realtime;
+    double timestamp;
+} record_header;
+
+typedef struct {
+    double timestamp;
+    uint64_t offset;
+} record_index;
+
+typedef struct {
+    FILE *file;
+    record_file_header header;
+    record_index *index;
+    uint64_t index_count;
+    uint64_t index_size;
+    uint64_t records;
+    unsigned char *padding;
+    int32_t error;
+} packet_recorder;
+
+typedef struct {
+    const unsigned char *map;
+    size_t map_size;
+    const record_file_header *header;
+    const record_index *index;
+    uint64_t records;
+    uint64_t next;
+    double speed;
+    uint64_t base_record;
+    uint64_t base_host;
+} packet_replay;
+
+typedef struct {
+    ahp_xc_context *context;
+    ahp_xc_packet_pool *pool;
+    ahp_xc_packet **queue;
+    uint32_t head;
+    uint32_t count;
+    int32_t starved;
+    int32_t ended;
+    pthread_t thread;
+    struct ahp_xc_merge *merge;
+    ahp_xc_merge_status status;
+} merge_stream;
+
+struct ahp_xc_merge {
+    uint32_t n_streams;
+    uint32_t depth;
+    double tolerance;
+    double window;
+    merge_stream *streams;
+    ahp_xc_packet_group *groups;
+    ahp_xc_packet **group_packets;
+    uint32_t group_head;
+    uint32_t group_count;
+    uint64_t sequence;
+    double newest;
+    double emitted;
+    int32_t has_emitted;
+    int32_t finished;
+    volatile int32_t running;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    pthread_cond_t available;
+};
+
+struct ahp_xc_context {
+    ahp_serial_port *port;
+    int32_t current_input;
+    int64_t sign;
+    uint64_t max_threads;
+    worker_pool pool;
+    thread_argument *auto_args;
+    thread_argument *cross_args;
+    pthread_t *auto_threads;
+    pthread_t *cross_threads;
+    pthread_mutex_t mutex;
+    int32_t mutexes_initialized;
+    unsigned char *test;
+    unsigned char *leds;
+    ahp_xc_scan_request *auto_channel;
+    ahp_xc_scan_request *cross_channel;
+    ahp_xc_sample *line_samples;
+    uint32_t line_samples_len;
+    ahp_xc_sample *planar_sample;
+    baseline_table baselines;
+    unsigned char *decode_scratch;
+    int64_t *counts_values;
+    unsigned char *counts_packed;
+    unsigned char *packed_payload;
+    const char *packed_source;
+    uint32_t bps;
+    uint32_t nlines;
+    uint32_t nbaselines;
+    uint32_t auto_lagsize;
+    uint32_t cross_lagsize;
+    uint32_t delaysize;
+    uint32_t flags;
+    uint32_t correlator_enabled;
+    uint32_t intensity_correlator_enabled;
+    double frequency;
+    uint32_t voltage;
+    uint32_t connected;
+    uint32_t detected;
+    uint32_t packetsize;
+    int32_t baserate;
+    baud_rate rate;
+    uint32_t correlation_order;
+    char comport[128];
+    char *header;
+    int header_len;
+    int delaysize_len;
+    ahp_xc_layout packet_layout;
+    unsigned char *command_buffer;
+    size_t command_len;
+    size_t command_size;
+    int32_t command_depth;
+    unsigned char capture_flags;
+    device_shadow shadow;
+    unsigned char max_lost_packets;
+    uint32_t link_max_multiplier;
+    uint32_t link_burst;
+    double link_max_error_rate;
+    ahp_xc_link_status link;
+    uint64_t link_switch_mark;
+    int32_t link_switch_pending;
+    char *rx_buffer;
+    uint32_t rx_len;
+    uint32_t rx_size;
+    int32_t rx_synced;
+    uint64_t rx_discarded;
+    packet_ring ring;
+    pthread_t stream_thread;
+    pthread_mutex_t stream_mutex;
+    pthread_cond_t stream_cond;
+    volatile int32_t streaming;
+    packet_recorder recorder;
+    packet_replay replay;
+};
+
+#define AHP_XC_CONTEXT_INITIALIZER(serial_port) { \
+    .port = serial_port, \
+    .sign = 1, \
+    .max_threads = 1, \
+    .pool = { .mutex = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER }, \
+    .correlator_enabled = 1, \
+    .frequency = 1, \
+    .packetsize = 1344, \
+    .baserate = XC_BASE_RATE, \
+    .rate = R_BASE, \
+    .correlation_order = 2, \
+    .shadow = { -1, -1, -1, NULL, NULL, NULL, NULL, 0, 0, 0 }, \
+    .max_lost_packets = 1, \
+    .stream_mutex = PTHREAD_MUTEX_INITIALIZER, \
+    .stream_cond = PTHREAD_COND_INITIALIZER, \
+}
+
+static ahp_xc_context ahp_xc_default_context = AHP_XC_CONTEXT_INITIALIZER(&ahp_serial_default_port);
+static __thread ahp_xc_context *ahp_xc_current = &ahp_xc_default_context;
+
+static void context_bind(ahp_xc_context *context)
+{
+    ahp_xc_current = context;
+}
 
 static uint32_t get_npolytopes(int nlines, int32_t order)
 {
@@ -99,686 +322,3242 @@ int32_t ahp_xc_get_line_index(int32_t idx, int32_t order)
     return get_line_index(ahp_xc_get_nlines(), idx, order);
 }
 
-int32_t ahp_xc_get_crosscorrelation_index(int32_t *lines, int32_t order)
+static void baselines_sort(int32_t *tuple, uint32_t order)
 {
-    int32_t x, y, idx;
-    int32_t nprisms = ahp_xc_get_nbaselines();
-    int* matches = (int*)malloc(sizeof(int)*nprisms);
-    memset(matches, 0, sizeof(int)*nprisms);
-    for(idx = 0; idx < nprisms; idx ++) {
-        for(x = 0; x < order; x ++) {
-            for(y = 0; y < order; y ++) {
-                if(lines[x] == ahp_xc_get_line_index(idx, y))
-                    matches[idx]++;
-            }
-        }
-    }
-    int32_t index = 0;
-    int32_t best_match = 0;
-    for(idx = 0; idx < nprisms; idx++) {
-        if(matches[idx] > best_match) {
-            best_match = matches[idx];
-            index = idx;
-        }
+    uint32_t x, y;
+    for(x = 1; x < order; x++) {
+        int32_t line = tuple[x];
+        for(y = x; y > 0 && tuple[y-1] > line; y--)
+            tuple[y] = tuple[y-1];
+        tuple[y] = line;
     }
-    return index;
 }
 
-uint64_t ahp_xc_max_threads(uint64_t value)
+static uint32_t baselines_slot(baseline_table *table, const int32_t *sorted)
 {
-    if(value>0) {
-        AHP_XC_MAX_THREADS = value;
+    uint32_t x;
+    if(!table->hashed) {
+        uint64_t rank = 0;
+        for(x = 0; x < table->order; x++)
+            rank += table->binomial[(sorted[x] + x) * (table->order + 1) + x + 1];
+        return (uint32_t)rank;
     }
-    return AHP_XC_MAX_THREADS;
+    uint32_t hash = 2166136261u;
+    for(x = 0; x < table->order; x++)
+        hash = (hash ^ (uint32_t)sorted[x]) * 16777619u;
+    uint32_t slot = hash & (table->size - 1);
+    while(table->slots[slot] >= 0 && memcmp(&table->sorted[table->slots[slot] * table->order], sorted, sizeof(int32_t) * table->order))
+        slot = (slot + 1) & (table->size - 1);
+    return slot;
 }
 
-void wait_threads()
+static int32_t baselines_closest(baseline_table *table, const int32_t *lines, int32_t order)
 {
-    while (nthreads >= ahp_xc_max_threads(0))
-        usleep(1);
-}
-
-void wait_no_threads()
-{
-    while (nthreads > 0)
-        usleep(1);
+    uint32_t nbaselines = table->nlines * (table->nlines - 1) / 2;
+    uint32_t idx;
+    int32_t x, y, index = 0, best_match = 0;
+    for(idx = 0; idx < nbaselines; idx++) {
+        int32_t matches = 0;
+        for(y = 0; y < order; y++) {
+            int32_t line = get_line_index(table->nlines, idx, y);
+            for(x = 0; x < order; x++)
+                matches += lines[x] == line;
+        }
+        if(matches > best_match) {
+            best_match = matches;
+            index = idx;
+        }
+    }
+    return index;
 }
 
-static void complex_phase_magnitude(ahp_xc_correlation *sample)
+/**
+* \brief baselines_closest restricted to the baselines sharing a line with the sorted tuple
+* members lists the baselines of each line from offsets[line] to offsets[line+1], once per occurrence,
+* scores must be zero on entry and is left zeroed.
+*/
+static int32_t baselines_closest_sorted(const uint32_t *offsets, const int32_t *members, int32_t *scores, const int32_t *sorted, int32_t order)
 {
-    if(!ahp_xc_detected) return;
-    double cr = (double)sample->real / sample->counts;
-    double ci = (double)sample->imaginary / sample->counts;
-    double magnitude = (double)sqrt(pow(cr, 2)+pow((double)ci, 2));
-    double phase = 0.0;
-    if(magnitude > 0.0) {
-        phase = asin ((double)cr / magnitude);
-        if(ci < 0)
-            phase = M_PI*2.0-phase;
+    int32_t x, index = 0, best_match = 0;
+    uint32_t k;
+    for(x = 0; x < order; x++) {
+        int32_t run = 1;
+        while(x + run < order && sorted[x + run] == sorted[x])
+            run++;
+        for(k = offsets[sorted[x]]; k < offsets[sorted[x] + 1]; k++)
+            scores[members[k]] += run;
+        x += run - 1;
+    }
+    for(x = 0; x < order; x++) {
+        for(k = offsets[sorted[x]]; k < offsets[sorted[x] + 1]; k++) {
+            int32_t idx = members[k];
+            if(scores[idx] > best_match || (scores[idx] == best_match && idx < index)) {
+                best_match = scores[idx];
+                index = idx;
+            }
+        }
+    }
+    for(x = 0; x < order; x++) {
+        for(k = offsets[sorted[x]]; k < offsets[sorted[x] + 1]; k++)
+            scores[members[k]] = 0;
     }
-    sample->magnitude = magnitude;
-    sample->phase = phase;
+    return index;
 }
 
-double get_timestamp(char *data)
+static void baselines_free(baseline_table *table)
 {
-    char timestamp[16] = { 0 };
-    double ts = 0;
-    uint32_t tmp = 0;
-    strncpy(timestamp, &data[ahp_xc_get_packetsize()-19], 16);
-    sscanf(timestamp, "%8X", &tmp);
-    ts = (double)tmp * 4.294967296;
-    sscanf(&timestamp[8], "%8X", &tmp);
-    return (double)ts + tmp / 1000000000.0;
+    free(table->slots);
+    free(table->lines);
+    free(table->sorted);
+    free(table->binomial);
+    memset(table, 0, sizeof(baseline_table));
 }
 
-double ahp_xc_get_current_channel_auto(int n, char *data)
+static int32_t baselines_build(ahp_xc_context *context, uint32_t nlines, uint32_t order)
 {
-    char *current_channel = (char*)malloc(ahp_xc_delaysize_len);
-    double channel = 0;
-    uint32_t tmp = 0;
-    char *message = &data[ahp_xc_get_packetsize()-19-ahp_xc_delaysize_len*ahp_xc_get_nlines()-ahp_xc_delaysize_len*(n+1)];
-    strncpy(current_channel, message, ahp_xc_delaysize_len);
-    sscanf(current_channel, "%X", &tmp);
-    channel = (double)tmp;
-    return channel;
+    baseline_table *table = &context->baselines;
+    uint32_t nbaselines = nlines * (nlines - 1) / 2;
+    uint32_t range = nlines + order - 1;
+    uint32_t x, y;
+    baselines_free(table);
+    if(nlines < 2 || order < 2)
+        return -EINVAL;
+    uint64_t *binomial = (uint64_t*)malloc(sizeof(uint64_t) * (range + 1) * (order + 1));
+    if(binomial == NULL)
+        return -ENOMEM;
+    for(x = 0; x <= range; x++) {
+        for(y = 0; y <= order; y++) {
+            uint64_t *c = &binomial[x * (order + 1) + y];
+            if(y == 0)
+                *c = 1;
+            else if(x == 0)
+                *c = 0;
+            else
+                *c = binomial[(x - 1) * (order + 1) + y - 1] + binomial[(x - 1) * (order + 1) + y];
+            if(*c > AHP_XC_BASELINE_DENSE_MAX)
+                *c = AHP_XC_BASELINE_DENSE_MAX + 1;
+        }
+    }
+    uint64_t dense = binomial[range * (order + 1) + order];
+    table->nlines = nlines;
+    table->order = order;
+    if(dense <= AHP_XC_BASELINE_DENSE_MAX) {
+        table->size = (uint32_t)dense;
+        table->binomial = binomial;
+    } else {
+        free(binomial);
+        table->hashed = 1;
+        for(table->size = 1; table->size < nbaselines * 2; table->size <<= 1);
+    }
+    table->slots = (int32_t*)malloc(sizeof(int32_t) * table->size);
+    table->lines = (int32_t*)malloc(sizeof(int32_t) * nbaselines * order);
+    table->sorted = (int32_t*)malloc(sizeof(int32_t) * nbaselines * order);
+    if(table->slots == NULL || table->lines == NULL || table->sorted == NULL) {
+        baselines_free(table);
+        return -ENOMEM;
+    }
+    memset(table->slots, -1, sizeof(int32_t) * table->size);
+    for(x = 0; x < nbaselines; x++) {
+        for(y = 0; y < order; y++)
+            table->lines[x * order + y] = table->sorted[x * order + y] = get_line_index(nlines, x, y);
+        baselines_sort(&table->sorted[x * order], order);
+    }
+    uint32_t *offsets = (uint32_t*)calloc(nlines + 1, sizeof(uint32_t));
+    int32_t *members = (int32_t*)malloc(sizeof(int32_t) * nbaselines * order);
+    int32_t *scores = (int32_t*)calloc(nbaselines, sizeof(int32_t));
+    if(offsets == NULL || members == NULL || scores == NULL) {
+        free(offsets);
+        free(members);
+        free(scores);
+        baselines_free(table);
+        return -ENOMEM;
+    }
+    for(x = 0; x < nbaselines * order; x++)
+        offsets[table->lines[x] + 1]++;
+    for(x = 0; x < nlines; x++)
+        offsets[x + 1] += offsets[x];
+    for(x = 0; x < nbaselines * order; x++)
+        members[offsets[table->lines[x]]++] = (int32_t)(x / order);
+    for(x = nlines; x > 0; x--)
+        offsets[x] = offsets[x - 1];
+    offsets[0] = 0;
+    for(x = 0; x < nbaselines; x++) {
+        int32_t *sorted = &table->sorted[x * order];
+        int32_t repeated = 0;
+        for(y = 1; y < order; y++)
+            repeated |= sorted[y] == sorted[y-1];
+        uint32_t slot = baselines_slot(table, sorted);
+        if(table->slots[slot] < 0)
+            table->slots[slot] = repeated ? baselines_closest_sorted(offsets, members, scores, sorted, order) : (int32_t)x;
+    }
+    free(offsets);
+    free(members);
+    free(scores);
+    return 0;
 }
 
-double ahp_xc_get_current_channel_cross(int n, char *data)
+int32_t ahp_xc_get_baseline_lines(uint32_t idx, int32_t *lines)
 {
-    char *current_channel = (char*)malloc(ahp_xc_delaysize_len);
-    double channel = 0;
-    uint32_t tmp = 0;
-    char *message = &data[ahp_xc_get_packetsize()-19-ahp_xc_delaysize_len*(n+1)];
-    strncpy(current_channel, message, ahp_xc_delaysize_len);
-    sscanf(current_channel, "%X", &tmp);
-    channel = (double)tmp;
-    return channel;
+    ahp_xc_context *context = ahp_xc_current;
+    baseline_table *table = &context->baselines;
+    if(!context->detected || table->lines == NULL) return -ENOENT;
+    if(idx >= table->nlines * (table->nlines - 1) / 2) return -EINVAL;
+    memcpy(lines, &table->lines[idx * table->order], sizeof(int32_t) * table->order);
+    return (int32_t)table->order;
 }
 
-int32_t calc_checksum(char *data)
+int32_t ahp_xc_get_crosscorrelation_index(int32_t *lines, int32_t order)
 {
-    if(!ahp_xc_connected) return -ENOENT;
-    int32_t x;
-    uint32_t checksum = 0x00;
-    uint32_t calculated_checksum = 0;
-    unsigned char v = data[ahp_xc_get_packetsize()-3];
-    checksum = v < 'A' ? (v - '0') : (v - 'A' + 10);
-    checksum *= 16;
-    v = data[ahp_xc_get_packetsize()-2];
-    checksum += v < 'A' ? (v - '0') : (v - 'A' + 10);
-    for(x = ahp_xc_header_len; x < (int)ahp_xc_get_packetsize()-3; x++) {
-        calculated_checksum += data[x] < 'A' ? (data[x] - '0') : (data[x] - 'A' + 10);
-        calculated_checksum &= 0xff;
-    }
-    if(checksum != calculated_checksum) {
-        return EINVAL;
+    ahp_xc_context *context = ahp_xc_current;
+    baseline_table *table = &context->baselines;
+    int32_t stack_key[16];
+    int32_t x, idx = -1;
+    int32_t *key = order > 16 ? (int32_t*)malloc(sizeof(int32_t) * order) : stack_key;
+    if(table->slots != NULL && key != NULL && (uint32_t)order == table->order) {
+        for(x = 0; x < order && lines[x] >= 0 && (uint32_t)lines[x] < table->nlines; x++)
+            key[x] = lines[x];
+        if(x == order) {
+            baselines_sort(key, table->order);
+            idx = table->slots[baselines_slot(table, key)];
+        }
     }
-    return 0;
+    if(key != stack_key)
+        free(key);
+    if(idx >= 0)
+        return idx;
+    return baselines_closest(table, lines, order);
 }
 
-int32_t check_sof(char *data)
+uint64_t ahp_xc_max_threads(uint64_t value)
 {
-    if(!ahp_xc_connected) return -ENOENT;
-    char* tmp = (char*)malloc(ahp_xc_header_len);
-    memset(tmp, 'F', ahp_xc_header_len);
-    if(!strncmp(data, tmp, ahp_xc_header_len)) {
-        free(tmp);
-        return 1;
+    ahp_xc_context *context = ahp_xc_current;
+    if(value>0) {
+        context->max_threads = value;
     }
-    free(tmp);
-    return 0;
+    return context->max_threads;
 }
 
-static char * grab_packet(double *timestamp)
+static void pool_drain(worker_pool *pool)
 {
-    errno = 0;
-    uint32_t size = ahp_xc_get_packetsize();
-    char *buf = (char*)malloc(ahp_xc_get_packetsize());
-    memset(buf, 0, (unsigned int)size);
-    if(!ahp_xc_connected){
-        errno = ENOENT;
-        goto err_end;
-    }
-    int32_t nread = 0;
-    nread = ahp_serial_RecvBuf((unsigned char*)buf, size);
-    if(buf[0] == '\0' || buf[0] == '\r' || buf[0] == '\n') {
-        ahp_serial_AlignFrame('\r', (int)size);
-        goto err_end;
-    }
-    buf[nread-1] = 0;
-    nread = strlen((char*)buf);
-    if(nread == 0) {
-        errno = ENODATA;
-    } else if(nread < 0) {
-        errno = ETIMEDOUT;
-    } else if(nread > ahp_xc_header_len) {
-        char *tmp = buf;
-        if(strncmp(ahp_xc_get_header(), (char*)tmp, ahp_xc_header_len)) {
-            errno = EINVAL;
-            ahp_serial_AlignFrame('\r', -1);
-        } else if(check_sof((char*)buf)) {
-            errno = 0;
-        } else if(nread < size-1) {
-            errno = ERANGE;
-        } else {
-            errno = calc_checksum((char*)buf);
+    uint32_t first, last, x;
+    for(;;) {
+        first = __atomic_fetch_add(&pool->next, pool->chunk, __ATOMIC_ACQ_REL);
+        if(first >= pool->count)
+            break;
+        last = first + pool->chunk < pool->count ? first + pool->chunk : pool->count;
+        for(x = first; x < last; x++)
+            pool->job(&pool->args[x]);
+        if(__atomic_sub_fetch(&pool->pending, last - first, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&pool->mutex);
+            pthread_cond_broadcast(&pool->done);
+            pthread_mutex_unlock(&pool->mutex);
         }
     }
-    if(nread == 0 || errno)
-        goto err_end;
-    if(timestamp != NULL)
-        *timestamp = get_timestamp(buf);
-    return buf;
-err_end:
-    fprintf(stderr, "%s error: %s\n", __func__, strerror(errno));
-    free(buf);
-    return NULL;
 }
 
-uint32_t ahp_xc_current_input()
+static void *pool_worker(void *o)
 {
-    return xc_current_input;
+    worker_pool *pool = (worker_pool*)o;
+    uint32_t seen;
+    context_bind(pool->context);
+    pthread_mutex_lock(&pool->mutex);
+    seen = pool->generation;
+    for(;;) {
+        while(!pool->quit && seen == pool->generation)
+            pthread_cond_wait(&pool->work, &pool->mutex);
+        if(pool->quit)
+            break;
+        seen = pool->generation;
+        pool->active++;
+        pthread_mutex_unlock(&pool->mutex);
+        pool_drain(pool);
+        pthread_mutex_lock(&pool->mutex);
+        if(--pool->active == 0)
+            pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
 }
 
-void ahp_xc_select_input(uint32_t index)
+static void pool_stop(worker_pool *pool)
 {
-    if(!ahp_xc_detected) return;
-    int32_t idx = 0;
-    if(index >= ahp_xc_get_nlines())
+    uint32_t x;
+    if(!pool->nworkers)
         return;
-    ahp_xc_send_command(CLEAR, SET_INDEX);
-    int len = (((int)log2(ahp_xc_get_nlines()) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_send_command(SET_INDEX, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_INDEX, (unsigned char)(index&0xf));
-        index >>= 4;
-    }
-    xc_current_input = index;
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    for(x = 0; x < pool->nworkers; x++)
+        pthread_join(pool->workers[x], NULL);
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->nworkers = 0;
+    pool->quit = 0;
 }
 
-void ahp_xc_enable_crosscorrelator(int32_t enable)
+static void pool_start(ahp_xc_context *context, worker_pool *pool, uint32_t nworkers)
 {
-    if(!ahp_xc_detected) return;
-    ahp_xc_correlator_enabled = enable;
+    uint32_t x;
+    pool->context = context;
+    pool->workers = (pthread_t*)malloc(sizeof(pthread_t)*nworkers);
+    for(x = 0; x < nworkers; x++) {
+        if(pthread_create(&pool->workers[x], NULL, pool_worker, pool))
+            break;
+    }
+    pool->nworkers = x;
 }
 
-void ahp_xc_enable_intensity_crosscorrelator(int32_t enable)
+/**
+* \brief run job over count arguments on the caller thread and the pool workers
+* Returns once every job has completed. The pool follows ahp_xc_max_threads,
+* counting the caller as one of the threads.
+*/
+static void pool_run(ahp_xc_context *context, worker_pool *pool, void *(*job)(void *), thread_argument *args, uint32_t count)
 {
-    if(!ahp_xc_detected) return;
-    ahp_xc_intensity_correlator_enabled = enable;
+    uint32_t x;
+    uint32_t nthreads = (uint32_t)context->max_threads;
+    if(nthreads < 1)
+        nthreads = 1;
+    if(pool->nworkers != nthreads - 1) {
+        pool_stop(pool);
+        if(nthreads > 1)
+            pool_start(context, pool, nthreads - 1);
+    }
+    uint32_t chunk = count / ((pool->nworkers + 1) * 4);
+    if(chunk < AHP_XC_POOL_MIN_CHUNK)
+        chunk = AHP_XC_POOL_MIN_CHUNK;
+    if(!pool->nworkers || count <= chunk) {
+        for(x = 0; x < count; x++)
+            job(&args[x]);
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    while(pool->active > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pool->job = job;
+    pool->args = args;
+    pool->count = count;
+    pool->chunk = chunk;
+    pool->next = 0;
+    pool->pending = count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    pool_drain(pool);
+    pthread_mutex_lock(&pool->mutex);
+    while(__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
 }
 
-int32_t ahp_xc_intensity_crosscorrelator_enabled()
-{
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_intensity_correlator_enabled != 0 || !ahp_xc_has_crosscorrelator();
-}
+static unsigned char hex_table[256];
 
-int32_t ahp_xc_has_crosscorrelator()
+static uint32_t hex_pack_scalar(const char *src, size_t len, unsigned char *dst)
 {
-    if(!ahp_xc_detected) return 0;
-    return (ahp_xc_flags & HAS_CROSSCORRELATOR ? ahp_xc_correlator_enabled : 0);
+    size_t x;
+    uint32_t sum = 0;
+    for(x = 0; x + 1 < len; x += 2) {
+        unsigned char hi = hex_table[(unsigned char)src[x]];
+        unsigned char lo = hex_table[(unsigned char)src[x+1]];
+        *dst++ = (unsigned char)((hi << 4) | lo);
+        sum += hi + lo;
+    }
+    if(x < len)
+        sum += hex_table[(unsigned char)src[x]];
+    return sum;
 }
 
-int32_t ahp_xc_has_psu()
+static uint32_t hex_sum_scalar(const char *src, size_t len)
 {
-    if(!ahp_xc_detected) return 0;
-    return (ahp_xc_flags & HAS_PSU ? 1 : 0);
+    size_t x;
+    uint32_t sum = 0;
+    for(x = 0; x < len; x++)
+        sum += hex_table[(unsigned char)src[x]];
+    return sum;
 }
 
-int32_t ahp_xc_has_leds()
+#ifdef AHP_XC_X86
+__attribute__((target("sse4.1")))
+static inline __m128i hex_nibbles_sse41(__m128i c)
 {
-    if(!ahp_xc_detected) return 0;
-    return (ahp_xc_flags & HAS_LEDS ? 1 : 0);
+    __m128i alpha = _mm_and_si128(_mm_srli_epi16(c, 6), _mm_set1_epi8(0x01));
+    return _mm_add_epi8(_mm_and_si128(c, _mm_set1_epi8(0x0f)), _mm_add_epi8(alpha, _mm_slli_epi16(alpha, 3)));
 }
 
-int32_t ahp_xc_has_cumulative_only()
+__attribute__((target("sse4.1")))
+static uint32_t hex_sum128(__m128i acc)
 {
-    if(!ahp_xc_detected) return 0;
-    return (ahp_xc_flags & HAS_CUMULATIVE_ONLY ? 1 : 0);
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return (uint32_t)(lanes[0] + lanes[1]);
 }
 
-char* ahp_xc_get_header()
+__attribute__((target("sse4.1")))
+static uint32_t hex_pack_sse41(const char *src, size_t len, unsigned char *dst)
 {
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_header;
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    __m128i acc = _mm_setzero_si128();
+    size_t x;
+    for(x = 0; x + 16 <= len; x += 16) {
+        __m128i nibbles = hex_nibbles_sse41(_mm_loadu_si128((const __m128i*)(src + x)));
+        __m128i bytes = _mm_maddubs_epi16(nibbles, weights);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(nibbles, _mm_setzero_si128()));
+        _mm_storel_epi64((__m128i*)(dst + x / 2), _mm_packus_epi16(bytes, bytes));
+    }
+    return hex_sum128(acc) + hex_pack_scalar(src + x, len - x, dst + x / 2);
 }
 
-int32_t ahp_xc_get_baudrate()
+__attribute__((target("sse4.1")))
+static uint32_t hex_sum_sse41(const char *src, size_t len)
 {
-    return ahp_xc_baserate << ahp_xc_rate;
+    __m128i acc = _mm_setzero_si128();
+    size_t x;
+    for(x = 0; x + 16 <= len; x += 16) {
+        __m128i nibbles = hex_nibbles_sse41(_mm_loadu_si128((const __m128i*)(src + x)));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(nibbles, _mm_setzero_si128()));
+    }
+    return hex_sum128(acc) + hex_sum_scalar(src + x, len - x);
 }
 
-uint32_t ahp_xc_get_bps()
+__attribute__((target("avx2")))
+static inline __m256i hex_nibbles_avx2(__m256i c)
 {
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_bps;
+    __m256i alpha = _mm256_and_si256(_mm256_srli_epi16(c, 6), _mm256_set1_epi8(0x01));
+    return _mm256_add_epi8(_mm256_and_si256(c, _mm256_set1_epi8(0x0f)), _mm256_add_epi8(alpha, _mm256_slli_epi16(alpha, 3)));
 }
 
-uint32_t ahp_xc_get_nlines()
+__attribute__((target("avx2")))
+static uint32_t hex_sum256(__m256i acc)
 {
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_nlines;
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return (uint32_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
 }
 
-uint32_t ahp_xc_get_nbaselines()
+__attribute__((target("avx2")))
+static uint32_t hex_pack_avx2(const char *src, size_t len, unsigned char *dst)
 {
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_get_nlines() * (ahp_xc_get_nlines() - 1) / 2;
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+    __m256i acc = _mm256_setzero_si256();
+    size_t x;
+    for(x = 0; x + 32 <= len; x += 32) {
+        __m256i nibbles = hex_nibbles_avx2(_mm256_loadu_si256((const __m256i*)(src + x)));
+        __m256i bytes = _mm256_maddubs_epi16(nibbles, weights);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(nibbles, _mm256_setzero_si256()));
+        bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(bytes, bytes), 0x08);
+        _mm_storeu_si128((__m128i*)(dst + x / 2), _mm256_castsi256_si128(bytes));
+    }
+    return hex_sum256(acc) + hex_pack_sse41(src + x, len - x, dst + x / 2);
 }
 
-uint32_t ahp_xc_get_npolytopes(int32_t order)
+__attribute__((target("avx2")))
+static uint32_t hex_sum_avx2(const char *src, size_t len)
 {
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_get_nlines() * (ahp_xc_get_nlines() - order + 1) / order;
+    __m256i acc = _mm256_setzero_si256();
+    size_t x;
+    for(x = 0; x + 32 <= len; x += 32) {
+        __m256i nibbles = hex_nibbles_avx2(_mm256_loadu_si256((const __m256i*)(src + x)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(nibbles, _mm256_setzero_si256()));
+    }
+    return hex_sum256(acc) + hex_sum_sse41(src + x, len - x);
 }
+#endif
 
-uint32_t ahp_xc_get_delaysize()
-{
-    if(!ahp_xc_detected) return 0;
-    if(ahp_xc_delaysize == 0 || ahp_xc_delaysize == 4)
-        return pow(2, 24);
-    return ahp_xc_delaysize * 17;
-}
+#define PHASE_CHUNK 32
+#define ATAN_MOREBITS 6.123233995736765886130E-17
+#define ATAN_P0 -8.750608600031904122785E-1
+#define ATAN_P1 -1.615753718733365076637E1
+#define ATAN_P2 -7.500855792314704667340E1
+#define ATAN_P3 -1.228866684490136173410E2
+#define ATAN_P4 -6.485021904942025371773E1
+#define ATAN_Q0 2.485846490142306297962E1
+#define ATAN_Q1 1.650270098316988542046E2
+#define ATAN_Q2 4.328810604912902668951E2
+#define ATAN_Q3 4.853903996359136964868E2
+#define ATAN_Q4 1.945506571482613964425E2
 
-uint32_t ahp_xc_get_autocorrelator_lagsize()
+/**
+* \brief magnitude and phase of count normalized complex samples
+* The phase is asin(re/magnitude), mirrored to 2pi-phase when im is negative, computed as
+* atan2(re, |im|) with the Cephes rational approximation of atan over [0, 1].
+* The vector kernels perform the same operations in the same order, so all give identical results.
+*/
+static void phase_magnitude_scalar(const double *re, const double *im, double *magnitude, double *phase, size_t count)
 {
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_auto_lagsize;
+    size_t x;
+    for(x = 0; x < count; x++) {
+        double cr = re[x];
+        double ci = im[x];
+        double ax = fabs(cr);
+        double ay = fabs(ci);
+        double den = ax > ay ? ax : ay;
+        double t = den > 0.0 ? (ax > ay ? ay : ax) / den : 0.0;
+        double y = 0.0, m = 0.0, z;
+        if(t > 0.66) {
+            y = M_PI_4;
+            m = 0.5 * ATAN_MOREBITS;
+            t = (t - 1.0) / (t + 1.0);
+        }
+        z = t * t;
+        z = z * ((((ATAN_P0 * z + ATAN_P1) * z + ATAN_P2) * z + ATAN_P3) * z + ATAN_P4) / (((((z + ATAN_Q0) * z + ATAN_Q1) * z + ATAN_Q2) * z + ATAN_Q3) * z + ATAN_Q4);
+        z = t * z + t;
+        z = (y + z) + m;
+        if(ax > ay)
+            z = M_PI_2 - z;
+        if(cr < 0.0)
+            z = -z;
+        if(ci < 0.0)
+            z = M_PI * 2.0 - z;
+        magnitude[x] = sqrt(cr * cr + ci * ci);
+        phase[x] = z;
+    }
 }
 
-uint32_t ahp_xc_get_crosscorrelator_lagsize()
+#ifdef AHP_XC_X86
+__attribute__((target("avx2")))
+static void phase_magnitude_avx2(const double *re, const double *im, double *magnitude, double *phase, size_t count)
 {
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_cross_lagsize;
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.0);
+    size_t x;
+    for(x = 0; x + 4 <= count; x += 4) {
+        __m256d cr = _mm256_loadu_pd(re + x);
+        __m256d ci = _mm256_loadu_pd(im + x);
+        __m256d ax = _mm256_andnot_pd(sign, cr);
+        __m256d ay = _mm256_andnot_pd(sign, ci);
+        __m256d swap = _mm256_cmp_pd(ax, ay, _CMP_GT_OQ);
+        __m256d den = _mm256_max_pd(ax, ay);
+        __m256d t = _mm256_div_pd(_mm256_min_pd(ax, ay), den);
+        t = _mm256_and_pd(t, _mm256_cmp_pd(den, zero, _CMP_GT_OQ));
+        __m256d big = _mm256_cmp_pd(t, _mm256_set1_pd(0.66), _CMP_GT_OQ);
+        __m256d y = _mm256_and_pd(big, _mm256_set1_pd(M_PI_4));
+        __m256d m = _mm256_and_pd(big, _mm256_set1_pd(0.5 * ATAN_MOREBITS));
+        t = _mm256_blendv_pd(t, _mm256_div_pd(_mm256_sub_pd(t, one), _mm256_add_pd(t, one)), big);
+        __m256d z = _mm256_mul_pd(t, t);
+        __m256d p = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(ATAN_P0), z), _mm256_set1_pd(ATAN_P1));
+        p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(ATAN_P2));
+        p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(ATAN_P3));
+        p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(ATAN_P4));
+        __m256d q = _mm256_add_pd(z, _mm256_set1_pd(ATAN_Q0));
+        q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(ATAN_Q1));
+        q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(ATAN_Q2));
+        q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(ATAN_Q3));
+        q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(ATAN_Q4));
+        z = _mm256_div_pd(_mm256_mul_pd(z, p), q);
+        z = _mm256_add_pd(_mm256_mul_pd(t, z), t);
+        z = _mm256_add_pd(_mm256_add_pd(y, z), m);
+        z = _mm256_blendv_pd(z, _mm256_sub_pd(_mm256_set1_pd(M_PI_2), z), swap);
+        z = _mm256_xor_pd(z, _mm256_and_pd(sign, _mm256_cmp_pd(cr, zero, _CMP_LT_OQ)));
+        z = _mm256_blendv_pd(z, _mm256_sub_pd(_mm256_set1_pd(M_PI * 2.0), z), _mm256_cmp_pd(ci, zero, _CMP_LT_OQ));
+        _mm256_storeu_pd(magnitude + x, _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(cr, cr), _mm256_mul_pd(ci, ci))));
+        _mm256_storeu_pd(phase + x, z);
+    }
+    phase_magnitude_scalar(re + x, im + x, magnitude + x, phase + x, count - x);
 }
+#endif
 
-double ahp_xc_get_frequency()
-{
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_frequency;
-}
+static void (*phase_magnitude)(const double *re, const double *im, double *magnitude, double *phase, size_t count) = phase_magnitude_scalar;
 
-double ahp_xc_get_sampletime()
-{
-    return (double)1.0/ahp_xc_get_frequency();
-}
+static uint32_t (*hex_pack)(const char *src, size_t len, unsigned char *dst) = hex_pack_scalar;
+static uint32_t (*hex_sum)(const char *src, size_t len) = hex_sum_scalar;
 
-double ahp_xc_get_packettime()
+static pthread_once_t hex_once = PTHREAD_ONCE_INIT;
+
+static void hex_setup()
 {
-    return 9.0  * (double)ahp_xc_get_packetsize() / (double)ahp_xc_get_baudrate();
+    int32_t x;
+    memset(hex_table, 0, sizeof(hex_table));
+    for(x = 0; x < 10; x++)
+        hex_table['0' + x] = (unsigned char)x;
+    for(x = 0; x < 6; x++) {
+        hex_table['A' + x] = (unsigned char)(10 + x);
+        hex_table['a' + x] = (unsigned char)(10 + x);
+    }
+    hex_pack = hex_pack_scalar;
+    hex_sum = hex_sum_scalar;
+    phase_magnitude = phase_magnitude_scalar;
+#ifdef AHP_XC_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        hex_pack = hex_pack_avx2;
+        hex_sum = hex_sum_avx2;
+        phase_magnitude = phase_magnitude_avx2;
+    } else if(__builtin_cpu_supports("sse4.1")) {
+        hex_pack = hex_pack_sse41;
+        hex_sum = hex_sum_sse41;
+    }
+#endif
 }
 
-uint32_t ahp_xc_get_packetsize()
+static void hex_init()
 {
-    return ahp_xc_packetsize;
+    pthread_once(&hex_once, hex_setup);
 }
 
-int32_t ahp_xc_get_fd()
+static uint64_t hex_value(const char *src, int32_t len)
 {
-    return ahp_serial_GetFD();
+    uint64_t value = 0;
+    while(len-- > 0)
+        value = (value << 4) | hex_table[(unsigned char)*src++];
+    return value;
 }
 
-int32_t ahp_xc_connect_fd(int32_t fd)
+/**
+* \brief read count fields of n hexadecimal digits each from bytes packed by hex_pack
+* n must be even, packed must be readable for 8 bytes past the last field.
+* When sign is non-zero the fields are two's complement numbers of sign*2 range and are sign extended.
+*/
+static void hex_unpack(const unsigned char *packed, int64_t *dst, size_t count, int32_t n, int64_t sign)
 {
-    if(ahp_xc_detected)
-        return 0;
-    ahp_xc_connected = 0;
-    ahp_xc_detected = 0;
-    ahp_xc_bps = 0;
-    ahp_xc_nlines = 0;
-    ahp_xc_nbaselines = 0;
-    ahp_xc_delaysize = 0;
-    ahp_xc_frequency = 0;
-    ahp_xc_packetsize = 1344;
-    ahp_xc_rate = R_BASE;
-    if(fd > -1) {
-        ahp_xc_connected = 1;
-        ahp_xc_detected = 0;
-        ahp_serial_SetFD(fd, XC_BASE_RATE);
-        if(!ahp_xc_mutexes_initialized) {
-            pthread_mutex_init(&ahp_xc_mutex, &ahp_serial_mutex_attr);
-            ahp_xc_mutexes_initialized = 1;
-        }
-        nthreads = 0;
-        xc_current_input = 0;
-        ahp_xc_get_properties();
+    size_t x;
+    int64_t v;
+    int32_t bytes = n / 2;
+    int32_t shift = (8 - bytes) * 8;
+    uint64_t word;
+    for(x = 0; x < count; x++, packed += bytes) {
+        memcpy(&word, packed, sizeof(uint64_t));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        v = (int64_t)(word >> shift);
+        dst[x] = v - ((v & sign) << 1);
     }
-    if(!ahp_xc_detected)
-        ahp_xc_disconnect();
-    ahp_xc_connected = ahp_xc_detected;
-    return !ahp_xc_detected;
 }
 
-int32_t ahp_xc_connect(const char *port)
+/**
+* \brief decode count fields of n hexadecimal digits each into dst
+* Fields with an even number of digits are packed into bytes by the vector kernel into scratch,
+* which must hold count*n/2+8 bytes, then read back as big endian words.
+*/
+static void hex_decode(const char *src, int64_t *dst, size_t count, int32_t n, int64_t sign, unsigned char *scratch)
 {
-    if(ahp_xc_detected)
-        return 0;
-    int32_t ret = 1;
-    ahp_xc_connected = 0;
-    ahp_xc_detected = 0;
-    ahp_xc_bps = 0;
-    ahp_xc_nlines = 0;
-    ahp_xc_nbaselines = 0;
-    ahp_xc_delaysize = 0;
-    ahp_xc_frequency = 0;
-    ahp_xc_packetsize = 1344;
-    strcpy(ahp_xc_comport, port);
-    int32_t try_high_rate = 1;
-    ahp_xc_baserate = XC_BASE_RATE;
-    ahp_xc_rate = R_BASE;
-    if(!ahp_serial_OpenComport(ahp_xc_comport))
-        ahp_xc_connected = 1;
-try_connect:
-        ret = ahp_serial_SetupPort(ahp_xc_get_baudrate(), "8N2", 0);
-    if(!ret) {
-        if(!ahp_xc_mutexes_initialized) {
-            pthread_mutex_init(&ahp_xc_mutex, &ahp_serial_mutex_attr);
-            ahp_xc_mutexes_initialized = 1;
+    size_t x;
+    int64_t v;
+    if((n & 1) || n > 16) {
+        for(x = 0; x < count; x++, src += n) {
+            v = (int64_t)hex_value(src, n);
+            dst[x] = v - ((v & sign) << 1);
         }
-        nthreads = 0;
-        xc_current_input = 0;
-        ahp_xc_get_properties();
+        return;
     }
-connect_end:
-    if(!ahp_xc_detected)
-        ahp_xc_disconnect();
-    ahp_xc_connected = ahp_xc_detected;
-    return !ahp_xc_detected;
+    hex_pack(src, count * n, scratch);
+    hex_unpack(scratch, dst, count, n, sign);
 }
-void ahp_xc_disconnect()
+
+static void correlations_phase_magnitude(ahp_xc_correlation *correlations, size_t count)
 {
-    if(ahp_xc_connected) {
-        if(ahp_xc_detected) {
-            ahp_xc_send_command(CLEAR, SET_INDEX);
-            ahp_xc_send_command(CLEAR, SET_LEDS);
-            ahp_xc_send_command(CLEAR, SET_BAUD_RATE);
-            ahp_xc_send_command(CLEAR, SET_VOLTAGE);
-            ahp_xc_send_command(CLEAR, SET_DELAY);
-            ahp_xc_send_command(CLEAR, ENABLE_TEST);
-            ahp_xc_send_command(CLEAR, CLEAR);
+    double re[PHASE_CHUNK], im[PHASE_CHUNK], magnitude[PHASE_CHUNK], phase[PHASE_CHUNK];
+    size_t x, y, len;
+    for(x = 0; x < count; x += len) {
+        len = count - x < PHASE_CHUNK ? count - x : PHASE_CHUNK;
+        for(y = 0; y < len; y++) {
+            re[y] = (double)correlations[x+y].real / correlations[x+y].counts;
+            im[y] = (double)correlations[x+y].imaginary / correlations[x+y].counts;
         }
-        if(ahp_xc_mutexes_initialized) {
-            pthread_mutex_unlock(&ahp_xc_mutex);
-            pthread_mutex_destroy(&ahp_xc_mutex);
-            ahp_xc_mutexes_initialized = 0;
+        phase_magnitude(re, im, magnitude, phase, len);
+        for(y = 0; y < len; y++) {
+            correlations[x+y].magnitude = magnitude[y];
+            correlations[x+y].phase = phase[y];
         }
-        free(ahp_xc_header);
-        ahp_xc_header_len = 0;
-        ahp_xc_connected = 0;
-        ahp_xc_detected = 0;
-        ahp_xc_bps = 0;
-        ahp_xc_nlines = 0;
-        ahp_xc_nbaselines = 0;
-        ahp_xc_delaysize = 0;
-        ahp_xc_frequency = 0;
-        ahp_xc_packetsize = 1344;
-        ahp_serial_CloseComport();
     }
 }
 
-uint32_t ahp_xc_is_connected()
+static void planes_phase_magnitude(ahp_xc_correlation_planes *planes, size_t first, size_t count)
 {
-    return ahp_xc_connected;
+    double re[PHASE_CHUNK], im[PHASE_CHUNK];
+    size_t x, y, len;
+    for(x = first; x < first + count; x += len) {
+        len = first + count - x < PHASE_CHUNK ? first + count - x : PHASE_CHUNK;
+        for(y = 0; y < len; y++) {
+            re[y] = (double)planes->real[x+y] / planes->counts[x+y];
+            im[y] = (double)planes->imaginary[x+y] / planes->counts[x+y];
+        }
+        phase_magnitude(re, im, &planes->magnitude[x], &planes->phase[x], len);
+    }
 }
 
-uint32_t ahp_xc_is_detected()
+static void planes_put_values(ahp_xc_correlation_planes *planes, uint32_t row, const int64_t *values, uint64_t counts, double offset, double lag, int32_t phase_mode)
 {
-    return ahp_xc_detected;
+    size_t first = (size_t)row * planes->lag_size;
+    size_t x;
+    planes->offset[row] = offset;
+    for(x = first; x < first + planes->lag_size; x++, values += 2) {
+        planes->real[x] = values[0];
+        planes->imaginary[x] = values[1];
+        planes->counts[x] = counts;
+        planes->lag[x] = lag;
+    }
+    if(phase_mode == PHASE_EAGER)
+        planes_phase_magnitude(planes, first, planes->lag_size);
 }
 
-ahp_xc_sample *ahp_xc_alloc_samples(uint64_t nlines, size_t size)
+static void planes_put_sample(ahp_xc_correlation_planes *planes, uint32_t row, const ahp_xc_sample *sample)
 {
-    uint64_t x, y;
-    ahp_xc_sample* samples = (ahp_xc_sample*)malloc(sizeof(ahp_xc_sample)*nlines);
-    memset(samples, 0, sizeof(ahp_xc_sample)*nlines);
-    for(x = 0; x < nlines; x++) {
-        samples[x].lag_size = size;
-        samples[x].correlations = (ahp_xc_correlation*)malloc(sizeof(ahp_xc_correlation)*size);
-        memset(samples[x].correlations, 0, sizeof(ahp_xc_correlation)*size);
+    size_t x = (size_t)row * planes->lag_size;
+    uint64_t y;
+    planes->offset[row] = sample->lag;
+    for(y = 0; y < planes->lag_size; y++, x++) {
+        planes->real[x] = sample->correlations[y].real;
+        planes->imaginary[x] = sample->correlations[y].imaginary;
+        planes->counts[x] = sample->correlations[y].counts;
+        planes->magnitude[x] = sample->correlations[y].magnitude;
+        planes->phase[x] = sample->correlations[y].phase;
+        planes->lag[x] = sample->correlations[y].lag;
     }
-    return samples;
 }
 
-ahp_xc_sample *ahp_xc_copy_samples(ahp_xc_sample* src, uint64_t nlines, size_t size)
+static void planes_get_sample(const ahp_xc_correlation_planes *planes, uint32_t row, ahp_xc_sample *sample)
 {
-    uint64_t x;
-    ahp_xc_sample* samples = ahp_xc_alloc_samples(nlines, size);
-    for(x = 0; x < nlines; x++) {
-        samples[x].lag = src[x].lag;
-        memcpy(samples[x].correlations, src[x].correlations, sizeof(ahp_xc_correlation)*size);
+    size_t x = (size_t)row * planes->lag_size;
+    uint64_t y;
+    sample->lag = planes->offset[row];
+    sample->lag_size = planes->lag_size;
+    for(y = 0; y < planes->lag_size; y++, x++) {
+        sample->correlations[y].real = planes->real[x];
+        sample->correlations[y].imaginary = planes->imaginary[x];
+        sample->correlations[y].counts = planes->counts[x];
+        sample->correlations[y].magnitude = planes->magnitude[x];
+        sample->correlations[y].phase = planes->phase[x];
+        sample->correlations[y].lag = planes->lag[x];
     }
-    return samples;
 }
 
-void ahp_xc_free_samples(uint64_t nlines, ahp_xc_sample *samples)
+double get_timestamp(ahp_xc_context *context, char *data)
 {
-    uint64_t x, y;
-    if(samples != NULL) {
-        for(x = 0; x < nlines; x++) {
-            if(samples[x].correlations != NULL) {
-                free(samples[x].correlations);
-            }
-        }
-        free(samples);
-    }
+    const char *timestamp = &data[context->packet_layout.timestamp_offset];
+    double ts = (double)hex_value(timestamp, 8) * 4.294967296;
+    return (double)ts + hex_value(&timestamp[8], 8) / 1000000000.0;
 }
 
-ahp_xc_packet *ahp_xc_alloc_packet()
+double ahp_xc_get_current_channel_auto(int n, const char *data)
 {
-    ahp_xc_packet *packet = (ahp_xc_packet*)malloc(sizeof(ahp_xc_packet));
-    packet->bps = (uint64_t)ahp_xc_get_bps();
-    packet->tau = (uint64_t)(1.0/ahp_xc_get_frequency());
-    packet->n_lines = (uint64_t)ahp_xc_get_nlines();
-    packet->n_baselines = (uint64_t)ahp_xc_get_nbaselines();
-    packet->auto_lag = ahp_xc_get_autocorrelator_lagsize();
-    packet->cross_lag = ahp_xc_get_crosscorrelator_lagsize()*2-1;
-    packet->counts = (uint64_t*)malloc((uint64_t)ahp_xc_get_nlines() * sizeof(uint64_t));
-    packet->autocorrelations = ahp_xc_alloc_samples((uint64_t)ahp_xc_get_nlines(), (uint64_t)ahp_xc_get_autocorrelator_lagsize());
-    packet->crosscorrelations = ahp_xc_alloc_samples((uint64_t)ahp_xc_get_nbaselines(), (uint64_t)ahp_xc_get_crosscorrelator_lagsize()*2-1);
-    packet->lock = malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(((pthread_mutex_t*)packet->lock), &ahp_serial_mutex_attr);
-    return packet;
+    ahp_xc_context *context = ahp_xc_current;
+    const char *message = &data[context->packet_layout.auto_channel_offset+context->packet_layout.channel_stride*n];
+    return (double)hex_value(message, fmin(context->packet_layout.channel_len, sizeof(uint32_t)*2));
 }
 
-ahp_xc_packet *ahp_xc_copy_packet(ahp_xc_packet *packet)
+double ahp_xc_get_current_channel_cross(int n, const char *data)
 {
-    ahp_xc_packet *copy = ahp_xc_alloc_packet();
-    copy->timestamp = packet->timestamp;
-    copy->bps = packet->bps;
-    copy->tau = packet->tau;
-    copy->n_lines = packet->n_lines;
-    copy->n_baselines = packet->n_baselines;
-    copy->auto_lag = packet->auto_lag;
-    copy->cross_lag = packet->cross_lag;
-    copy->counts = (uint64_t*)malloc((uint64_t)copy->n_lines * sizeof(uint64_t));
-    memcpy(copy->counts, packet->counts, sizeof(uint64_t) * (uint64_t)copy->n_lines);
-    ahp_xc_free_samples(copy->n_lines, copy->autocorrelations);
-    ahp_xc_free_samples(copy->n_baselines, copy->crosscorrelations);
-    copy->autocorrelations = ahp_xc_copy_samples(packet->autocorrelations, copy->n_lines, copy->auto_lag);
-    copy->crosscorrelations = ahp_xc_copy_samples(packet->crosscorrelations, copy->n_baselines, copy->cross_lag);
-    return copy;
+    ahp_xc_context *context = ahp_xc_current;
+    const char *message = &data[context->packet_layout.cross_channel_offset+context->packet_layout.channel_stride*n];
+    return (double)hex_value(message, fmin(context->packet_layout.channel_len, sizeof(uint32_t)*2));
 }
 
-void ahp_xc_free_packet(ahp_xc_packet *packet)
+int32_t calc_checksum(ahp_xc_context *context, char *data)
 {
-    if(packet != NULL) {
-        if(packet->counts != NULL)
-            free(packet->counts);
-        pthread_mutex_destroy(((pthread_mutex_t*)packet->lock));
-        free(packet->lock);
-        ahp_xc_free_samples((uint64_t)packet->n_lines, packet->autocorrelations);
-        ahp_xc_free_samples((uint64_t)packet->n_baselines, packet->crosscorrelations);
-        free(packet);
+    if(!context->connected) return -ENOENT;
+    const ahp_xc_layout *layout = &context->packet_layout;
+    uint32_t checksum = (uint32_t)hex_value(&data[layout->checksum_offset], 2);
+    uint32_t calculated_checksum = hex_sum(&data[layout->counts_offset], layout->checksum_offset-layout->counts_offset) & 0xff;
+    if(checksum != calculated_checksum) {
+        return EINVAL;
     }
+    return 0;
 }
 
-void ahp_xc_start_autocorrelation_scan(uint32_t index)
+int32_t check_sof(ahp_xc_context *context, char *data)
 {
-    if(!ahp_xc_detected) return;
-    ahp_xc_set_capture_flags((ahp_xc_get_capture_flags()|CAP_RESET_TIMESTAMP)&~CAP_ENABLE);
-    ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)|SCAN_AUTO);
+    if(!context->connected) return -ENOENT;
+    int32_t x;
+    for(x = 0; x < context->header_len; x++) {
+        if(data[x] != 'F')
+            return 0;
+    }
+    return 1;
 }
 
-void ahp_xc_end_autocorrelation_scan(uint32_t index)
+static void frame_reset(ahp_xc_context *context, int32_t flush)
 {
-    if(!ahp_xc_detected) return;
-    ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)&~SCAN_AUTO);
+    if(flush)
+        ahp_serial_flushRX(context->port);
+    context->rx_len = 0;
+    context->rx_synced = 0;
 }
 
-static void* _get_autocorrelation(void *o)
+static int32_t ring_push(packet_ring *ring, const char *frame)
+{
+    uint64_t head = ring->head;
+    uint32_t occupancy = (uint32_t)(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    if(occupancy >= ring->depth) {
+        __atomic_add_fetch(&ring->overflows, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    memcpy(&ring->slots[(head & (ring->depth - 1)) * ring->slot_size], frame, ring->slot_size);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    if(++occupancy > ring->max_occupancy)
+        __atomic_store_n(&ring->max_occupancy, occupancy, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ring->packets, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int32_t ring_pop(packet_ring *ring, char *frame)
+{
+    uint64_t tail = ring->tail;
+    if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+        return 1;
+    memcpy(frame, &ring->slots[(tail & (ring->depth - 1)) * ring->slot_size], ring->slot_size);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void *stream_reader(void *arg)
+{
+    ahp_xc_context *context = (ahp_xc_context*)arg;
+    context_bind(context);
+    uint32_t size = context->ring.slot_size;
+    char *frame = context->ring.frame;
+    char *start, *end;
+    size_t len = 0;
+    int32_t timeout = AHP_XC_MIN(ahp_serial_RecvTimeout(context->port, size), 100);
+    while(__atomic_load_n(&context->streaming, __ATOMIC_ACQUIRE)) {
+        int32_t n = ahp_serial_RecvAvailable(context->port, (unsigned char*)frame + len, size * 2 - len, timeout);
+        if(n < 0) {
+            usleep(timeout * 1000);
+            continue;
+        }
+        len += n;
+        int32_t pushed = 0;
+        start = frame;
+        while((end = (char*)memchr(start, '\r', frame + len - start)) != NULL) {
+            if(end - start + 1 == size)
+                pushed |= !ring_push(&context->ring, start);
+            else
+                __atomic_add_fetch(&context->ring.malformed, 1, __ATOMIC_RELAXED);
+            start = end + 1;
+        }
+        len -= start - frame;
+        memmove(frame, start, len);
+        if(len >= size) {
+            __atomic_add_fetch(&context->ring.malformed, 1, __ATOMIC_RELAXED);
+            len = 0;
+        }
+        if(pushed) {
+            pthread_mutex_lock(&context->stream_mutex);
+            pthread_cond_broadcast(&context->stream_cond);
+            pthread_mutex_unlock(&context->stream_mutex);
+        }
+    }
+    return arg;
+}
+
+static void deadline_after(struct timespec *deadline, int32_t timeout)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (long)(timeout % 1000) * 1000000;
+    if(deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static int32_t stream_pop(ahp_xc_context *context, char *buf, uint32_t size)
+{
+    struct timespec deadline;
+    int32_t timeout = ahp_serial_RecvTimeout(context->port, size);
+    int32_t err = 0;
+    if(!ring_pop(&context->ring, buf))
+        return size;
+    deadline_after(&deadline, timeout);
+    pthread_mutex_lock(&context->stream_mutex);
+    while(ring_pop(&context->ring, buf)) {
+        if(!context->streaming || err == ETIMEDOUT) {
+            pthread_mutex_unlock(&context->stream_mutex);
+            return -ENODATA;
+        }
+        err = pthread_cond_timedwait(&context->stream_cond, &context->stream_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&context->stream_mutex);
+    return size;
+}
+
+int32_t ahp_xc_start_streaming(uint32_t depth)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return -ENOENT;
+    if(context->streaming) return -EBUSY;
+    if(context->replay.map != NULL) return -EINVAL;
+    uint32_t slots = 2;
+    while(slots < depth)
+        slots <<= 1;
+    memset(&context->ring, 0, sizeof(packet_ring));
+    context->ring.slot_size = ahp_xc_get_packetsize();
+    context->ring.depth = slots;
+    context->ring.slots = (char*)malloc((size_t)slots * context->ring.slot_size);
+    context->ring.frame = (char*)malloc((size_t)context->ring.slot_size * 2);
+    if(context->ring.slots == NULL || context->ring.frame == NULL) {
+        free(context->ring.slots);
+        free(context->ring.frame);
+        context->ring.slots = NULL;
+        context->ring.frame = NULL;
+        return -ENOMEM;
+    }
+    context->streaming = 1;
+    if(pthread_create(&context->stream_thread, NULL, stream_reader, context)) {
+        context->streaming = 0;
+        free(context->ring.slots);
+        free(context->ring.frame);
+        context->ring.slots = NULL;
+        context->ring.frame = NULL;
+        return -EAGAIN;
+    }
+    return 0;
+}
+
+void ahp_xc_stop_streaming()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->streaming) return;
+    __atomic_store_n(&context->streaming, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&context->stream_mutex);
+    pthread_cond_broadcast(&context->stream_cond);
+    pthread_mutex_unlock(&context->stream_mutex);
+    pthread_join(context->stream_thread, NULL);
+    free(context->ring.slots);
+    free(context->ring.frame);
+    context->ring.slots = NULL;
+    context->ring.frame = NULL;
+    frame_reset(context, 0);
+}
+
+int32_t ahp_xc_is_streaming()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    return context->streaming;
+}
+
+void ahp_xc_get_stream_status(ahp_xc_stream_status *status)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(status == NULL) return;
+    memset(status, 0, sizeof(ahp_xc_stream_status));
+    if(!context->streaming) return;
+    uint64_t head = __atomic_load_n(&context->ring.head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&context->ring.tail, __ATOMIC_ACQUIRE);
+    status->depth = context->ring.depth;
+    status->occupancy = (uint32_t)(head - tail);
+    status->max_occupancy = __atomic_load_n(&context->ring.max_occupancy, __ATOMIC_RELAXED);
+    status->packets = __atomic_load_n(&context->ring.packets, __ATOMIC_RELAXED);
+    status->overflows = __atomic_load_n(&context->ring.overflows, __ATOMIC_RELAXED);
+    status->malformed = __atomic_load_n(&context->ring.malformed, __ATOMIC_RELAXED);
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int32_t ahp_xc_start_recording(const char *filename)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return -ENOENT;
+    if(context->recorder.file != NULL) return -EBUSY;
+    if(context->replay.map != NULL) return -EINVAL;
+    FILE *file = fopen(filename, "wb");
+    if(file == NULL)
+        return -errno;
+    record_file_header *header = &context->recorder.header;
+    memset(header, 0, sizeof(record_file_header));
+    memcpy(header->magic, AHP_XC_RECORD_MAGIC, sizeof(header->magic));
+    header->version = AHP_XC_RECORD_VERSION;
+    header->header_len = context->header_len;
+    header->packet_size = ahp_xc_get_packetsize();
+    header->record_size = (sizeof(record_header) + header->packet_size + 7) & ~7;
+    header->index_interval = AHP_XC_RECORD_INDEX_INTERVAL;
+    header->data_offset = (sizeof(record_file_header) + header->header_len + 1 + 7) & ~7;
+    header->realtime_start = clock_ns(CLOCK_REALTIME);
+    context->recorder.padding = (unsigned char*)calloc(header->data_offset + header->record_size, 1);
+    if(context->recorder.padding == NULL) {
+        fclose(file);
+        return -ENOMEM;
+    }
+    memcpy(context->recorder.padding, header, sizeof(record_file_header));
+    memcpy(context->recorder.padding + sizeof(record_file_header), context->header, header->header_len);
+    if(fwrite(context->recorder.padding, header->data_offset, 1, file) != 1) {
+        free(context->recorder.padding);
+        context->recorder.padding = NULL;
+        fclose(file);
+        return -EIO;
+    }
+    memset(context->recorder.padding, 0, header->data_offset);
+    context->recorder.records = 0;
+    context->recorder.index = NULL;
+    context->recorder.index_count = 0;
+    context->recorder.index_size = 0;
+    context->recorder.error = 0;
+    context->recorder.file = file;
+    return 0;
+}
+
+static void recorder_close(ahp_xc_context *context)
+{
+    packet_recorder *recorder = &context->recorder;
+    if(recorder->file == NULL) return;
+    record_file_header *header = &recorder->header;
+    header->index_count = recorder->index_count;
+    header->index_offset = header->data_offset + recorder->records * header->record_size;
+    int32_t failed = fwrite(recorder->index, sizeof(record_index), header->index_count, recorder->file) != header->index_count;
+    if(!failed)
+        failed = fseek(recorder->file, 0, SEEK_SET) || fwrite(header, sizeof(record_file_header), 1, recorder->file) != 1;
+    if(fclose(recorder->file))
+        failed = 1;
+    if(failed && !recorder->error)
+        recorder->error = -EIO;
+    free(recorder->index);
+    free(recorder->padding);
+    recorder->file = NULL;
+    recorder->index = NULL;
+    recorder->padding = NULL;
+    recorder->index_count = 0;
+    recorder->index_size = 0;
+}
+
+static void record_packet(ahp_xc_context *context, const char *data)
+{
+    packet_recorder *recorder = &context->recorder;
+    record_header record;
+    uint32_t size = recorder->header.packet_size;
+    record.monotonic = clock_ns(CLOCK_MONOTONIC);
+    record.realtime = clock_ns(CLOCK_REALTIME);
+    record.timestamp = get_timestamp(context, (char*)data);
+    size_t padding = recorder->header.record_size - sizeof(record_header) - size;
+    errno = 0;
+    if(fwrite(&record, sizeof(record_header), 1, recorder->file) != 1 ||
+       fwrite(data, size - 1, 1, recorder->file) != 1 ||
+       fputc('\r', recorder->file) == EOF ||
+       (padding > 0 && fwrite(recorder->padding, padding, 1, recorder->file) != 1)) {
+        recorder->error = errno ? -errno : -EIO;
+        recorder_close(context);
+        return;
+    }
+    if(recorder->records % recorder->header.index_interval == 0) {
+        if(recorder->index_count == recorder->index_size) {
+            uint64_t index_size = recorder->index_size ? recorder->index_size * 2 : 64;
+            record_index *index = (record_index*)realloc(recorder->index, sizeof(record_index) * index_size);
+            if(index != NULL) {
+                recorder->index = index;
+                recorder->index_size = index_size;
+            }
+        }
+        if(recorder->index_count < recorder->index_size) {
+            recorder->index[recorder->index_count].timestamp = record.timestamp;
+            recorder->index[recorder->index_count].offset = recorder->header.data_offset + recorder->records * recorder->header.record_size;
+            recorder->index_count++;
+        }
+    }
+    recorder->records++;
+}
+
+void ahp_xc_stop_recording()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    recorder_close(context);
+}
+
+int32_t ahp_xc_is_recording()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    return context->recorder.file != NULL;
+}
+
+int32_t ahp_xc_get_recording_error()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    return context->recorder.error;
+}
+
+static const record_header *replay_record(ahp_xc_context *context, uint64_t n)
+{
+    return (const record_header*)(context->replay.map + context->replay.header->data_offset + n * context->replay.header->record_size);
+}
+
+static void replay_rebase(ahp_xc_context *context)
+{
+    context->replay.base_host = clock_ns(CLOCK_MONOTONIC);
+    if(context->replay.next < context->replay.records)
+        context->replay.base_record = replay_record(context, context->replay.next)->monotonic;
+}
+
+void ahp_xc_close_replay()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(context->replay.map == NULL) return;
+#ifndef WINDOWS
+    munmap((void*)context->replay.map, context->replay.map_size);
+#else
+    free((void*)context->replay.map);
+#endif
+    memset(&context->replay, 0, sizeof(packet_replay));
+}
+
+static int32_t replay_open(ahp_xc_context *context, const char *filename, double speed)
+{
+    size_t size = 0;
+    unsigned char *map = NULL;
+    FILE *file = fopen(filename, "rb");
+    if(file == NULL)
+        return -errno;
+    fseek(file, 0, SEEK_END);
+    size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(size < sizeof(record_file_header)) {
+        fclose(file);
+        return -EINVAL;
+    }
+#ifndef WINDOWS
+    map = (unsigned char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if(map == MAP_FAILED) {
+        fclose(file);
+        return -errno;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+#else
+    map = (unsigned char*)malloc(size);
+    if(map == NULL || fread(map, size, 1, file) != 1) {
+        free(map);
+        fclose(file);
+        return -EIO;
+    }
+#endif
+    fclose(file);
+    context->replay.map = map;
+    context->replay.map_size = size;
+    const record_file_header *header = (const record_file_header*)map;
+    if(memcmp(header->magic, AHP_XC_RECORD_MAGIC, sizeof(header->magic)) || header->version != AHP_XC_RECORD_VERSION ||
+            header->record_size < sizeof(record_header) + header->packet_size || header->data_offset > size) {
+        ahp_xc_close_replay();
+        return -EINVAL;
+    }
+    uint64_t end = size;
+    if(header->index_offset >= header->data_offset && header->index_offset + header->index_count * sizeof(record_index) <= size) {
+        context->replay.index = (const record_index*)(map + header->index_offset);
+        end = header->index_offset;
+    }
+    context->replay.header = header;
+    context->replay.records = (end - header->data_offset) / header->record_size;
+    context->replay.speed = speed;
+    context->replay.next = 0;
+    replay_rebase(context);
+    return 0;
+}
+
+static int32_t replay_pop(ahp_xc_context *context, char *buf, uint32_t size)
+{
+    packet_replay *replay = &context->replay;
+    if(replay->next >= replay->records) {
+        errno = ENODATA;
+        return 0;
+    }
+    const record_header *record = replay_record(context, replay->next++);
+    if(replay->speed > 0) {
+        uint64_t due = replay->base_host + (uint64_t)((double)(record->monotonic - replay->base_record) / replay->speed);
+        uint64_t now = clock_ns(CLOCK_MONOTONIC);
+        if(due > now)
+            usleep((due - now) / 1000);
+    }
+    size = fmin(size, replay->header->packet_size);
+    memcpy(buf, (const char*)(record + 1), size);
+    return size;
+}
+
+int32_t ahp_xc_replay_seek(double timestamp)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    packet_replay *replay = &context->replay;
+    if(replay->map == NULL) return -ENOENT;
+    uint64_t first = 0;
+    if(replay->index != NULL && replay->header->index_count > 0) {
+        uint64_t lo = 0, hi = replay->header->index_count;
+        while(hi - lo > 1) {
+            uint64_t mid = (lo + hi) / 2;
+            if(replay->index[mid].timestamp <= timestamp)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        first = (replay->index[lo].offset - replay->header->data_offset) / replay->header->record_size;
+    }
+    while(first < replay->records && replay_record(context, first)->timestamp < timestamp)
+        first++;
+    replay->next = first;
+    replay_rebase(context);
+    return first < replay->records ? 0 : -ERANGE;
+}
+
+uint64_t ahp_xc_get_replay_length()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    return context->replay.records;
+}
+
+static uint64_t rx_errors(ahp_xc_context *context)
+{
+    return context->rx_discarded + __atomic_load_n(&context->ring.malformed, __ATOMIC_RELAXED);
+}
+
+static void link_switch_settle(ahp_xc_context *context)
+{
+    uint64_t errors = rx_errors(context);
+    context->link.switch_lost = errors > context->link_switch_mark ? (uint32_t)(errors - context->link_switch_mark) : 0;
+}
+
+static void frame_consume(ahp_xc_context *context, uint32_t len)
+{
+    context->rx_len -= len;
+    memmove(context->rx_buffer, context->rx_buffer + len, context->rx_len);
+}
+
+static int32_t frame_recv(ahp_xc_context *context, char *buf, uint32_t size)
+{
+    if(context->rx_size < size) {
+        char *rx = (char*)realloc(context->rx_buffer, size);
+        if(rx == NULL)
+            return -ENOMEM;
+        context->rx_buffer = rx;
+        context->rx_size = size;
+    }
+    if(context->rx_len > size)
+        frame_reset(context, 0);
+    while(1) {
+        char *rx = context->rx_buffer;
+        char *end = (char*)memchr(rx, '\r', context->rx_len);
+        if(!context->rx_synced) {
+            if(end == NULL) {
+                context->rx_len = 0;
+            } else {
+                frame_consume(context, end - rx + 1);
+                context->rx_synced = 1;
+                continue;
+            }
+        } else if(!context->detected) {
+            if(context->rx_len == size) {
+                memcpy(buf, rx, size);
+                frame_reset(context, 0);
+                return size;
+            }
+        } else if(end != NULL) {
+            uint32_t len = end - rx + 1;
+            if(len == size && (check_sof(context, rx) || !strncmp(context->header, rx, context->header_len))) {
+                memcpy(buf, rx, size);
+                frame_consume(context, size);
+                return size;
+            }
+            frame_consume(context, len);
+            context->rx_discarded++;
+            continue;
+        } else if(context->rx_len == size) {
+            frame_reset(context, 0);
+            context->rx_discarded++;
+        }
+        int32_t n = ahp_serial_RecvBuf(context->port, (unsigned char*)rx + context->rx_len, size - context->rx_len);
+        if(n < 1)
+            return n;
+        context->rx_len += n;
+    }
+}
+
+static char * grab_packet(ahp_xc_context *context, char *buf, double *timestamp, int32_t verify)
+{
+    errno = 0;
+    uint32_t size = ahp_xc_get_packetsize();
+    memset(buf, 0, (unsigned int)size);
+    if(!context->connected){
+        errno = ENOENT;
+        goto err_end;
+    }
+    int32_t nread = 0;
+    if(context->replay.map != NULL)
+        nread = replay_pop(context, buf, size);
+    else if(context->streaming)
+        nread = stream_pop(context, buf, size);
+    else
+        nread = frame_recv(context, buf, size);
+    if(buf[0] == '\0' || buf[0] == '\r' || buf[0] == '\n')
+        goto err_end;
+    buf[nread-1] = 0;
+    nread = strlen((char*)buf);
+    if(nread == 0) {
+        errno = ENODATA;
+    } else if(nread < 0) {
+        errno = ETIMEDOUT;
+    } else if(nread > context->header_len) {
+        char *tmp = buf;
+        if(context->header_len > 0 && strncmp(context->header, (char*)tmp, context->header_len)) {
+            errno = EINVAL;
+        } else if(check_sof(context, (char*)buf)) {
+            errno = 0;
+        } else if(nread < size-1) {
+            errno = ERANGE;
+        } else if(verify) {
+            errno = calc_checksum(context, (char*)buf);
+        }
+    }
+    if(nread == 0 || errno)
+        goto err_end;
+    if(context->link_switch_pending) {
+        link_switch_settle(context);
+        context->link_switch_pending = 0;
+    }
+    if(timestamp != NULL)
+        *timestamp = get_timestamp(context, buf);
+    return buf;
+err_end:
+    fprintf(stderr, "%s error: %s\n", __func__, strerror(errno));
+    return NULL;
+}
+
+static int32_t nibble_count(uint64_t value)
+{
+    int32_t len = 1;
+    while(value >>= 4)
+        len++;
+    return len;
+}
+
+static size_t shadow_size(uint32_t nlines)
+{
+    return nlines * (sizeof(int64_t) * 6 + sizeof(int32_t) * 3);
+}
+
+static void shadow_alloc(ahp_xc_context *context, uint32_t nlines)
+{
+    int64_t *delay = (int64_t*)realloc(context->shadow.delay, shadow_size(nlines));
+    if(delay == NULL) {
+        if(context->shadow.delay)
+            memset(context->shadow.delay, 0xff, shadow_size(context->shadow.lines));
+        return;
+    }
+    context->shadow.delay = delay;
+    context->shadow.lines = nlines;
+    context->shadow.test = (int32_t*)(context->shadow.delay + nlines * 6);
+    context->shadow.leds = context->shadow.test + nlines;
+    context->shadow.voltage = context->shadow.leds + nlines;
+    memset(context->shadow.delay, 0xff, shadow_size(nlines));
+}
+
+void ahp_xc_invalidate_device_state()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    context->shadow.index = -1;
+    context->shadow.capture = -1;
+    context->shadow.order = -1;
+    if(context->shadow.delay)
+        memset(context->shadow.delay, 0xff, shadow_size(context->shadow.lines));
+}
+
+void ahp_xc_get_command_stats(ahp_xc_command_stats *stats)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(stats == NULL) return;
+    stats->sent = context->shadow.sent;
+    stats->suppressed = context->shadow.suppressed;
+}
+
+static int32_t flush_commands(ahp_xc_context *context)
+{
+    int32_t err = 0;
+    if(context->replay.map != NULL)
+        context->command_len = 0;
+    if(context->command_len > 0) {
+        int sent = ahp_serial_SendBuf(context->port, context->command_buffer, (int)context->command_len);
+        if(sent > 0)
+            context->shadow.sent += sent;
+        if(sent < (int)context->command_len) {
+            ahp_xc_invalidate_device_state();
+            err = -EIO;
+        }
+        ahp_serial_DrainTX(context->port);
+    }
+    context->command_len = 0;
+    return err;
+}
+
+void ahp_xc_begin_commands()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    context->command_depth++;
+}
+
+int32_t ahp_xc_append_command(xc_cmd cmd, unsigned char value)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->connected) return -ENOENT;
+    if(context->command_len == context->command_size) {
+        size_t size = context->command_size ? context->command_size * 2 : 64;
+        unsigned char *buffer = (unsigned char*)realloc(context->command_buffer, size);
+        if(buffer == NULL)
+            return -ENOMEM;
+        context->command_buffer = buffer;
+        context->command_size = size;
+    }
+    context->command_buffer[context->command_len++] = (unsigned char)(cmd|(value<<4));
+    if(cmd == CLEAR && value == SET_DELAY && context->current_input >= 0 && (uint32_t)context->current_input < context->shadow.lines) {
+        int32_t cross = (context->capture_flags & CAP_EXTRA_CMD) != 0;
+        memset(&context->shadow.delay[(context->current_input*2+cross)*3], 0xff, sizeof(int64_t)*3);
+    }
+    return 0;
+}
+
+int32_t ahp_xc_commit_commands()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(context->command_depth > 0)
+        context->command_depth--;
+    if(context->command_depth > 0)
+        return 0;
+    if(!context->connected) {
+        context->command_len = 0;
+        return -ENOENT;
+    }
+    return flush_commands(context);
+}
+
+int32_t ahp_xc_send_command(xc_cmd cmd, unsigned char value)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->connected) return -ENOENT;
+    int32_t err = ahp_xc_append_command(cmd, value);
+    if(err || context->command_depth > 0)
+        return err;
+    return flush_commands(context);
+}
+
+uint32_t ahp_xc_current_input()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    return context->current_input;
+}
+
+void ahp_xc_select_input(uint32_t index)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
+    int32_t idx = 0;
+    if(index >= ahp_xc_get_nlines())
+        return;
+    int len = nibble_count(ahp_xc_get_nlines());
+    context->current_input = index;
+    if(context->shadow.index == (int32_t)index) {
+        context->shadow.suppressed += len + 2;
+        return;
+    }
+    context->shadow.index = index;
+    ahp_xc_begin_commands();
+    ahp_xc_send_command(CLEAR, SET_INDEX);
+    ahp_xc_send_command(SET_INDEX, (unsigned char)(len&0xf));
+    for(idx = 0; idx < len; idx ++) {
+        ahp_xc_send_command(SET_INDEX, (unsigned char)(index&0xf));
+        index >>= 4;
+    }
+    ahp_xc_commit_commands();
+}
+
+void ahp_xc_enable_crosscorrelator(int32_t enable)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
+    context->correlator_enabled = enable;
+}
+
+void ahp_xc_enable_intensity_crosscorrelator(int32_t enable)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
+    context->intensity_correlator_enabled = enable;
+}
+
+int32_t ahp_xc_intensity_crosscorrelator_enabled()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return context->intensity_correlator_enabled != 0 || !ahp_xc_has_crosscorrelator();
+}
+
+int32_t ahp_xc_has_crosscorrelator()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return (context->flags & HAS_CROSSCORRELATOR ? context->correlator_enabled : 0);
+}
+
+int32_t ahp_xc_has_psu()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return (context->flags & HAS_PSU ? 1 : 0);
+}
+
+int32_t ahp_xc_has_leds()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return (context->flags & HAS_LEDS ? 1 : 0);
+}
+
+int32_t ahp_xc_has_cumulative_only()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return (context->flags & HAS_CUMULATIVE_ONLY ? 1 : 0);
+}
+
+char* ahp_xc_get_header()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return context->header;
+}
+
+int32_t ahp_xc_get_baudrate()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    return context->baserate << context->rate;
+}
+
+int32_t ahp_xc_get_actual_baudrate()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(context->replay.map != NULL || ahp_serial_GetFD(context->port) == -1 || ahp_serial_GetBaudrate(context->port) <= 0)
+        return ahp_xc_get_baudrate();
+    return ahp_serial_GetBaudrate(context->port);
+}
+
+uint32_t ahp_xc_get_bps()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return context->bps;
+}
+
+uint32_t ahp_xc_get_nlines()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return context->nlines;
+}
+
+uint32_t ahp_xc_get_nbaselines()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return ahp_xc_get_nlines() * (ahp_xc_get_nlines() - 1) / 2;
+}
+
+uint32_t ahp_xc_get_npolytopes(int32_t order)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return ahp_xc_get_nlines() * (ahp_xc_get_nlines() - order + 1) / order;
+}
+
+uint32_t ahp_xc_get_delaysize()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    if(context->delaysize == 0 || context->delaysize == 4)
+        return pow(2, 24);
+    return context->delaysize * 17;
+}
+
+uint32_t ahp_xc_get_autocorrelator_lagsize()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return context->auto_lagsize;
+}
+
+uint32_t ahp_xc_get_crosscorrelator_lagsize()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return context->cross_lagsize;
+}
+
+double ahp_xc_get_frequency()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return context->frequency;
+}
+
+double ahp_xc_get_sampletime()
+{
+    return (double)1.0/ahp_xc_get_frequency();
+}
+
+double ahp_xc_get_packettime()
+{
+    return 9.0  * (double)ahp_xc_get_packetsize() / (double)ahp_xc_get_actual_baudrate();
+}
+
+uint32_t ahp_xc_get_packetsize()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    return context->packetsize;
+}
+
+const ahp_xc_layout *ahp_xc_get_layout()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return NULL;
+    return &context->packet_layout;
+}
+
+int32_t ahp_xc_get_fd()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    return ahp_serial_GetFD(context->port);
+}
+
+int32_t ahp_xc_connect_fd(int32_t fd)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(context->detected)
+        return 0;
+    context->connected = 0;
+    context->detected = 0;
+    context->bps = 0;
+    context->nlines = 0;
+    context->nbaselines = 0;
+    context->delaysize = 0;
+    context->frequency = 0;
+    context->packetsize = 1344;
+    context->rate = R_BASE;
+    if(fd > -1) {
+        context->connected = 1;
+        context->detected = 0;
+        ahp_serial_SetFD(context->port, fd, XC_BASE_RATE);
+        if(!context->mutexes_initialized) {
+            pthread_mutex_init(&context->mutex, &context->port->mutex_attr);
+            context->mutexes_initialized = 1;
+        }
+        context->current_input = 0;
+        ahp_xc_invalidate_device_state();
+        frame_reset(context, 0);
+        ahp_xc_get_properties();
+    }
+    if(context->detected && context->link_max_multiplier > 1)
+        ahp_xc_negotiate_baudrate(context->link_max_multiplier, context->link_burst, context->link_max_error_rate);
+    if(!context->detected)
+        ahp_xc_disconnect();
+    context->connected = context->detected;
+    return !context->detected;
+}
+
+int32_t ahp_xc_connect_replay(const char *filename, double speed)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(context->detected)
+        return 0;
+    context->connected = 0;
+    context->detected = 0;
+    context->bps = 0;
+    context->nlines = 0;
+    context->nbaselines = 0;
+    context->delaysize = 0;
+    context->frequency = 0;
+    context->packetsize = 1344;
+    context->rate = R_BASE;
+    if(!replay_open(context, filename, speed)) {
+        context->connected = 1;
+        ahp_serial_InitMutexes(context->port);
+        if(!context->mutexes_initialized) {
+            pthread_mutex_init(&context->mutex, &context->port->mutex_attr);
+            context->mutexes_initialized = 1;
+        }
+        context->current_input = 0;
+        ahp_xc_invalidate_device_state();
+        frame_reset(context, 0);
+        ahp_xc_get_properties();
+        context->replay.next = 0;
+        replay_rebase(context);
+    }
+    if(!context->detected)
+        ahp_xc_disconnect();
+    context->connected = context->detected;
+    return !context->detected;
+}
+
+int32_t ahp_xc_connect(const char *port)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(context->detected)
+        return 0;
+    int32_t ret = 1;
+    context->connected = 0;
+    context->detected = 0;
+    context->bps = 0;
+    context->nlines = 0;
+    context->nbaselines = 0;
+    context->delaysize = 0;
+    context->frequency = 0;
+    context->packetsize = 1344;
+    strcpy(context->comport, port);
+    context->baserate = XC_BASE_RATE;
+    context->rate = R_BASE;
+    if(!ahp_serial_OpenComport(context->port, context->comport))
+        context->connected = 1;
+    ret = ahp_serial_SetupPort(context->port, ahp_xc_get_baudrate(), "8N2", 0);
+    if(!ret) {
+        if(!context->mutexes_initialized) {
+            pthread_mutex_init(&context->mutex, &context->port->mutex_attr);
+            context->mutexes_initialized = 1;
+        }
+        context->current_input = 0;
+        ahp_xc_invalidate_device_state();
+        frame_reset(context, 0);
+        ahp_xc_get_properties();
+    }
+    if(context->detected && context->link_max_multiplier > 1)
+        ahp_xc_negotiate_baudrate(context->link_max_multiplier, context->link_burst, context->link_max_error_rate);
+    if(!context->detected)
+        ahp_xc_disconnect();
+    context->connected = context->detected;
+    return !context->detected;
+}
+void ahp_xc_disconnect()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    ahp_xc_stop_streaming();
+    ahp_xc_stop_recording();
+    pool_stop(&context->pool);
+    if(context->connected) {
+        if(context->detected) {
+            ahp_xc_begin_commands();
+            ahp_xc_send_command(CLEAR, SET_INDEX);
+            ahp_xc_send_command(CLEAR, SET_LEDS);
+            ahp_xc_send_command(CLEAR, SET_BAUD_RATE);
+            ahp_xc_send_command(CLEAR, SET_VOLTAGE);
+            ahp_xc_send_command(CLEAR, SET_DELAY);
+            ahp_xc_send_command(CLEAR, ENABLE_TEST);
+            ahp_xc_send_command(CLEAR, CLEAR);
+            ahp_xc_commit_commands();
+        }
+        ahp_xc_invalidate_device_state();
+        frame_reset(context, 0);
+        if(context->mutexes_initialized) {
+            pthread_mutex_unlock(&context->mutex);
+            pthread_mutex_destroy(&context->mutex);
+            context->mutexes_initialized = 0;
+        }
+        free(context->header);
+        context->header_len = 0;
+        context->connected = 0;
+        context->detected = 0;
+        context->bps = 0;
+        context->nlines = 0;
+        context->nbaselines = 0;
+        context->delaysize = 0;
+        context->frequency = 0;
+        context->packetsize = 1344;
+        memset(&context->link, 0, sizeof(ahp_xc_link_status));
+        context->link_switch_pending = 0;
+        ahp_xc_close_replay();
+        ahp_serial_CloseComport(context->port);
+    }
+}
+
+uint32_t ahp_xc_is_connected()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    return context->connected;
+}
+
+uint32_t ahp_xc_is_detected()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    return context->detected;
+}
+
+ahp_xc_context *ahp_xc_alloc_context()
+{
+    ahp_xc_context *context = (ahp_xc_context*)malloc(sizeof(ahp_xc_context));
+    ahp_serial_port *port = (ahp_serial_port*)malloc(sizeof(ahp_serial_port));
+    if(context == NULL || port == NULL) {
+        free(context);
+        free(port);
+        return NULL;
+    }
+    *port = (ahp_serial_port)AHP_SERIAL_PORT_INITIALIZER;
+    *context = (ahp_xc_context)AHP_XC_CONTEXT_INITIALIZER(port);
+    pthread_mutex_init(&context->pool.mutex, NULL);
+    pthread_cond_init(&context->pool.work, NULL);
+    pthread_cond_init(&context->pool.done, NULL);
+    pthread_mutex_init(&context->stream_mutex, NULL);
+    pthread_cond_init(&context->stream_cond, NULL);
+    return context;
+}
+
+void ahp_xc_free_context(ahp_xc_context *context)
+{
+    if(context == NULL || context == &ahp_xc_default_context) return;
+    ahp_xc_context *previous = ahp_xc_set_context(context);
+    ahp_xc_disconnect();
+    pool_stop(&context->pool);
+    ahp_xc_free_samples(context->line_samples_len, context->line_samples);
+    ahp_xc_free_samples(1, context->planar_sample);
+    free(context->test);
+    free(context->leds);
+    free(context->auto_channel);
+    free(context->cross_channel);
+    baselines_free(&context->baselines);
+    free(context->decode_scratch);
+    free(context->packed_payload);
+    free(context->auto_args);
+    free(context->cross_args);
+    free(context->auto_threads);
+    free(context->cross_threads);
+    free(context->command_buffer);
+    free(context->rx_buffer);
+    free(context->shadow.delay);
+    ahp_xc_set_context(previous == context ? NULL : previous);
+    pthread_mutex_destroy(&context->pool.mutex);
+    pthread_cond_destroy(&context->pool.work);
+    pthread_cond_destroy(&context->pool.done);
+    pthread_mutex_destroy(&context->stream_mutex);
+    pthread_cond_destroy(&context->stream_cond);
+    free(context->port);
+    free(context);
+}
+
+ahp_xc_context *ahp_xc_set_context(ahp_xc_context *context)
+{
+    ahp_xc_context *previous = ahp_xc_current;
+    context_bind(context != NULL ? context : &ahp_xc_default_context);
+    return previous;
+}
+
+ahp_xc_context *ahp_xc_get_context()
+{
+    return ahp_xc_current;
+}
+
+#define CONTEXT_CALL(type, name, params, args) \
+type ahp_xc_context_##name params \
+{ \
+    ahp_xc_context *previous = ahp_xc_set_context(context); \
+    type ret = ahp_xc_##name args; \
+    ahp_xc_set_context(previous); \
+    return ret; \
+}
+
+#define CONTEXT_CALL_VOID(name, params, args) \
+void ahp_xc_context_##name params \
+{ \
+    ahp_xc_context *previous = ahp_xc_set_context(context); \
+    ahp_xc_##name args; \
+    ahp_xc_set_context(previous); \
+}
+
+CONTEXT_CALL(int32_t, connect, (ahp_xc_context *context, const char *port), (port))
+CONTEXT_CALL(int32_t, connect_fd, (ahp_xc_context *context, int32_t fd), (fd))
+CONTEXT_CALL(int32_t, connect_replay, (ahp_xc_context *context, const char *filename, double speed), (filename, speed))
+CONTEXT_CALL_VOID(disconnect, (ahp_xc_context *context), ())
+CONTEXT_CALL(uint32_t, is_detected, (ahp_xc_context *context), ())
+CONTEXT_CALL(uint32_t, get_nlines, (ahp_xc_context *context), ())
+CONTEXT_CALL(uint32_t, get_nbaselines, (ahp_xc_context *context), ())
+CONTEXT_CALL(uint32_t, get_delaysize, (ahp_xc_context *context), ())
+CONTEXT_CALL(uint32_t, get_autocorrelator_lagsize, (ahp_xc_context *context), ())
+CONTEXT_CALL(uint32_t, get_crosscorrelator_lagsize, (ahp_xc_context *context), ())
+CONTEXT_CALL(double, get_frequency, (ahp_xc_context *context), ())
+CONTEXT_CALL(double, get_packettime, (ahp_xc_context *context), ())
+CONTEXT_CALL(const ahp_xc_layout*, get_layout, (ahp_xc_context *context), ())
+CONTEXT_CALL(uint64_t, max_threads, (ahp_xc_context *context, uint64_t value), (value))
+CONTEXT_CALL(ahp_xc_packet*, alloc_packet, (ahp_xc_context *context), ())
+CONTEXT_CALL(int32_t, get_packet, (ahp_xc_context *context, ahp_xc_packet *packet), (packet))
+CONTEXT_CALL(ahp_xc_planar_packet*, alloc_planar_packet, (ahp_xc_context *context), ())
+CONTEXT_CALL(int32_t, get_planar_packet, (ahp_xc_context *context, ahp_xc_planar_packet *packet), (packet))
+CONTEXT_CALL(int32_t, start_streaming, (ahp_xc_context *context, uint32_t depth), (depth))
+CONTEXT_CALL_VOID(stop_streaming, (ahp_xc_context *context), ())
+CONTEXT_CALL(int32_t, start_recording, (ahp_xc_context *context, const char *filename), (filename))
+CONTEXT_CALL_VOID(stop_recording, (ahp_xc_context *context), ())
+CONTEXT_CALL(int32_t, is_recording, (ahp_xc_context *context), ())
+CONTEXT_CALL(int32_t, get_recording_error, (ahp_xc_context *context), ())
+CONTEXT_CALL(int32_t, scan_autocorrelations, (ahp_xc_context *context, ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **autocorrelations, int32_t *interrupt, double *percent), (lines, nlines, autocorrelations, interrupt, percent))
+CONTEXT_CALL(int32_t, scan_autocorrelations_adaptive, (ahp_xc_context *context, ahp_xc_scan_request *lines, uint32_t nlines, uint32_t factor, double threshold, ahp_xc_sample **autocorrelations, uint32_t *counts, int32_t *interrupt, double *percent), (lines, nlines, factor, threshold, autocorrelations, counts, interrupt, percent))
+CONTEXT_CALL(int32_t, scan_autocorrelations_to_file, (ahp_xc_context *context, ahp_xc_scan_request *lines, uint32_t nlines, const char *filename, int32_t *interrupt, double *percent), (lines, nlines, filename, interrupt, percent))
+CONTEXT_CALL(int32_t, scan_autocorrelations_stream, (ahp_xc_context *context, ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_scan_callback callback, void *user, int32_t *interrupt, double *percent), (lines, nlines, callback, user, interrupt, percent))
+CONTEXT_CALL(int32_t, scan_crosscorrelations, (ahp_xc_context *context, ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **crosscorrelations, int32_t *interrupt, double *percent), (lines, nlines, crosscorrelations, interrupt, percent))
+CONTEXT_CALL(int32_t, set_capture_flags, (ahp_xc_context *context, xc_capture_flags flags), (flags))
+CONTEXT_CALL_VOID(set_test_flags, (ahp_xc_context *context, uint32_t index, int32_t value), (index, value))
+CONTEXT_CALL_VOID(set_channel_auto, (ahp_xc_context *context, uint32_t index, off_t value, size_t size, size_t step), (index, value, size, step))
+CONTEXT_CALL_VOID(set_channel_cross, (ahp_xc_context *context, uint32_t index, off_t value, size_t size, size_t step), (index, value, size, step))
+CONTEXT_CALL_VOID(select_input, (ahp_xc_context *context, uint32_t index), (index))
+CONTEXT_CALL_VOID(set_leds, (ahp_xc_context *context, uint32_t index, int32_t leds), (index, leds))
+CONTEXT_CALL_VOID(set_voltage, (ahp_xc_context *context, uint32_t index, unsigned char value), (index, value))
+CONTEXT_CALL_VOID(set_baudrate, (ahp_xc_context *context, baud_rate rate), (rate))
+CONTEXT_CALL_VOID(set_link_negotiation, (ahp_xc_context *context, uint32_t max_multiplier, uint32_t burst, double max_error_rate), (max_multiplier, burst, max_error_rate))
+CONTEXT_CALL(int32_t, negotiate_baudrate, (ahp_xc_context *context, uint32_t max_multiplier, uint32_t burst, double max_error_rate), (max_multiplier, burst, max_error_rate))
+CONTEXT_CALL_VOID(get_link_status, (ahp_xc_context *context, ahp_xc_link_status *status), (status))
+CONTEXT_CALL(int32_t, set_correlation_order, (ahp_xc_context *context, uint32_t order), (order))
+CONTEXT_CALL(int32_t, send_command, (ahp_xc_context *context, xc_cmd cmd, unsigned char value), (cmd, value))
+CONTEXT_CALL_VOID(get_command_stats, (ahp_xc_context *context, ahp_xc_command_stats *stats), (stats))
+
+static void *merge_reader(void *arg)
+{
+    merge_stream *stream = (merge_stream*)arg;
+    ahp_xc_context *context = stream->context;
+    ahp_xc_merge *merge = stream->merge;
+    ahp_xc_packet *packet = NULL;
+    context_bind(context);
+    while(__atomic_load_n(&merge->running, __ATOMIC_ACQUIRE)) {
+        if(!context->detected || !context->connected)
+            break;
+        if(context->replay.map != NULL && context->replay.next >= context->replay.records)
+            break;
+        if(packet == NULL)
+            packet = ahp_xc_packet_pool_get(stream->pool);
+        if(packet == NULL) {
+            pthread_mutex_lock(&merge->mutex);
+            stream->starved = 1;
+            pthread_cond_broadcast(&merge->ready);
+            while(merge->running && (packet = ahp_xc_packet_pool_get(stream->pool)) == NULL)
+                pthread_cond_wait(&merge->space, &merge->mutex);
+            stream->starved = 0;
+            pthread_mutex_unlock(&merge->mutex);
+            continue;
+        }
+        if(ahp_xc_get_packet(packet)) {
+            __atomic_add_fetch(&stream->status.errors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        pthread_mutex_lock(&merge->mutex);
+        if(merge->has_emitted && packet->timestamp <= merge->emitted + merge->tolerance) {
+            stream->status.late++;
+        } else {
+            stream->queue[(stream->head + stream->count) % merge->depth] = packet;
+            stream->count++;
+            stream->status.packets++;
+            if(packet->timestamp > merge->newest)
+                merge->newest = packet->timestamp;
+            packet = NULL;
+            pthread_cond_broadcast(&merge->ready);
+        }
+        pthread_mutex_unlock(&merge->mutex);
+    }
+    ahp_xc_packet_pool_put(stream->pool, packet);
+    pthread_mutex_lock(&merge->mutex);
+    stream->ended = 1;
+    pthread_cond_broadcast(&merge->ready);
+    pthread_mutex_unlock(&merge->mutex);
+    return arg;
+}
+
+static int32_t merge_ready(ahp_xc_merge *merge, double *timestamp)
+{
+    uint32_t x;
+    int32_t found = 0, force = 0;
+    double first = 0;
+    for(x = 0; x < merge->n_streams; x++) {
+        merge_stream *stream = &merge->streams[x];
+        if(stream->count == 0)
+            continue;
+        double ts = stream->queue[stream->head]->timestamp;
+        if(!found || ts < first)
+            first = ts;
+        found = 1;
+        force |= stream->starved;
+    }
+    if(!found)
+        return 0;
+    for(x = 0; x < merge->n_streams; x++) {
+        merge_stream *stream = &merge->streams[x];
+        if(stream->count > 0 || stream->ended || force || merge->newest - first > merge->window)
+            continue;
+        return 0;
+    }
+    *timestamp = first;
+    return 1;
+}
+
+static void merge_emit(ahp_xc_merge *merge, double timestamp)
+{
+    uint32_t x;
+    uint32_t slot = (merge->group_head + merge->group_count) % merge->depth;
+    ahp_xc_packet_group *group = &merge->groups[slot];
+    group->timestamp = timestamp;
+    group->sequence = merge->sequence++;
+    group->missing = 0;
+    for(x = 0; x < merge->n_streams; x++) {
+        merge_stream *stream = &merge->streams[x];
+        if(stream->count > 0 && stream->queue[stream->head]->timestamp <= timestamp + merge->tolerance) {
+            group->packets[x] = stream->queue[stream->head];
+            stream->head = (stream->head + 1) % merge->depth;
+            stream->count--;
+        } else {
+            group->packets[x] = NULL;
+            group->missing++;
+            stream->status.gaps++;
+        }
+    }
+    merge->group_count++;
+    merge->emitted = timestamp;
+    merge->has_emitted = 1;
+    pthread_cond_broadcast(&merge->available);
+}
+
+static void *merge_worker(void *arg)
+{
+    ahp_xc_merge *merge = (ahp_xc_merge*)arg;
+    uint32_t x;
+    double timestamp;
+    pthread_mutex_lock(&merge->mutex);
+    while(merge->running) {
+        if(!merge_ready(merge, &timestamp)) {
+            for(x = 0; x < merge->n_streams && merge->streams[x].ended; x++);
+            if(x == merge->n_streams)
+                break;
+            pthread_cond_wait(&merge->ready, &merge->mutex);
+            continue;
+        }
+        while(merge->running && merge->group_count == merge->depth)
+            pthread_cond_wait(&merge->space, &merge->mutex);
+        if(merge->running)
+            merge_emit(merge, timestamp);
+    }
+    merge->finished = 1;
+    pthread_cond_broadcast(&merge->available);
+    pthread_mutex_unlock(&merge->mutex);
+    return arg;
+}
+
+static void merge_free(ahp_xc_merge *merge)
+{
+    uint32_t x;
+    for(x = 0; x < merge->n_streams; x++) {
+        ahp_xc_free_packet_pool(merge->streams[x].pool);
+        free(merge->streams[x].queue);
+    }
+    pthread_mutex_destroy(&merge->mutex);
+    pthread_cond_destroy(&merge->ready);
+    pthread_cond_destroy(&merge->space);
+    pthread_cond_destroy(&merge->available);
+    free(merge->streams);
+    free(merge->groups);
+    free(merge->group_packets);
+    free(merge);
+}
+
+ahp_xc_merge *ahp_xc_merge_start(ahp_xc_context **contexts, uint32_t n_streams, uint32_t depth, double tolerance, double window)
+{
+    uint32_t x, y;
+    if(contexts == NULL || n_streams == 0 || depth < 2 || tolerance < 0 || window < 0)
+        return NULL;
+    for(x = 0; x < n_streams; x++) {
+        if(contexts[x] == NULL || !contexts[x]->detected)
+            return NULL;
+        for(y = 0; y < x; y++)
+            if(contexts[y] == contexts[x])
+                return NULL;
+    }
+    ahp_xc_merge *merge = (ahp_xc_merge*)calloc(1, sizeof(ahp_xc_merge));
+    if(merge == NULL)
+        return NULL;
+    merge->n_streams = n_streams;
+    merge->depth = depth;
+    merge->tolerance = tolerance;
+    merge->window = window;
+    pthread_mutex_init(&merge->mutex, NULL);
+    pthread_cond_init(&merge->ready, NULL);
+    pthread_cond_init(&merge->space, NULL);
+    pthread_cond_init(&merge->available, NULL);
+    merge->streams = (merge_stream*)calloc(n_streams, sizeof(merge_stream));
+    merge->groups = (ahp_xc_packet_group*)calloc(depth, sizeof(ahp_xc_packet_group));
+    merge->group_packets = (ahp_xc_packet**)calloc((size_t)depth * n_streams, sizeof(ahp_xc_packet*));
+    if(merge->streams == NULL || merge->groups == NULL || merge->group_packets == NULL) {
+        merge_free(merge);
+        return NULL;
+    }
+    for(x = 0; x < depth; x++) {
+        merge->groups[x].n_streams = n_streams;
+        merge->groups[x].packets = &merge->group_packets[x * n_streams];
+    }
+    for(x = 0; x < n_streams; x++) {
+        merge_stream *stream = &merge->streams[x];
+        ahp_xc_context *previous = ahp_xc_set_context(contexts[x]);
+        stream->pool = ahp_xc_alloc_packet_pool(depth);
+        ahp_xc_set_context(previous);
+        stream->queue = (ahp_xc_packet**)calloc(depth, sizeof(ahp_xc_packet*));
+        stream->context = contexts[x];
+        stream->merge = merge;
+        if(stream->pool == NULL || stream->queue == NULL) {
+            merge_free(merge);
+            return NULL;
+        }
+    }
+    merge->running = 1;
+    for(x = 0; x < n_streams; x++) {
+        if(pthread_create(&merge->streams[x].thread, NULL, merge_reader, &merge->streams[x]))
+            break;
+    }
+    if(x < n_streams || pthread_create(&merge->thread, NULL, merge_worker, merge)) {
+        __atomic_store_n(&merge->running, 0, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&merge->mutex);
+        pthread_cond_broadcast(&merge->space);
+        pthread_mutex_unlock(&merge->mutex);
+        for(y = 0; y < x; y++)
+            pthread_join(merge->streams[y].thread, NULL);
+        merge_free(merge);
+        return NULL;
+    }
+    return merge;
+}
+
+void ahp_xc_merge_stop(ahp_xc_merge *merge)
+{
+    uint32_t x;
+    if(merge == NULL)
+        return;
+    pthread_mutex_lock(&merge->mutex);
+    __atomic_store_n(&merge->running, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&merge->ready);
+    pthread_cond_broadcast(&merge->space);
+    pthread_cond_broadcast(&merge->available);
+    pthread_mutex_unlock(&merge->mutex);
+    pthread_join(merge->thread, NULL);
+    for(x = 0; x < merge->n_streams; x++)
+        pthread_join(merge->streams[x].thread, NULL);
+    merge_free(merge);
+}
+
+ahp_xc_packet_group *ahp_xc_merge_alloc_group(ahp_xc_merge *merge)
+{
+    if(merge == NULL)
+        return NULL;
+    ahp_xc_packet_group *group = (ahp_xc_packet_group*)calloc(1, sizeof(ahp_xc_packet_group));
+    if(group == NULL)
+        return NULL;
+    group->n_streams = merge->n_streams;
+    group->packets = (ahp_xc_packet**)calloc(merge->n_streams, sizeof(ahp_xc_packet*));
+    if(group->packets == NULL) {
+        free(group);
+        return NULL;
+    }
+    return group;
+}
+
+void ahp_xc_merge_release_group(ahp_xc_merge *merge, ahp_xc_packet_group *group)
+{
+    uint32_t x;
+    int32_t released = 0;
+    if(merge == NULL || group == NULL || group->n_streams != merge->n_streams)
+        return;
+    for(x = 0; x < group->n_streams; x++) {
+        if(group->packets[x] == NULL)
+            continue;
+        ahp_xc_packet_pool_put(merge->streams[x].pool, group->packets[x]);
+        group->packets[x] = NULL;
+        released = 1;
+    }
+    if(released) {
+        pthread_mutex_lock(&merge->mutex);
+        pthread_cond_broadcast(&merge->space);
+        pthread_mutex_unlock(&merge->mutex);
+    }
+}
+
+void ahp_xc_merge_free_group(ahp_xc_merge *merge, ahp_xc_packet_group *group)
+{
+    if(group == NULL)
+        return;
+    ahp_xc_merge_release_group(merge, group);
+    free(group->packets);
+    free(group);
+}
+
+int32_t ahp_xc_merge_get_group(ahp_xc_merge *merge, ahp_xc_packet_group *group, int32_t timeout)
+{
+    struct timespec deadline;
+    int32_t err = 0;
+    if(merge == NULL || group == NULL || group->n_streams != merge->n_streams)
+        return -EINVAL;
+    ahp_xc_merge_release_group(merge, group);
+    if(timeout >= 0)
+        deadline_after(&deadline, timeout);
+    pthread_mutex_lock(&merge->mutex);
+    while(merge->group_count == 0) {
+        if(merge->finished || err == ETIMEDOUT) {
+            pthread_mutex_unlock(&merge->mutex);
+            return merge->finished ? -ENODATA : -ETIMEDOUT;
+        }
+        if(timeout >= 0)
+            err = pthread_cond_timedwait(&merge->available, &merge->mutex, &deadline);
+        else
+            pthread_cond_wait(&merge->available, &merge->mutex);
+    }
+    ahp_xc_packet_group *next = &merge->groups[merge->group_head];
+    group->timestamp = next->timestamp;
+    group->sequence = next->sequence;
+    group->missing = next->missing;
+    memcpy(group->packets, next->packets, sizeof(ahp_xc_packet*) * merge->n_streams);
+    merge->group_head = (merge->group_head + 1) % merge->depth;
+    merge->group_count--;
+    pthread_cond_broadcast(&merge->space);
+    pthread_mutex_unlock(&merge->mutex);
+    return 0;
+}
+
+int32_t ahp_xc_merge_get_status(ahp_xc_merge *merge, uint32_t stream, ahp_xc_merge_status *status)
+{
+    if(merge == NULL || status == NULL || stream >= merge->n_streams)
+        return -EINVAL;
+    pthread_mutex_lock(&merge->mutex);
+    *status = merge->streams[stream].status;
+    status->errors = __atomic_load_n(&merge->streams[stream].status.errors, __ATOMIC_RELAXED);
+    status->pending = merge->streams[stream].count;
+    status->ended = merge->streams[stream].ended;
+    pthread_mutex_unlock(&merge->mutex);
+    return 0;
+}
+
+ahp_xc_sample *ahp_xc_alloc_samples(uint64_t nlines, size_t size)
+{
+    uint64_t x, y;
+    ahp_xc_sample* samples = (ahp_xc_sample*)malloc(sizeof(ahp_xc_sample)*nlines);
+    memset(samples, 0, sizeof(ahp_xc_sample)*nlines);
+    for(x = 0; x < nlines; x++) {
+        samples[x].lag_size = size;
+        samples[x].correlations = (ahp_xc_correlation*)malloc(sizeof(ahp_xc_correlation)*size);
+        memset(samples[x].correlations, 0, sizeof(ahp_xc_correlation)*size);
+    }
+    return samples;
+}
+
+ahp_xc_sample *ahp_xc_copy_samples(ahp_xc_sample* src, uint64_t nlines, size_t size)
+{
+    uint64_t x;
+    uint64_t y;
+    ahp_xc_sample* samples = ahp_xc_alloc_samples(nlines, size);
+    for(x = 0; x < nlines; x++) {
+        samples[x].lag = src[x].lag;
+        memcpy(samples[x].correlations, src[x].correlations, sizeof(ahp_xc_correlation)*size);
+        for(y = 0; y < size; y++) {
+            ahp_xc_correlation *correlation = &samples[x].correlations[y];
+            size_t capacity = fmax(correlation->num_indexes, ahp_xc_get_nlines());
+            if(correlation->indexes != NULL) {
+                correlation->indexes = (int*)malloc(sizeof(int)*capacity);
+                memcpy(correlation->indexes, src[x].correlations[y].indexes, sizeof(int)*correlation->num_indexes);
+            }
+            if(correlation->lags != NULL) {
+                correlation->lags = (double*)malloc(sizeof(double)*capacity);
+                memcpy(correlation->lags, src[x].correlations[y].lags, sizeof(double)*correlation->num_indexes);
+            }
+        }
+    }
+    return samples;
+}
+
+void ahp_xc_free_samples(uint64_t nlines, ahp_xc_sample *samples)
+{
+    uint64_t x, y;
+    if(samples != NULL) {
+        for(x = 0; x < nlines; x++) {
+            if(samples[x].correlations != NULL) {
+                for(y = 0; y < samples[x].lag_size; y++) {
+                    free(samples[x].correlations[y].indexes);
+                    free(samples[x].correlations[y].lags);
+                }
+                free(samples[x].correlations);
+            }
+        }
+        free(samples);
+    }
+}
+
+typedef struct {
+    ahp_xc_packet packet;
+    ahp_xc_packet_pool *pool;
+    uint32_t pool_index;
+} packet_arena;
+
+struct ahp_xc_packet_pool {
+    uint32_t size;
+    uint64_t head;
+    uint32_t *next;
+    ahp_xc_packet **packets;
+};
+
+static void *arena_take(unsigned char **cursor, size_t size)
+{
+    void *ptr = *cursor;
+    *cursor += (size + 63) & ~(size_t)63;
+    return ptr;
+}
+
+/**
+* \brief fill the geometry of a packet sized for the device of the context
+*/
+static void packet_shape(ahp_xc_context *context, ahp_xc_packet *shape)
+{
+    shape->bps = (uint64_t)ahp_xc_get_bps();
+    shape->tau = (uint64_t)(1.0/ahp_xc_get_frequency());
+    shape->n_lines = ahp_xc_get_nlines();
+    shape->n_baselines = ahp_xc_get_nbaselines();
+    shape->auto_lag = ahp_xc_get_autocorrelator_lagsize();
+    shape->cross_lag = ahp_xc_get_crosscorrelator_lagsize()*2-1;
+    shape->buf_len = context->packetsize;
+}
+
+/**
+* \brief carve a packet and all of its arrays from a single block
+* The geometry is taken from shape, with a NULL arena only the cursor is advanced, which measures the block size.
+* The correlations of a baseline share its indexes and lags, which are the same at every lag.
+*/
+static size_t packet_carve(ahp_xc_context *context, const ahp_xc_packet *shape, unsigned char *arena)
+{
+    uint64_t nlines = shape->n_lines;
+    uint64_t nbaselines = shape->n_baselines;
+    uint64_t auto_lag = shape->auto_lag;
+    uint64_t cross_lag = shape->cross_lag;
+    unsigned char *cursor = arena;
+    uint64_t x, y;
+    packet_arena *packet = (packet_arena*)arena_take(&cursor, sizeof(packet_arena));
+    pthread_mutex_t *lock = (pthread_mutex_t*)arena_take(&cursor, sizeof(pthread_mutex_t));
+    uint64_t *counts = (uint64_t*)arena_take(&cursor, sizeof(uint64_t)*nlines);
+    ahp_xc_sample *autocorrelations = (ahp_xc_sample*)arena_take(&cursor, sizeof(ahp_xc_sample)*nlines);
+    ahp_xc_sample *crosscorrelations = (ahp_xc_sample*)arena_take(&cursor, sizeof(ahp_xc_sample)*nbaselines);
+    ahp_xc_correlation *correlations = (ahp_xc_correlation*)arena_take(&cursor, sizeof(ahp_xc_correlation)*(nlines*auto_lag+nbaselines*cross_lag));
+    int *indexes = (int*)arena_take(&cursor, sizeof(int)*nbaselines*nlines);
+    double *lags = (double*)arena_take(&cursor, sizeof(double)*nbaselines*nlines);
+    char *buf = (char*)arena_take(&cursor, shape->buf_len);
+    if(arena == NULL)
+        return (size_t)(cursor - arena);
+    packet->packet.bps = shape->bps;
+    packet->packet.tau = shape->tau;
+    packet->packet.n_lines = nlines;
+    packet->packet.n_baselines = nbaselines;
+    packet->packet.auto_lag = auto_lag;
+    packet->packet.cross_lag = cross_lag;
+    packet->packet.counts = counts;
+    packet->packet.autocorrelations = autocorrelations;
+    packet->packet.crosscorrelations = crosscorrelations;
+    packet->packet.buf = buf;
+    packet->packet.buf_len = shape->buf_len;
+    packet->packet.lock = lock;
+    for(x = 0; x < nlines; x++, correlations += auto_lag) {
+        autocorrelations[x].lag_size = auto_lag;
+        autocorrelations[x].correlations = correlations;
+    }
+    for(x = 0; x < nbaselines; x++, correlations += cross_lag, indexes += nlines, lags += nlines) {
+        crosscorrelations[x].lag_size = cross_lag;
+        crosscorrelations[x].correlations = correlations;
+        for(y = 0; y < cross_lag; y++) {
+            correlations[y].indexes = indexes;
+            correlations[y].lags = lags;
+        }
+    }
+    pthread_mutex_init(lock, &context->port->mutex_attr);
+    return (size_t)(cursor - arena);
+}
+
+static ahp_xc_packet *packet_alloc(ahp_xc_context *context, const ahp_xc_packet *shape)
+{
+    size_t size = packet_carve(context, shape, NULL);
+    unsigned char *arena = (unsigned char*)malloc(size);
+    if(arena == NULL)
+        return NULL;
+    memset(arena, 0, size);
+    packet_carve(context, shape, arena);
+    return (ahp_xc_packet*)arena;
+}
+
+ahp_xc_packet *ahp_xc_alloc_packet()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    ahp_xc_packet shape;
+    packet_shape(context, &shape);
+    return packet_alloc(context, &shape);
+}
+
+static void copy_correlations(ahp_xc_sample *dst, const ahp_xc_sample *src, uint64_t rows, uint64_t lag_size)
+{
+    uint64_t x, y;
+    for(x = 0; x < rows; x++) {
+        dst[x].lag = src[x].lag;
+        for(y = 0; y < lag_size; y++) {
+            ahp_xc_correlation *correlation = &dst[x].correlations[y];
+            int *indexes = correlation->indexes;
+            double *lags = correlation->lags;
+            *correlation = src[x].correlations[y];
+            correlation->indexes = indexes;
+            correlation->lags = lags;
+            if(indexes != NULL && src[x].correlations[y].indexes != NULL)
+                memcpy(indexes, src[x].correlations[y].indexes, sizeof(int)*correlation->num_indexes);
+            if(lags != NULL && src[x].correlations[y].lags != NULL)
+                memcpy(lags, src[x].correlations[y].lags, sizeof(double)*correlation->num_indexes);
+        }
+    }
+}
+
+ahp_xc_packet *ahp_xc_copy_packet(ahp_xc_packet *packet)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(packet == NULL)
+        return NULL;
+    ahp_xc_packet *copy = packet_alloc(context, packet);
+    if(copy == NULL)
+        return NULL;
+    copy->timestamp = packet->timestamp;
+    memcpy(copy->counts, packet->counts, sizeof(uint64_t) * (uint64_t)copy->n_lines);
+    memcpy((char*)copy->buf, packet->buf, copy->buf_len);
+    copy_correlations(copy->autocorrelations, packet->autocorrelations, copy->n_lines, copy->auto_lag);
+    copy_correlations(copy->crosscorrelations, packet->crosscorrelations, copy->n_baselines, copy->cross_lag);
+    return copy;
+}
+
+void ahp_xc_free_packet(ahp_xc_packet *packet)
+{
+    if(packet != NULL) {
+        packet_arena *arena = (packet_arena*)packet;
+        if(arena->pool != NULL) {
+            ahp_xc_packet_pool_put(arena->pool, packet);
+            return;
+        }
+        pthread_mutex_destroy(((pthread_mutex_t*)packet->lock));
+        free(packet);
+    }
+}
+
+void ahp_xc_free_packet_pool(ahp_xc_packet_pool *pool)
+{
+    uint32_t x;
+    if(pool == NULL)
+        return;
+    for(x = 0; x < pool->size; x++) {
+        ((packet_arena*)pool->packets[x])->pool = NULL;
+        ahp_xc_free_packet(pool->packets[x]);
+    }
+    free(pool->packets);
+    free(pool->next);
+    free(pool);
+}
+
+ahp_xc_packet_pool *ahp_xc_alloc_packet_pool(uint32_t size)
+{
+    uint32_t x;
+    if(size == 0)
+        return NULL;
+    ahp_xc_packet_pool *pool = (ahp_xc_packet_pool*)calloc(1, sizeof(ahp_xc_packet_pool));
+    if(pool == NULL)
+        return NULL;
+    pool->next = (uint32_t*)malloc(sizeof(uint32_t)*size);
+    pool->packets = (ahp_xc_packet**)malloc(sizeof(ahp_xc_packet*)*size);
+    if(pool->next == NULL || pool->packets == NULL) {
+        ahp_xc_free_packet_pool(pool);
+        return NULL;
+    }
+    for(x = 0; x < size; x++) {
+        pool->packets[x] = ahp_xc_alloc_packet();
+        if(pool->packets[x] == NULL) {
+            ahp_xc_free_packet_pool(pool);
+            return NULL;
+        }
+        pool->size = x + 1;
+        ((packet_arena*)pool->packets[x])->pool = pool;
+        ((packet_arena*)pool->packets[x])->pool_index = x;
+        pool->next[x] = x + 1 < size ? x + 2 : 0;
+    }
+    pool->head = 1;
+    return pool;
+}
+
+ahp_xc_packet *ahp_xc_packet_pool_get(ahp_xc_packet_pool *pool)
+{
+    if(pool == NULL)
+        return NULL;
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    uint32_t index;
+    do {
+        index = (uint32_t)head;
+        if(index == 0)
+            return NULL;
+        next = (((head >> 32) + 1) << 32) | __atomic_load_n(&pool->next[index-1], __ATOMIC_RELAXED);
+    } while(!__atomic_compare_exchange_n(&pool->head, &head, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return pool->packets[index-1];
+}
+
+void ahp_xc_packet_pool_put(ahp_xc_packet_pool *pool, ahp_xc_packet *packet)
+{
+    if(pool == NULL || packet == NULL)
+        return;
+    packet_arena *arena = (packet_arena*)packet;
+    if(arena->pool != pool)
+        return;
+    uint32_t index = arena->pool_index + 1;
+    uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do {
+        __atomic_store_n(&pool->next[index-1], (uint32_t)head, __ATOMIC_RELAXED);
+        next = (((head >> 32) + 1) << 32) | index;
+    } while(!__atomic_compare_exchange_n(&pool->head, &head, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+static unsigned char *planes_carve(ahp_xc_correlation_planes *planes, uint64_t rows, uint64_t lag_size, unsigned char *storage)
+{
+    size_t plane = (rows * lag_size * sizeof(int64_t) + 63) & ~63;
+    planes->rows = rows;
+    planes->lag_size = lag_size;
+    planes->real = (int64_t*)storage;
+    planes->imaginary = (int64_t*)(storage + plane);
+    planes->counts = (uint64_t*)(storage + plane * 2);
+    planes->magnitude = (double*)(storage + plane * 3);
+    planes->phase = (double*)(storage + plane * 4);
+    planes->lag = (double*)(storage + plane * 5);
+    planes->offset = (double*)(storage + plane * 6);
+    return storage + plane * 6 + ((rows * sizeof(double) + 63) & ~63);
+}
+
+ahp_xc_planar_packet *ahp_xc_alloc_planar_packet()
+{
+    ahp_xc_context *context = ahp_xc_current;
+    ahp_xc_planar_packet *packet = (ahp_xc_planar_packet*)malloc(sizeof(ahp_xc_planar_packet));
+    if(packet == NULL)
+        return NULL;
+    memset(packet, 0, sizeof(ahp_xc_planar_packet));
+    packet->bps = (uint64_t)ahp_xc_get_bps();
+    packet->tau = (uint64_t)(1.0/ahp_xc_get_frequency());
+    packet->n_lines = (uint64_t)ahp_xc_get_nlines();
+    packet->n_baselines = (uint64_t)ahp_xc_get_nbaselines();
+    packet->auto_lag = ahp_xc_get_autocorrelator_lagsize();
+    packet->cross_lag = ahp_xc_get_crosscorrelator_lagsize()*2-1;
+    size_t counts = (packet->n_lines * sizeof(uint64_t) + 63) & ~63;
+    size_t size = counts + 64;
+    size += ((packet->n_lines * packet->auto_lag * sizeof(int64_t) + 63) & ~63) * 6 + ((packet->n_lines * sizeof(double) + 63) & ~63);
+    size += ((packet->n_baselines * packet->cross_lag * sizeof(int64_t) + 63) & ~63) * 6 + ((packet->n_baselines * sizeof(double) + 63) & ~63);
+    packet->buf_len = ahp_xc_get_packetsize();
+    packet->storage = malloc(size);
+    packet->buf = (char*)malloc(packet->buf_len);
+    packet->lock = malloc(sizeof(pthread_mutex_t));
+    if(packet->storage == NULL || packet->buf == NULL || packet->lock == NULL) {
+        free(packet->lock);
+        free((char*)packet->buf);
+        free(packet->storage);
+        free(packet);
+        return NULL;
+    }
+    memset(packet->storage, 0, size);
+    unsigned char *storage = (unsigned char*)(((uintptr_t)packet->storage + 63) & ~(uintptr_t)63);
+    packet->counts = (uint64_t*)storage;
+    storage = planes_carve(&packet->autocorrelations, packet->n_lines, packet->auto_lag, storage + counts);
+    planes_carve(&packet->crosscorrelations, packet->n_baselines, packet->cross_lag, storage);
+    memset((char*)packet->buf, 0, packet->buf_len);
+    pthread_mutex_init(((pthread_mutex_t*)packet->lock), &context->port->mutex_attr);
+    return packet;
+}
+
+void ahp_xc_free_planar_packet(ahp_xc_planar_packet *packet)
+{
+    if(packet != NULL) {
+        pthread_mutex_destroy(((pthread_mutex_t*)packet->lock));
+        free(packet->lock);
+        free((char*)packet->buf);
+        free(packet->storage);
+        free(packet);
+    }
+}
+
+int32_t ahp_xc_packet_to_planar(ahp_xc_packet *src, ahp_xc_planar_packet *dst)
+{
+    uint64_t x;
+    if(src == NULL || dst == NULL)
+        return -EINVAL;
+    if(src->auto_lag != dst->auto_lag || src->cross_lag != dst->cross_lag)
+        return -EINVAL;
+    uint64_t nlines = AHP_XC_MIN(src->n_lines, dst->n_lines);
+    uint64_t nbaselines = AHP_XC_MIN(src->n_baselines, dst->n_baselines);
+    dst->timestamp = src->timestamp;
+    dst->tau = src->tau;
+    dst->bps = src->bps;
+    memcpy(dst->counts, src->counts, sizeof(uint64_t) * nlines);
+    memcpy((char*)dst->buf, src->buf, AHP_XC_MIN(src->buf_len, dst->buf_len));
+    for(x = 0; x < nlines; x++)
+        planes_put_sample(&dst->autocorrelations, x, &src->autocorrelations[x]);
+    for(x = 0; x < nbaselines; x++)
+        planes_put_sample(&dst->crosscorrelations, x, &src->crosscorrelations[x]);
+    return 0;
+}
+
+int32_t ahp_xc_planar_to_packet(ahp_xc_planar_packet *src, ahp_xc_packet *dst)
+{
+    uint64_t x;
+    if(src == NULL || dst == NULL)
+        return -EINVAL;
+    if(src->auto_lag != dst->auto_lag || src->cross_lag != dst->cross_lag)
+        return -EINVAL;
+    uint64_t nlines = AHP_XC_MIN(src->n_lines, dst->n_lines);
+    uint64_t nbaselines = AHP_XC_MIN(src->n_baselines, dst->n_baselines);
+    dst->timestamp = src->timestamp;
+    dst->tau = src->tau;
+    dst->bps = src->bps;
+    memcpy(dst->counts, src->counts, sizeof(uint64_t) * nlines);
+    memcpy((char*)dst->buf, src->buf, AHP_XC_MIN(src->buf_len, dst->buf_len));
+    for(x = 0; x < nlines; x++)
+        planes_get_sample(&src->autocorrelations, x, &dst->autocorrelations[x]);
+    for(x = 0; x < nbaselines; x++)
+        planes_get_sample(&src->crosscorrelations, x, &dst->crosscorrelations[x]);
+    return 0;
+}
+
+void ahp_xc_start_autocorrelation_scan(uint32_t index)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
+    ahp_xc_set_capture_flags((ahp_xc_get_capture_flags()|CAP_RESET_TIMESTAMP)&~CAP_ENABLE);
+    ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)|SCAN_AUTO);
+}
+
+void ahp_xc_end_autocorrelation_scan(uint32_t index)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
+    ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)&~SCAN_AUTO);
+}
+
+static void* _get_autocorrelation(void *o)
 {
     thread_argument *arg = (thread_argument*)o;
+    ahp_xc_context *context = arg->context;
     ahp_xc_sample *sample = arg->sample;
     int32_t index = arg->index;
     const char *data = arg->data;
     double lag = arg->lag;
     uint32_t y;
-    int32_t n = ahp_xc_get_bps() / 4;
-    const char *packet = data;
-    char *subpacket = (char*)malloc(n+1);
-    memset(subpacket, 0, n+1);
-    sample->lag_size = ahp_xc_get_autocorrelator_lagsize();
+    const ahp_xc_layout *layout = &context->packet_layout;
+    int32_t n = layout->field_len;
+    uint32_t offset = layout->auto_offset + layout->auto_line_stride * index;
+    uint32_t lag_size = ahp_xc_get_autocorrelator_lagsize();
+    uint64_t counts = hex_value(&data[layout->counts_offset + index*n], n)|1;
+    if(data == context->packed_source)
+        hex_unpack(context->packed_payload + (offset - layout->counts_offset) / 2, arg->values, lag_size*2, n, context->sign);
+    else
+        hex_decode(&data[offset], arg->values, lag_size*2, n, context->sign, arg->packed);
+    double channel_lag = ahp_xc_get_current_channel_auto(index, data) * ahp_xc_get_sampletime();
+    if(arg->planes != NULL) {
+        planes_put_values(arg->planes, arg->row, arg->values, counts, lag, channel_lag, arg->phase_mode);
+        return NULL;
+    }
+    sample->lag_size = lag_size;
     sample->lag = lag;
-    packet += ahp_xc_header_len;
-    memcpy(subpacket, &packet[index*n], (unsigned int)n);
-    uint64_t counts = strtoul(subpacket, NULL, 16)|1;
-    packet += n*ahp_xc_get_nlines();
-    packet += n*index*ahp_xc_get_autocorrelator_lagsize()*2;
     for(y = 0; y < sample->lag_size; y++) {
         sample->correlations[y].counts = counts;
-        memcpy(subpacket, packet, (unsigned int)n);
-        sscanf(subpacket, "%lX",  &sample->correlations[y].real);
-        if(sample->correlations[y].real >= sign) {
-            sample->correlations[y].real ^= fill;
-            sample->correlations[y].real ++;
-            sample->correlations[y].real = ~sample->correlations[y].real;
-            sample->correlations[y].real ++;
-        }
-        packet += n;
-        memcpy(subpacket, packet, (unsigned int)n);
-        sscanf(subpacket, "%lX",  &sample->correlations[y].imaginary);
-        if(sample->correlations[y].imaginary >= sign) {
-            sample->correlations[y].imaginary ^= fill;
-            sample->correlations[y].imaginary ++;
-            sample->correlations[y].imaginary = ~sample->correlations[y].imaginary;
-            sample->correlations[y].imaginary ++;
-        }
-        packet += n;
-        complex_phase_magnitude(&sample->correlations[y]);
-        sample->correlations[y].lag = ahp_xc_get_current_channel_auto(index, data) * ahp_xc_get_sampletime();
-    }
-    packet += (ahp_xc_get_nbaselines() + ahp_xc_get_nlines()) * n;
-    free(subpacket);
-    if(nthreads > 0)
-        nthreads--;
+        sample->correlations[y].real = arg->values[y*2];
+        sample->correlations[y].imaginary = arg->values[y*2+1];
+        sample->correlations[y].lag = channel_lag;
+    }
+    if(arg->phase_mode == PHASE_EAGER)
+        correlations_phase_magnitude(sample->correlations, sample->lag_size);
     return NULL;
 }
 
 void ahp_xc_get_autocorrelation(ahp_xc_sample *sample, int32_t index, const char *data, double lag)
 {
-    if(!ahp_xc_mutexes_initialized)
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->mutexes_initialized)
         return;
-    autocorrelation_thread_args[index].sample = sample;
-    autocorrelation_thread_args[index].index = index;
-    autocorrelation_thread_args[index].data = data;
-    autocorrelation_thread_args[index].lag = lag;
-    _get_autocorrelation(&autocorrelation_thread_args[index]);
+    context->auto_args[index].sample = sample;
+    context->auto_args[index].index = index;
+    context->auto_args[index].data = data;
+    context->auto_args[index].lag = lag;
+    context->auto_args[index].planes = NULL;
+    context->auto_args[index].phase_mode = PHASE_EAGER;
+    _get_autocorrelation(&context->auto_args[index]);
 }
 
-int32_t ahp_xc_scan_autocorrelations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **autocorrelations, int32_t *interrupt, double *percent)
+typedef struct scan_queue {
+    ahp_xc_context *context;
+    void (*decode)(struct scan_queue *queue, const char *packet, uint32_t target);
+    ahp_xc_scan_request *lines;
+    uint32_t nlines;
+    ahp_xc_scan_callback callback;
+    void *user;
+    ahp_xc_sample *samples;
+    ahp_xc_sample *correlations;
+    int32_t *inputs;
+    int32_t order;
+    double *lags;
+    FILE *file;
+    unsigned char *map;
+    size_t map_size;
+    uint64_t data_offset;
+    char *slots;
+    uint32_t *targets;
+    uint32_t packetsize;
+    uint32_t depth;
+    uint32_t head;
+    uint32_t tail;
+    int32_t done;
+    int32_t decoded;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+} scan_queue;
+
+typedef struct {
+    ahp_xc_scan_request *lines;
+    ahp_xc_sample *correlations;
+} scan_store_target;
+
+static size_t scan_clamp_auto(ahp_xc_scan_request *lines, uint32_t nlines, size_t *size)
 {
-    if(!ahp_xc_detected) return 0;
-    int32_t r = -1;
-    uint32_t i = 0;
-    uint32_t x = 0;
-    uint32_t y = 0;
-    double ts = 0.0;
-    double ts0 = 0.0;
-    int32_t s = 0;
-    *autocorrelations = NULL;
-    (*percent) = 0;
-    r++;
+    uint32_t i;
     size_t len = 0;
-    size_t size = 0;
+    *size = 0;
     for(i = 0; i < nlines; i++) {
         lines[i].start = (lines[i].start < ahp_xc_get_delaysize()-2 ? lines[i].start : (off_t)ahp_xc_get_delaysize()-2);
         lines[i].len = (lines[i].start+(off_t)lines[i].len < ahp_xc_get_delaysize() ? (off_t)lines[i].len : (off_t)ahp_xc_get_delaysize()-1-lines[i].start);
         len = fmax(len, lines[i].len/lines[i].step);
-        size += lines[i].len/lines[i].step;
+        *size += lines[i].len/lines[i].step;
+    }
+    return len;
+}
+
+static void *scan_decoder(void *arg)
+{
+    scan_queue *queue = (scan_queue*)arg;
+    context_bind(queue->context);
+    pthread_mutex_lock(&queue->mutex);
+    while(1) {
+        while(queue->tail == queue->head && !queue->done)
+            pthread_cond_wait(&queue->ready, &queue->mutex);
+        if(queue->tail == queue->head)
+            break;
+        uint32_t slot = queue->tail % queue->depth;
+        pthread_mutex_unlock(&queue->mutex);
+        queue->decode(queue, &queue->slots[slot * queue->packetsize], queue->targets[slot]);
+        pthread_mutex_lock(&queue->mutex);
+        queue->tail++;
+        pthread_cond_signal(&queue->space);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return NULL;
+}
+
+static int32_t scan_queue_start(ahp_xc_context *context, scan_queue *queue, void (*decode)(scan_queue *queue, const char *packet, uint32_t target))
+{
+    int err;
+    queue->context = context;
+    queue->decode = decode;
+    queue->packetsize = ahp_xc_get_packetsize();
+    queue->depth = AHP_XC_SCAN_QUEUE_DEPTH;
+    queue->slots = (char*)malloc(queue->packetsize * queue->depth);
+    queue->targets = (uint32_t*)malloc(sizeof(uint32_t) * queue->depth);
+    if(queue->slots == NULL || queue->targets == NULL) {
+        free(queue->slots);
+        free(queue->targets);
+        return -ENOMEM;
+    }
+    queue->head = queue->tail = 0;
+    queue->done = 0;
+    queue->decoded = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+    pthread_cond_init(&queue->space, NULL);
+    context->packed_source = NULL;
+    err = pthread_create(&queue->thread, NULL, scan_decoder, queue);
+    if(err) {
+        pthread_mutex_destroy(&queue->mutex);
+        pthread_cond_destroy(&queue->ready);
+        pthread_cond_destroy(&queue->space);
+        free(queue->slots);
+        free(queue->targets);
+        return -err;
+    }
+    return 0;
+}
+
+static char *scan_queue_slot(scan_queue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while(queue->head - queue->tail == queue->depth)
+        pthread_cond_wait(&queue->space, &queue->mutex);
+    pthread_mutex_unlock(&queue->mutex);
+    return &queue->slots[(queue->head % queue->depth) * queue->packetsize];
+}
+
+static void scan_queue_push(scan_queue *queue, uint32_t target)
+{
+    queue->targets[queue->head % queue->depth] = target;
+    pthread_mutex_lock(&queue->mutex);
+    queue->head++;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static int32_t scan_queue_finish(scan_queue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->done = 1;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->mutex);
+    pthread_join(queue->thread, NULL);
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->ready);
+    pthread_cond_destroy(&queue->space);
+    free(queue->slots);
+    free(queue->targets);
+    return queue->decoded;
+}
+
+static void scan_decode_auto(scan_queue *queue, const char *packet, uint32_t channel)
+{
+    uint32_t x;
+    for(x = 0; x < queue->nlines; x++) {
+        ahp_xc_scan_request *line = &queue->lines[x];
+        if(channel >= line->len/line->step)
+            continue;
+        ahp_xc_get_autocorrelation(&queue->samples[x], line->index, packet, ahp_xc_get_current_channel_auto(line->index, packet) * ahp_xc_get_sampletime());
+        queue->callback(line, channel, &queue->samples[x], queue->user);
+        queue->decoded++;
     }
-    ahp_xc_sample *correlations = ahp_xc_alloc_samples(size, (unsigned int)ahp_xc_get_autocorrelator_lagsize());
-    char* data = (char*)malloc(ahp_xc_get_packetsize()*(len+1));
+}
+
+static void scan_clear_channel(uint32_t index, int32_t cross)
+{
+    int capture_flags = ahp_xc_get_capture_flags();
+    ahp_xc_set_capture_flags(cross ? (capture_flags | CAP_EXTRA_CMD) : (capture_flags & ~CAP_EXTRA_CMD));
+    ahp_xc_select_input(index);
+    ahp_xc_send_command(CLEAR, SET_DELAY);
+    ahp_xc_set_capture_flags(capture_flags);
+}
+
+static void scan_settle(ahp_xc_context *context, scan_queue *queue)
+{
+    frame_reset(context, 1);
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+    frame_recv(context, scan_queue_slot(queue), queue->packetsize);
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+}
+
+static void scan_reset_lines(ahp_xc_scan_request *lines, uint32_t nlines, int32_t start)
+{
+    uint32_t i;
     for(i = 0; i < nlines; i++) {
-        ahp_xc_select_input(lines[i].index);
-        int capture_flags = ahp_xc_get_capture_flags();
-        ahp_xc_set_capture_flags(capture_flags & ~CAP_EXTRA_CMD);
-        ahp_xc_select_input(lines[i].index);
-        ahp_xc_send_command(CLEAR, SET_DELAY);
-        ahp_xc_set_capture_flags(capture_flags);
-        ahp_xc_set_channel_auto(lines[i].index, lines[i].start, lines[i].len, lines[i].step);
-        ahp_xc_start_autocorrelation_scan(lines[i].index);
+        scan_clear_channel(lines[i].index, 0);
+        if(start) {
+            ahp_xc_set_channel_auto(lines[i].index, lines[i].start, lines[i].len, lines[i].step);
+            ahp_xc_start_autocorrelation_scan(lines[i].index);
+        } else {
+            ahp_xc_end_autocorrelation_scan(lines[i].index);
+        }
     }
-    char* buf = NULL;
-    i = 0;
+}
+
+static int32_t scan_autocorrelations(ahp_xc_context *context, scan_queue *queue, ahp_xc_scan_request *lines, uint32_t nlines, void (*decode)(scan_queue *queue, const char *packet, uint32_t target), int32_t *interrupt, double *percent)
+{
+    uint32_t stream_depth = context->streaming ? context->ring.depth : 0;
+    ahp_xc_stop_streaming();
+    uint32_t i = 0;
+    uint32_t failures = 0;
+    int32_t err = 0;
+    size_t size = 0;
+    size_t len = scan_clamp_auto(lines, nlines, &size);
+    uint32_t packetsize = ahp_xc_get_packetsize();
+    err = scan_queue_start(context, queue, decode);
+    if(err) {
+        if(stream_depth)
+            ahp_xc_start_streaming(stream_depth);
+        return err;
+    }
+    queue->lines = lines;
+    queue->nlines = nlines;
+    queue->samples = ahp_xc_alloc_samples(nlines, (unsigned int)ahp_xc_get_autocorrelator_lagsize());
+    scan_reset_lines(lines, nlines, 1);
+    (*percent) = 0;
     ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-    ahp_serial_flushRX();
+    frame_reset(context, 1);
     ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_ENABLE);
-    ahp_serial_AlignFrame('\r', ahp_xc_get_packetsize());
-    while(i < len) {
-        if(*interrupt)
-            break;
-        unsigned char *buf = (unsigned char*)malloc(ahp_xc_get_packetsize());
-        ahp_serial_RecvBuf((unsigned char*)buf, ahp_xc_get_packetsize());
-        if(check_sof((char*)buf))
-            i = 0;
-        memcpy(data+i*ahp_xc_get_packetsize(), buf, ahp_xc_get_packetsize());
+    i = 0;
+    while(i < len && !*interrupt) {
+        char *packet = scan_queue_slot(queue);
+        if(frame_recv(context, packet, packetsize) != (int32_t)packetsize) {
+            if(++failures >= len) {
+                err = -ETIMEDOUT;
+                break;
+            }
+        } else {
+            if(check_sof(context, packet))
+                i = 0;
+            scan_queue_push(queue, i);
+        }
         i++;
-        free(buf);
         (*percent) += 100.0 / len;
-        r++;
     }
-    i = 0;
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-    for(i = 0; i < nlines; i++) {
-        ahp_xc_select_input(lines[i].index);
-        int capture_flags = ahp_xc_get_capture_flags();
-        ahp_xc_set_capture_flags(capture_flags & ~CAP_EXTRA_CMD);
-        ahp_xc_select_input(lines[i].index);
-        ahp_xc_send_command(CLEAR, SET_DELAY);
-        ahp_xc_set_capture_flags(capture_flags);
-        ahp_xc_end_autocorrelation_scan(lines[i].index);
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+    scan_reset_lines(lines, nlines, 0);
+    scan_settle(context, queue);
+    int32_t s = scan_queue_finish(queue);
+    ahp_xc_free_samples(nlines, queue->samples);
+    if(stream_depth)
+        ahp_xc_start_streaming(stream_depth);
+    return err ? err : s;
+}
+
+int32_t ahp_xc_scan_autocorrelations_stream(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_scan_callback callback, void *user, int32_t *interrupt, double *percent)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    if(!context->mutexes_initialized || callback == NULL) return -EINVAL;
+    scan_queue queue;
+    memset(&queue, 0, sizeof(scan_queue));
+    queue.callback = callback;
+    queue.user = user;
+    return scan_autocorrelations(context, &queue, lines, nlines, scan_decode_auto, interrupt, percent);
+}
+
+static void scan_file_put(scan_queue *queue, uint64_t index, const ahp_xc_scan_record *record)
+{
+    uint64_t offset = queue->data_offset + index * sizeof(ahp_xc_scan_record);
+#ifndef WINDOWS
+    memcpy(queue->map + offset, record, sizeof(ahp_xc_scan_record));
+#else
+    fseek(queue->file, (long)offset, SEEK_SET);
+    fwrite(record, sizeof(ahp_xc_scan_record), 1, queue->file);
+#endif
+}
+
+static void scan_decode_file(scan_queue *queue, const char *packet, uint32_t channel)
+{
+    ahp_xc_context *context = queue->context;
+    uint32_t x, y;
+    uint64_t off = 0;
+    ahp_xc_scan_record record;
+    double timestamp = get_timestamp(context, (char*)packet);
+    for(x = 0; x < queue->nlines; off += queue->lines[x].len/queue->lines[x].step, x++) {
+        ahp_xc_scan_request *line = &queue->lines[x];
+        ahp_xc_sample *sample = &queue->samples[x];
+        if(channel >= line->len/line->step)
+            continue;
+        ahp_xc_get_autocorrelation(sample, line->index, packet, ahp_xc_get_current_channel_auto(line->index, packet) * ahp_xc_get_sampletime());
+        for(y = 0; y < sample->lag_size; y++) {
+            record.line = line->index;
+            record.channel = channel;
+            record.lag = sample->correlations[y].lag;
+            record.real = sample->correlations[y].real;
+            record.imaginary = sample->correlations[y].imaginary;
+            record.counts = sample->correlations[y].counts;
+            record.timestamp = timestamp;
+            scan_file_put(queue, (off + channel) * sample->lag_size + y, &record);
+        }
+        queue->decoded++;
+    }
+}
+
+int32_t ahp_xc_scan_autocorrelations_to_file(ahp_xc_scan_request *lines, uint32_t nlines, const char *filename, int32_t *interrupt, double *percent)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    if(!context->mutexes_initialized || filename == NULL) return -EINVAL;
+    size_t size = 0;
+    scan_queue queue;
+    ahp_xc_scan_file_header header;
+    memset(&queue, 0, sizeof(scan_queue));
+    memset(&header, 0, sizeof(ahp_xc_scan_file_header));
+    scan_clamp_auto(lines, nlines, &size);
+    memcpy(header.magic, AHP_XC_SCAN_FILE_MAGIC, sizeof(header.magic));
+    header.version = AHP_XC_SCAN_FILE_VERSION;
+    header.record_size = sizeof(ahp_xc_scan_record);
+    header.lag_size = ahp_xc_get_autocorrelator_lagsize();
+    header.nlines = nlines;
+    header.data_offset = sizeof(ahp_xc_scan_file_header);
+    header.records = (uint64_t)size * header.lag_size;
+    queue.data_offset = header.data_offset;
+    queue.map_size = header.data_offset + header.records * header.record_size;
+    queue.file = fopen(filename, "w+b");
+    if(queue.file == NULL)
+        return -errno;
+    if(fwrite(&header, sizeof(ahp_xc_scan_file_header), 1, queue.file) != 1) {
+        fclose(queue.file);
+        return -EIO;
+    }
+#ifndef WINDOWS
+    fflush(queue.file);
+    if(ftruncate(fileno(queue.file), (off_t)queue.map_size)) {
+        int32_t err = -errno;
+        fclose(queue.file);
+        return err;
+    }
+    queue.map = (unsigned char*)mmap(NULL, queue.map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fileno(queue.file), 0);
+    if(queue.map == MAP_FAILED) {
+        int32_t err = -errno;
+        fclose(queue.file);
+        return err;
+    }
+    madvise(queue.map, queue.map_size, MADV_SEQUENTIAL);
+#endif
+    int32_t s = scan_autocorrelations(context, &queue, lines, nlines, scan_decode_file, interrupt, percent);
+    header.samples = s > 0 ? s : 0;
+#ifndef WINDOWS
+    memcpy(queue.map, &header, sizeof(ahp_xc_scan_file_header));
+    munmap(queue.map, queue.map_size);
+#else
+    fseek(queue.file, 0, SEEK_SET);
+    fwrite(&header, sizeof(ahp_xc_scan_file_header), 1, queue.file);
+#endif
+    fclose(queue.file);
+    return s;
+}
+
+static void scan_store(ahp_xc_scan_request *request, uint32_t channel, ahp_xc_sample *sample, void *user)
+{
+    scan_store_target *target = (scan_store_target*)user;
+    ahp_xc_scan_request *line;
+    size_t off = 0;
+    for(line = target->lines; line < request; line++)
+        off += line->len/line->step;
+    ahp_xc_sample *correlation = &target->correlations[off+channel];
+    correlation->lag = sample->lag;
+    correlation->lag_size = sample->lag_size;
+    memcpy(correlation->correlations, sample->correlations, sizeof(ahp_xc_correlation)*sample->lag_size);
+}
+
+int32_t ahp_xc_scan_autocorrelations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **autocorrelations, int32_t *interrupt, double *percent)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    size_t size = 0;
+    scan_store_target target;
+    *autocorrelations = NULL;
+    scan_clamp_auto(lines, nlines, &size);
+    target.lines = lines;
+    target.correlations = ahp_xc_alloc_samples(size, (unsigned int)ahp_xc_get_autocorrelator_lagsize());
+    int32_t s = ahp_xc_scan_autocorrelations_stream(lines, nlines, scan_store, &target, interrupt, percent);
+    if(s < 0) {
+        ahp_xc_free_samples(size, target.correlations);
+        return s;
+    }
+    *autocorrelations = target.correlations;
+    return s;
+}
+
+typedef struct {
+    uint32_t line;
+    off_t channel;
+    size_t step;
+    double magnitude;
+    ahp_xc_sample sample;
+} adaptive_point;
+
+typedef struct {
+    ahp_xc_scan_request *requests;
+    uint32_t *owners;
+    adaptive_point *points;
+    size_t count;
+    size_t size;
+    int32_t err;
+} adaptive_scan;
+
+typedef struct {
+    uint32_t owner;
+    ahp_xc_scan_request request;
+} adaptive_window;
+
+static void adaptive_store(ahp_xc_scan_request *request, uint32_t channel, ahp_xc_sample *sample, void *user)
+{
+    adaptive_scan *scan = (adaptive_scan*)user;
+    uint64_t y;
+    if(scan->count == scan->size) {
+        size_t size = scan->size ? scan->size * 2 : 256;
+        adaptive_point *points = (adaptive_point*)realloc(scan->points, sizeof(adaptive_point)*size);
+        if(points == NULL) {
+            scan->err = -ENOMEM;
+            return;
+        }
+        scan->points = points;
+        scan->size = size;
+    }
+    adaptive_point *point = &scan->points[scan->count];
+    point->line = scan->owners[request - scan->requests];
+    point->channel = request->start + (off_t)channel * (off_t)request->step;
+    if(ahp_xc_get_sampletime() > 0)
+        point->channel = (off_t)round(sample->lag / ahp_xc_get_sampletime());
+    point->step = request->step;
+    point->magnitude = 0;
+    point->sample.lag = sample->lag;
+    point->sample.lag_size = sample->lag_size;
+    point->sample.correlations = (ahp_xc_correlation*)malloc(sizeof(ahp_xc_correlation)*sample->lag_size);
+    if(point->sample.correlations == NULL) {
+        scan->err = -ENOMEM;
+        return;
+    }
+    memcpy(point->sample.correlations, sample->correlations, sizeof(ahp_xc_correlation)*sample->lag_size);
+    for(y = 0; y < sample->lag_size; y++)
+        point->magnitude = fmax(point->magnitude, sample->correlations[y].magnitude);
+    scan->count++;
+}
+
+static int compare_adaptive_point(const void *a, const void *b)
+{
+    const adaptive_point *p = (const adaptive_point*)a;
+    const adaptive_point *q = (const adaptive_point*)b;
+    if(p->line != q->line)
+        return p->line < q->line ? -1 : 1;
+    if(p->channel != q->channel)
+        return p->channel < q->channel ? -1 : 1;
+    return p->step > q->step ? -1 : (p->step < q->step ? 1 : 0);
+}
+
+static int compare_adaptive_window(const void *a, const void *b)
+{
+    const adaptive_window *v = (const adaptive_window*)a;
+    const adaptive_window *w = (const adaptive_window*)b;
+    if(v->owner != w->owner)
+        return v->owner < w->owner ? -1 : 1;
+    if(v->request.start != w->request.start)
+        return v->request.start < w->request.start ? -1 : 1;
+    return 0;
+}
+
+int32_t ahp_xc_scan_autocorrelations_adaptive(ahp_xc_scan_request *lines, uint32_t nlines, uint32_t factor, double threshold, ahp_xc_sample **autocorrelations, uint32_t *counts, int32_t *interrupt, double *percent)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    if(!context->mutexes_initialized || factor < 2 || nlines == 0) return -EINVAL;
+    uint32_t x, o;
+    size_t i, n;
+    size_t size = 0;
+    size_t max_step = 1;
+    adaptive_scan scan;
+    memset(&scan, 0, sizeof(adaptive_scan));
+    *autocorrelations = NULL;
+    if(counts != NULL)
+        memset(counts, 0, sizeof(uint32_t)*nlines);
+    (*percent) = 0;
+    scan_clamp_auto(lines, nlines, &size);
+    double *level = (double*)malloc(sizeof(double)*nlines);
+    uint32_t *taken = (uint32_t*)malloc(sizeof(uint32_t)*nlines);
+    scan.requests = (ahp_xc_scan_request*)malloc(sizeof(ahp_xc_scan_request)*nlines);
+    scan.owners = (uint32_t*)malloc(sizeof(uint32_t)*nlines);
+    size_t pending = nlines;
+    adaptive_window *windows = (adaptive_window*)malloc(sizeof(adaptive_window)*nlines);
+    if(level == NULL || taken == NULL || scan.requests == NULL || scan.owners == NULL || windows == NULL) {
+        scan.err = -ENOMEM;
+        pending = 0;
+    }
+    for(x = 0; x < pending; x++) {
+        windows[x].owner = x;
+        windows[x].request = lines[x];
+        max_step = fmax(max_step, lines[x].step);
     }
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-    usleep(ahp_xc_get_packettime() * 3000000);
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-    i = 0;
-    while((int)i < r) {
-        if(*interrupt)
-            break;
-        char *packet = (char*)data+i*ahp_xc_get_packetsize();
-        ts = get_timestamp(packet);
-        size_t off = 0;
-        for(x = 0; x < nlines; x++) {
-            if(i < lines[x].len/lines[x].step) {
-                ahp_xc_get_autocorrelation(&correlations[i+off], lines[x].index, packet+y*ahp_xc_get_packetsize(), ahp_xc_get_current_channel_auto(lines[x].index, data));
-                s++;
+    double passes = 1 + ceil(log((double)max_step) / log((double)factor));
+    int32_t pass = 0;
+    while(pending > 0 && !scan.err && !*interrupt) {
+        size_t first = scan.count;
+        size_t scheduled = 0;
+        while(scheduled < pending && !scan.err && !*interrupt) {
+            double round_percent = 0;
+            memset(taken, 0, sizeof(uint32_t)*nlines);
+            n = 0;
+            for(i = 0; i < pending; i++) {
+                if(windows[i].request.len == 0 || taken[windows[i].owner])
+                    continue;
+                taken[windows[i].owner] = 1;
+                scan.requests[n] = windows[i].request;
+                scan.owners[n++] = windows[i].owner;
+                windows[i].request.len = 0;
             }
-            off += lines[x].len/lines[x].step;
+            if(n == 0)
+                break;
+            int32_t s = ahp_xc_scan_autocorrelations_stream(scan.requests, (uint32_t)n, adaptive_store, &scan, interrupt, &round_percent);
+            if(s < 0)
+                scan.err = s;
+            scheduled += n;
+            (*percent) = 100.0 * (pass + (double)scheduled / pending) / passes;
         }
-        wait_no_threads();
-        i++;
+        if(pass == 0) {
+            for(o = 0; o < nlines; o++) {
+                double sum = 0, sum2 = 0, count = 0;
+                for(i = first; i < scan.count; i++) {
+                    if(scan.points[i].line != o)
+                        continue;
+                    sum += scan.points[i].magnitude;
+                    sum2 += scan.points[i].magnitude * scan.points[i].magnitude;
+                    count++;
+                }
+                double mean = count > 0 ? sum / count : 0;
+                level[o] = mean + threshold * sqrt(fmax(0, (count > 0 ? sum2 / count : 0) - mean * mean));
+            }
+        }
+        pending = 0;
+        for(i = first; i < scan.count; i++) {
+            adaptive_point *point = &scan.points[i];
+            if(point->step < 2 || point->magnitude <= level[point->line])
+                continue;
+            adaptive_window *grown = (adaptive_window*)realloc(windows, sizeof(adaptive_window)*(pending+1));
+            if(grown == NULL) {
+                scan.err = -ENOMEM;
+                break;
+            }
+            windows = grown;
+            windows[pending].owner = point->line;
+            windows[pending].request = lines[point->line];
+            windows[pending].request.start = fmax(0, point->channel - (off_t)point->step);
+            windows[pending].request.len = point->channel + (off_t)point->step - windows[pending].request.start;
+            windows[pending].request.step = fmax(1, point->step / factor);
+            pending++;
+        }
+        qsort(windows, pending, sizeof(adaptive_window), compare_adaptive_window);
+        for(i = 0, n = 0; i < pending; i++) {
+            adaptive_window *last = &windows[n > 0 ? n-1 : 0];
+            if(n > 0 && windows[i].owner == last->owner && windows[i].request.start <= last->request.start + (off_t)last->request.len) {
+                last->request.len = fmax(last->request.len, windows[i].request.start + (off_t)windows[i].request.len - last->request.start);
+                continue;
+            }
+            windows[n++] = windows[i];
+        }
+        pending = n;
+        pass++;
+    }
+    if(scan.err) {
+        for(i = 0; i < scan.count; i++)
+            free(scan.points[i].sample.correlations);
+        scan.count = 0;
+    }
+    if(scan.count > 0)
+        qsort(scan.points, scan.count, sizeof(adaptive_point), compare_adaptive_point);
+    for(i = 0, n = 0; i < scan.count; i++) {
+        if(n > 0 && scan.points[n-1].line == scan.points[i].line && scan.points[n-1].channel == scan.points[i].channel) {
+            free(scan.points[i].sample.correlations);
+            continue;
+        }
+        scan.points[n++] = scan.points[i];
+    }
+    ahp_xc_sample *correlations = scan.err || n == 0 ? NULL : ahp_xc_alloc_samples(n, (unsigned int)ahp_xc_get_autocorrelator_lagsize());
+    if(n > 0 && correlations == NULL && !scan.err)
+        scan.err = -ENOMEM;
+    for(i = 0; i < n; i++) {
+        if(correlations != NULL) {
+            correlations[i].lag = scan.points[i].sample.lag;
+            correlations[i].lag_size = AHP_XC_MIN(correlations[i].lag_size, scan.points[i].sample.lag_size);
+            memcpy(correlations[i].correlations, scan.points[i].sample.correlations, sizeof(ahp_xc_correlation)*correlations[i].lag_size);
+            if(counts != NULL)
+                counts[scan.points[i].line]++;
+        }
+        free(scan.points[i].sample.correlations);
     }
-    free(data);
+    free(scan.points);
+    free(scan.requests);
+    free(scan.owners);
+    free(windows);
+    free(level);
+    free(taken);
+    if(scan.err)
+        return scan.err;
+    if(!*interrupt)
+        (*percent) = 100;
     *autocorrelations = correlations;
-    return s;
+    return (int32_t)n;
 }
 
 void ahp_xc_start_crosscorrelation_scan(uint32_t index)
 {
-    if(!ahp_xc_detected) return;
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
     ahp_xc_end_crosscorrelation_scan(index);
     ahp_xc_set_capture_flags((ahp_xc_get_capture_flags()|CAP_RESET_TIMESTAMP)&~CAP_ENABLE);
     usleep(ahp_xc_get_packettime()*1000000);
@@ -790,7 +3569,8 @@ void ahp_xc_start_crosscorrelation_scan(uint32_t index)
 
 void ahp_xc_end_crosscorrelation_scan(uint32_t index)
 {
-    if(!ahp_xc_detected) return;
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
     if(!ahp_xc_intensity_crosscorrelator_enabled())
         ahp_xc_set_test_flags(index, ahp_xc_get_test_flags(index)&~SCAN_CROSS);
     else
@@ -800,6 +3580,7 @@ void ahp_xc_end_crosscorrelation_scan(uint32_t index)
 void *_get_crosscorrelation(void *o)
 {
     thread_argument *arg = (thread_argument*)o;
+    ahp_xc_context *context = arg->context;
     ahp_xc_sample *sample = arg->sample;
     int32_t *indexes = arg->indexes;
     int32_t index = arg->index;
@@ -808,36 +3589,37 @@ void *_get_crosscorrelation(void *o)
     uint32_t x, y;
     int32_t n = ahp_xc_get_bps() / 4;
     const char *packet = data;
-    sample->lag_size = (ahp_xc_get_crosscorrelator_lagsize()*2-1);
-    sample->lag = 0;
+    uint32_t lag_size = ahp_xc_get_crosscorrelator_lagsize()*2-1;
     if(ahp_xc_intensity_crosscorrelator_enabled()) {
-        ahp_xc_sample **samples = (ahp_xc_sample**)malloc(sizeof(ahp_xc_sample*)*num_indexes);
+        ahp_xc_sample *samples = context->line_samples;
+        if(arg->planes != NULL)
+            sample = context->planar_sample;
+        sample->lag_size = lag_size;
+        sample->lag = 0;
         for(y = 0; y < num_indexes; y++) {
-            samples[y] = ahp_xc_alloc_samples(1, ahp_xc_get_autocorrelator_lagsize());
-            ahp_xc_get_autocorrelation(samples[y], indexes[y], packet, ahp_xc_get_current_channel_auto(indexes[y], data) * ahp_xc_get_sampletime());
+            ahp_xc_get_autocorrelation(&samples[y], indexes[y], packet, ahp_xc_get_current_channel_auto(indexes[y], data) * ahp_xc_get_sampletime());
         }
-        wait_no_threads();
-        for (y = 0; y < ahp_xc_get_autocorrelator_lagsize(); y++) {
+        for (y = 0; y < fmin(ahp_xc_get_autocorrelator_lagsize(), sample->lag_size); y++) {
             sample->correlations[y].num_indexes = num_indexes;
-            sample->correlations[y].indexes = (int*)malloc(sizeof(int) * num_indexes);
-            sample->correlations[y].lags = (double*)malloc(sizeof(double) * num_indexes);
+            if(sample->correlations[y].indexes == NULL)
+                sample->correlations[y].indexes = (int*)malloc(sizeof(int) * ahp_xc_get_nlines());
+            if(sample->correlations[y].lags == NULL)
+                sample->correlations[y].lags = (double*)malloc(sizeof(double) * ahp_xc_get_nlines());
             memcpy(sample->correlations[y].indexes, arg->indexes, sizeof(int)*num_indexes);
             memcpy(sample->correlations[y].lags, arg->lags, sizeof(double)*num_indexes);
-            sample->correlations[y].lag = ahp_xc_get_current_channel_auto(indexes[y], data) * ahp_xc_get_sampletime();
-            sample->correlations[y].counts = samples[0]->correlations[y].counts;
-            sample->correlations[y].magnitude = samples[0]->correlations[y].magnitude;
-            sample->correlations[y].phase = samples[0]->correlations[y].phase;
-            sample->correlations[y].real = samples[0]->correlations[y].real;
-            sample->correlations[y].imaginary = samples[0]->correlations[y].imaginary;
-            ahp_xc_free_samples(1, samples[0]);
+            sample->correlations[y].lag = ahp_xc_get_current_channel_auto(indexes[0], data) * ahp_xc_get_sampletime();
+            sample->correlations[y].counts = samples[0].correlations[y].counts;
+            sample->correlations[y].magnitude = samples[0].correlations[y].magnitude;
+            sample->correlations[y].phase = samples[0].correlations[y].phase;
+            sample->correlations[y].real = samples[0].correlations[y].real;
+            sample->correlations[y].imaginary = samples[0].correlations[y].imaginary;
             for (x = 1; x < num_indexes; x++) {
-                sample->correlations[y].lag = samples[0]->lag+y*ahp_xc_get_sampletime();
+                sample->correlations[y].lag = samples[0].lag+y*ahp_xc_get_sampletime();
                 sample->correlations[y].lags[x] = arg->lags[x];
                 sample->correlations[y].indexes[x] = arg->indexes[x];
-                sample->correlations[y].counts += samples[x]->correlations[y].counts;
-                sample->correlations[y].magnitude *= samples[x]->correlations[y].magnitude;
-                sample->correlations[y].phase += samples[x]->correlations[y].phase;
-                ahp_xc_free_samples(1, samples[x]);
+                sample->correlations[y].counts += samples[x].correlations[y].counts;
+                sample->correlations[y].magnitude *= samples[x].correlations[y].magnitude;
+                sample->correlations[y].phase += samples[x].correlations[y].phase;
             }
             sample->correlations[y].counts /= num_indexes;
             sample->correlations[y].magnitude = pow(sample->correlations[y].magnitude, 1.0/num_indexes);
@@ -845,68 +3627,70 @@ void *_get_crosscorrelation(void *o)
             sample->correlations[y].real = (long)(sin(sample->correlations[y].phase) * sample->correlations[y].magnitude);
             sample->correlations[y].imaginary = (long)(cos(sample->correlations[y].phase) * sample->correlations[y].magnitude);
         }
-        free(samples);
+        if(arg->planes != NULL)
+            planes_put_sample(arg->planes, arg->row, sample);
     } else {
-        char *subpacket = (char*)malloc(n+1);
-        memset(subpacket, 0, n+1);
-        packet += ahp_xc_header_len;
+        const ahp_xc_layout *layout = &context->packet_layout;
+        uint32_t offset = layout->cross_offset + layout->cross_baseline_stride * index;
         uint64_t counts = 0;
         for(y = 0; y < num_indexes; y++) {
-            memcpy(subpacket, &packet[indexes[y]*n], (unsigned int)n);
-            counts += strtoul(subpacket, NULL, 16)|1;
+            counts += hex_value(&data[layout->counts_offset + indexes[y]*n], n)|1;
         }
-        packet += n*ahp_xc_get_nlines();
-        packet += n*ahp_xc_get_autocorrelator_lagsize()*ahp_xc_get_nlines()*2;
-        packet += n*index*2;
+        if(data == context->packed_source)
+            hex_unpack(context->packed_payload + (offset - layout->counts_offset) / 2, arg->values, lag_size*2, n, context->sign);
+        else
+            hex_decode(&data[offset], arg->values, lag_size*2, n, context->sign, arg->packed);
+        if(arg->planes != NULL) {
+            planes_put_values(arg->planes, arg->row, arg->values, counts, 0, ahp_xc_get_current_channel_auto(indexes[0], data) * ahp_xc_get_sampletime(), arg->phase_mode);
+            return NULL;
+        }
+        sample->lag_size = lag_size;
+        sample->lag = 0;
         for(y = 0; y < sample->lag_size; y++) {
             sample->correlations[y].num_indexes = num_indexes;
             if(sample->correlations[y].indexes == NULL)
-                sample->correlations[y].indexes = (int*)malloc(sizeof(int) * num_indexes);
+                sample->correlations[y].indexes = (int*)malloc(sizeof(int) * ahp_xc_get_nlines());
             if(sample->correlations[y].lags == NULL)
-                sample->correlations[y].lags = (double*)malloc(sizeof(double) * num_indexes);
+                sample->correlations[y].lags = (double*)malloc(sizeof(double) * ahp_xc_get_nlines());
             memcpy(sample->correlations[y].indexes, arg->indexes, sizeof(int)*num_indexes);
             memcpy(sample->correlations[y].lags, arg->lags, sizeof(double)*num_indexes);
-            sample->correlations[y].lag = ahp_xc_get_current_channel_auto(indexes[y], data) * ahp_xc_get_sampletime();
+            sample->correlations[y].lag = ahp_xc_get_current_channel_auto(indexes[0], data) * ahp_xc_get_sampletime();
             sample->correlations[y].counts = counts;
-            memcpy(subpacket, packet, (unsigned int)n);
-            sscanf(subpacket, "%lX",  &sample->correlations[y].real);
-            if(sample->correlations[y].real >= sign) {
-                sample->correlations[y].real ^= fill;
-                sample->correlations[y].real ++;
-                sample->correlations[y].real = ~sample->correlations[y].real;
-                sample->correlations[y].real ++;
-            }
-            packet += n;
-            memcpy(subpacket, packet, (unsigned int)n);
-            sscanf(subpacket, "%lX",  &sample->correlations[y].imaginary);
-            if(sample->correlations[y].imaginary >= sign) {
-                sample->correlations[y].imaginary ^= fill;
-                sample->correlations[y].imaginary ++;
-                sample->correlations[y].imaginary = ~sample->correlations[y].imaginary;
-                sample->correlations[y].imaginary ++;
-            }
-            packet += n;
-            complex_phase_magnitude(&sample->correlations[y]);
+            sample->correlations[y].real = arg->values[y*2];
+            sample->correlations[y].imaginary = arg->values[y*2+1];
         }
-        free(subpacket);
+        if(arg->phase_mode == PHASE_EAGER)
+            correlations_phase_magnitude(sample->correlations, sample->lag_size);
     }
-    if(nthreads > 0)
-        nthreads--;
     return NULL;
 }
 
 void ahp_xc_get_crosscorrelation(ahp_xc_sample *sample, int32_t *indexes, int32_t order, const char *data, double *lags)
 {
-    if(!ahp_xc_mutexes_initialized)
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->mutexes_initialized)
         return;
     int32_t index = ahp_xc_get_crosscorrelation_index(indexes, order);
-    crosscorrelation_thread_args[index].sample = sample;
-    crosscorrelation_thread_args[index].index = index;
-    crosscorrelation_thread_args[index].indexes = indexes;
-    crosscorrelation_thread_args[index].order = order;
-    crosscorrelation_thread_args[index].data = data;
-    crosscorrelation_thread_args[index].lags = lags;
-    _get_crosscorrelation(&crosscorrelation_thread_args[index]);
+    context->cross_args[index].sample = sample;
+    context->cross_args[index].index = index;
+    context->cross_args[index].indexes = indexes;
+    context->cross_args[index].order = order;
+    context->cross_args[index].data = data;
+    context->cross_args[index].lags = lags;
+    context->cross_args[index].planes = NULL;
+    context->cross_args[index].phase_mode = PHASE_EAGER;
+    _get_crosscorrelation(&context->cross_args[index]);
+}
+
+static void scan_decode_cross(scan_queue *queue, const char *packet, uint32_t target)
+{
+    ahp_xc_context *context = queue->context;
+    int32_t z;
+    double ts = get_timestamp(context, (char*)packet);
+    for(z = 0; z < queue->order; z++)
+        queue->lags[z] = ts;
+    ahp_xc_get_crosscorrelation(&queue->correlations[target], queue->inputs, queue->order, packet, queue->lags);
+    queue->decoded++;
 }
 
 static int compare_scan_request_asc(const void *a, const  void *b)
@@ -914,31 +3698,95 @@ static int compare_scan_request_asc(const void *a, const  void *b)
     return ((ahp_xc_scan_request*)a)->len / ((ahp_xc_scan_request*)a)->step < ((ahp_xc_scan_request*)b)->len / ((ahp_xc_scan_request*)b)->step? 1 : -1;
 }
 
+/**
+* \brief find the next line to step in the cross scan
+* The (x, y) cursor walks the polytopes, a new round restarts it while the previous one scheduled a step.
+*/
+static int32_t scan_cross_next(ahp_xc_scan_request *lines, uint32_t nlines, int32_t order, uint32_t *x, int32_t *y, int32_t *scheduled, int32_t more)
+{
+    int32_t round;
+    if(lines[0].cur_chan >= lines[0].start + (off_t)lines[0].step * (off_t)lines[0].len)
+        return -1;
+    for(round = 0; round < 2; round++) {
+        for(; *x < get_npolytopes(nlines, order); (*x)++, *y = 1) {
+            for(; *y < order; (*y)++) {
+                int32_t index = get_line_index(nlines, *x, *y);
+                if(lines[index].cur_chan >= lines[index].start + (off_t)lines[index].step * (off_t)lines[index].len)
+                    continue;
+                (*y)++;
+                *scheduled = 1;
+                return index;
+            }
+        }
+        if(!*scheduled || !more)
+            break;
+        *x = 0;
+        *y = 1;
+        *scheduled = 0;
+    }
+    return -1;
+}
+
+/**
+* \brief queue the commands of the next cross scan step without sending them
+* The batch opens with disabling the capture, so committing it right after a capture ends both.
+*/
+static void scan_cross_prepare(ahp_xc_scan_request *lines, int32_t index, int32_t intensity, int32_t scan_flag)
+{
+    ahp_xc_begin_commands();
+    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+    ahp_xc_set_test_flags(lines[0].index, ahp_xc_get_test_flags(lines[0].index)&~scan_flag);
+    scan_clear_channel(index, !intensity);
+    if(intensity)
+        ahp_xc_set_channel_auto(index, lines[0].start, lines[0].len, lines[0].step);
+    else
+        ahp_xc_set_channel_cross(index, lines[0].start, lines[0].len, lines[0].step);
+    ahp_xc_set_capture_flags((ahp_xc_get_capture_flags()|CAP_RESET_TIMESTAMP)&~CAP_ENABLE);
+    ahp_xc_set_test_flags(lines[0].index, ahp_xc_get_test_flags(lines[0].index)|scan_flag);
+    lines[index].cur_chan += lines[index].step;
+}
+
 int32_t ahp_xc_scan_crosscorrelations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **crosscorrelations, int32_t *interrupt, double *percent)
 {
-    if(!ahp_xc_detected) return 0;
-    size_t k = 0;
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    if(!context->mutexes_initialized) return 0;
+    uint32_t stream_depth = context->streaming ? context->ring.depth : 0;
+    ahp_xc_stop_streaming();
     int i = 0;
     int o = 0;
     uint32_t x = 0;
     int y = 0;
-    int z = 0;
-    double ts = 0.0;
-    double ts0 = 0.0;
+    int32_t failures = 0;
+    int32_t err = 0;
     int order = ahp_xc_get_correlation_order();
-    uint32_t n = ahp_xc_get_bps()/4;
+    int32_t intensity = ahp_xc_intensity_crosscorrelator_enabled();
+    int32_t scan_flag = intensity ? SCAN_AUTO : SCAN_CROSS;
+    uint32_t packetsize = ahp_xc_get_packetsize();
     *crosscorrelations = NULL;
     qsort(lines, nlines, sizeof(ahp_xc_scan_request), &compare_scan_request_asc);
     int32_t size = 1;
-    for(i = 0; i < order; i++) {
+    scan_queue queue;
+    memset(&queue, 0, sizeof(scan_queue));
+    int32_t *inputs = (int*)malloc(sizeof(int)*order);
+    double *lags = (double*)malloc(sizeof(double)*order);
+    if(inputs != NULL && lags != NULL)
+        err = scan_queue_start(context, &queue, scan_decode_cross);
+    else
+        err = -ENOMEM;
+    if(err) {
+        free(inputs);
+        free(lags);
+        if(stream_depth)
+            ahp_xc_start_streaming(stream_depth);
+        return err;
     }
-    int32_t *inputs = (int*)malloc(sizeof(int)*ahp_xc_get_correlation_order());
     ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|(CAP_ENABLE|CAP_RESET_TIMESTAMP));
     for(x = 0; x < get_npolytopes(nlines, order); x++) {
         for(y = 0; y < order; y++) {
             int index = get_line_index(nlines, x, y);
             inputs[y] = lines[index].index;
-            if(ahp_xc_intensity_crosscorrelator_enabled()) {
+            if(intensity) {
                 ahp_xc_end_autocorrelation_scan(lines[index].index);
             } else {
                 ahp_xc_end_crosscorrelation_scan(lines[index].index);
@@ -947,363 +3795,553 @@ int32_t ahp_xc_scan_crosscorrelations(ahp_xc_scan_request *lines, uint32_t nline
             size *= (lines[index].len / lines[index].step);
         }
     }
-    usleep(ahp_xc_get_packettime() * 3000000);
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-    char *buffer = (char*)malloc(ahp_xc_get_packetsize() * lines[0].len / lines[0].step);
-    ahp_xc_sample *correlations = ahp_xc_alloc_samples((unsigned int)size, (unsigned int)ahp_xc_get_crosscorrelator_lagsize());
-    char* sample = (char*)malloc((unsigned int)n+1);
-    sample[n] = 0;
+    scan_settle(context, &queue);
+    int32_t len = lines[0].len / lines[0].step;
+    ahp_xc_sample *correlations = ahp_xc_alloc_samples((unsigned int)size, (unsigned int)ahp_xc_get_crosscorrelator_lagsize()*2-1);
+    queue.correlations = correlations;
+    queue.inputs = inputs;
+    queue.order = order;
+    queue.lags = lags;
     (*percent) = 0;
     o = 0;
-    while(o < size && !*interrupt) {
-        for(x = 0; x < get_npolytopes(nlines, order) && !*interrupt; x++) {
-            for(y = 1; y < order && !*interrupt; y++) {
-                int index = get_line_index(nlines, x, y);
-                if(lines[0].cur_chan >= lines[0].start + (off_t)lines[0].step * (off_t)lines[0].len)
-                    continue;
-                if(lines[index].cur_chan >= lines[index].start + (off_t)lines[index].step * (off_t)lines[index].len)
-                    continue;
-                int capture_flags = ahp_xc_get_capture_flags();
-                ahp_xc_set_capture_flags(capture_flags | CAP_EXTRA_CMD);
-                ahp_xc_select_input(index);
-                ahp_xc_send_command(CLEAR, SET_DELAY);
-                ahp_xc_set_capture_flags(capture_flags);
-                if(ahp_xc_intensity_crosscorrelator_enabled())
-                    ahp_xc_set_channel_auto(index, lines[0].start, lines[0].len, lines[0].step);
-                else
-                    ahp_xc_set_channel_cross(index, lines[0].start, lines[0].len, lines[0].step);
-                usleep(ahp_xc_get_packettime()*1000000);
-
-                ahp_xc_start_crosscorrelation_scan(lines[0].index);
-                lines[index].cur_chan += lines[index].step;
-                i = 0;
-                ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-                ahp_serial_flushRX();
-                ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_ENABLE);
-                ahp_serial_AlignFrame('\r', ahp_xc_get_packetsize());
-                while(i < (int)(lines[0].len/lines[0].step)) {
-                    if(*interrupt)
-                        break;
-                    unsigned char *buf = (unsigned char*)malloc(ahp_xc_get_packetsize());
-                    ahp_serial_RecvBuf((unsigned char*)buf, ahp_xc_get_packetsize());
-                    if(check_sof((char*)buf))
-                        i = 0;
-                    memcpy(buffer+i*ahp_xc_get_packetsize(), buf, ahp_xc_get_packetsize());
-                    free(buf);
-                    (*percent) += 100.0 / size;
-                    i++;
-                }
-                ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-                if(ahp_xc_intensity_crosscorrelator_enabled()) {
-                    ahp_xc_end_autocorrelation_scan(lines[0].index);
-                } else {
-                    ahp_xc_end_crosscorrelation_scan(lines[0].index);
-                }
-                ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-                usleep(ahp_xc_get_packettime() * 3000000);
-                ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
-                k = 0;
-                ts0 = 0.0;
-                while(k < lines[0].len/lines[0].step) {
-                    if(*interrupt)
-                        break;
-                    char *packet = (char*)buffer+k*ahp_xc_get_packetsize();
-                    double *lags = (double*)malloc(sizeof(double)*order);
-                    ts = get_timestamp(packet);
-                    for(z = 0; z < order && !*interrupt; z++)
-                        lags[z] = ts;
-                    ahp_xc_get_crosscorrelation(&correlations[o], inputs, order, packet, lags);
-                    free(lags);
-                    wait_no_threads();
-                    o++;
-                    k++;
+    int32_t planned = 0;
+    int32_t scheduled = 1;
+    x = 0;
+    y = 1;
+    int32_t index = scan_cross_next(lines, nlines, order, &x, &y, &scheduled, planned < size);
+    if(index >= 0) {
+        scan_cross_prepare(lines, index, intensity, scan_flag);
+        planned += len;
+    }
+    while(index >= 0 && !err && !*interrupt) {
+        ahp_xc_commit_commands();
+        frame_reset(context, 1);
+        ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_ENABLE);
+        index = scan_cross_next(lines, nlines, order, &x, &y, &scheduled, planned < size);
+        if(index >= 0) {
+            scan_cross_prepare(lines, index, intensity, scan_flag);
+            planned += len;
+        }
+        i = -1;
+        failures = 0;
+        while(i < len && !*interrupt) {
+            char *packet = scan_queue_slot(&queue);
+            if(frame_recv(context, packet, packetsize) != (int32_t)packetsize) {
+                if(++failures >= len) {
+                    err = -ETIMEDOUT;
+                    break;
                 }
+                i += i >= 0;
+                continue;
+            }
+            if(check_sof(context, packet))
+                i = 0;
+            if(i < 0) {
+                i = 0;
+                continue;
             }
+            scan_queue_push(&queue, o + i);
+            (*percent) += 100.0 / size;
+            i++;
         }
+        if(index < 0)
+            ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~(CAP_ENABLE|CAP_RESET_TIMESTAMP));
+        if(!err && !*interrupt)
+            o += len;
+    }
+    if(index >= 0)
+        ahp_xc_commit_commands();
+    if(intensity) {
+        ahp_xc_end_autocorrelation_scan(lines[0].index);
+    } else {
+        ahp_xc_end_crosscorrelation_scan(lines[0].index);
     }
+    scan_settle(context, &queue);
+    scan_queue_finish(&queue);
+    free(lags);
     free(inputs);
-    free(buffer);
-    free(sample);
+    if(stream_depth)
+        ahp_xc_start_streaming(stream_depth);
+    if(err) {
+        ahp_xc_free_samples(size, correlations);
+        return err;
+    }
     *crosscorrelations = correlations;
     return o;
 }
 
-int32_t ahp_xc_get_packet(ahp_xc_packet *packet)
+static int32_t decode_packet(ahp_xc_context *context, void *lock, char *buf, double *timestamp, uint64_t *counts, ahp_xc_sample *autocorrelations, ahp_xc_sample *crosscorrelations, ahp_xc_correlation_planes *auto_planes, ahp_xc_correlation_planes *cross_planes, int32_t phase_mode)
 {
-    if(!ahp_xc_detected) return 0;
     char* data = NULL;
-    char *sample = NULL;
+    int32_t fused = 0;
     int32_t ret = 1;
     uint32_t x = 0, y = 0;
     int32_t n = ahp_xc_get_bps()/4;
-    if(packet == NULL) {
-        return -EINVAL;
-    }
-    if(pthread_mutex_trylock(((pthread_mutex_t*)packet->lock))) {
-        ret = -EBUSY;
-        goto end;
-    }
-    data = grab_packet(&packet->timestamp);
+    if(pthread_mutex_trylock(((pthread_mutex_t*)lock)))
+        return -EBUSY;
+    fused = !(n & 1) && n <= 16;
+    data = grab_packet(context, buf, timestamp, !fused);
     if(!data){
         ret = -ENOENT;
         goto end;
     }
-    sample = (char*)malloc((unsigned int)n+1);
-    packet->buf = data;
-    const char *buf = packet->buf;
-    buf += ahp_xc_header_len;
-    for(x = 0; x < ahp_xc_get_nlines(); x++) {
-        sample[n] = 0;
-        memcpy(sample, buf, (unsigned int)n);
-        if(1<sscanf(sample, "%lX", &packet->counts[x])) {
-            ret = -ENOENT;
-            goto err_end;
+    if(fused && !check_sof(context, data)) {
+        const ahp_xc_layout *layout = &context->packet_layout;
+        uint32_t checksum = hex_pack(&data[layout->counts_offset], layout->checksum_offset-layout->counts_offset, context->packed_payload);
+        if((checksum & 0xff) != hex_value(&data[layout->checksum_offset], 2)) {
+            fprintf(stderr, "%s error: %s\n", __func__, strerror(EINVAL));
+            ret = -EINVAL;
+            goto end;
         }
-        packet->counts[x] = (packet->counts[x] == 0 ? 1 : packet->counts[x]);
-        buf += n;
+        context->packed_source = data;
+        hex_unpack(context->packed_payload, context->counts_values, ahp_xc_get_nlines(), n, 0);
+    } else {
+        hex_decode(&data[context->packet_layout.counts_offset], context->counts_values, ahp_xc_get_nlines(), n, 0, context->counts_packed);
     }
-    int32_t *inputs = (int*)malloc(sizeof(int)*ahp_xc_get_correlation_order());
-    double *lags = (double*)malloc(sizeof(double)*ahp_xc_get_correlation_order());
+    if(context->recorder.file != NULL)
+        record_packet(context, data);
+    for(x = 0; x < ahp_xc_get_nlines(); x++)
+        counts[x] = (context->counts_values[x] == 0 ? 1 : (uint64_t)context->counts_values[x]);
+    int32_t order = ahp_xc_get_correlation_order();
+    baseline_table *baselines = &context->baselines;
     for(x = 0; x < ahp_xc_get_nbaselines(); x++) {
-        for(y = 0; y < (unsigned int)ahp_xc_get_correlation_order(); y++) {
-            inputs[y] = ahp_xc_get_line_index(x, y);
-            ahp_xc_cross_channel[inputs[y]].cur_chan = ahp_xc_get_current_channel_cross(inputs[y], data) * ahp_xc_get_packettime();
-            lags[y] = (double)ahp_xc_cross_channel[inputs[y]].cur_chan;
+        thread_argument *arg = &context->cross_args[x];
+        for(y = 0; y < (unsigned int)order; y++) {
+            arg->line_indexes[y] = baselines->lines[x * order + y];
+            context->cross_channel[arg->line_indexes[y]].cur_chan = ahp_xc_get_current_channel_cross(arg->line_indexes[y], data) * ahp_xc_get_packettime();
+            arg->line_lags[y] = (double)context->cross_channel[arg->line_indexes[y]].cur_chan;
         }
-        ahp_xc_get_crosscorrelation(&packet->crosscorrelations[x], inputs, ahp_xc_get_correlation_order(), data, lags);
+        arg->sample = crosscorrelations != NULL ? &crosscorrelations[x] : NULL;
+        arg->planes = cross_planes;
+        arg->row = x;
+        arg->phase_mode = phase_mode;
+        arg->index = baselines->slots[baselines_slot(baselines, &baselines->sorted[x * order])];
+        arg->indexes = arg->line_indexes;
+        arg->order = order;
+        arg->data = data;
+        arg->lags = arg->line_lags;
     }
-    free(inputs);
-    free(lags);
-    wait_no_threads();
-    for(x = 0; x < ahp_xc_get_nlines(); x++)
-        ahp_xc_get_autocorrelation(&packet->autocorrelations[x], x, data, ahp_xc_get_current_channel_auto(x, data) * ahp_xc_get_packettime());
-    wait_no_threads();
+    if(ahp_xc_intensity_crosscorrelator_enabled()) {
+        for(x = 0; x < ahp_xc_get_nbaselines(); x++)
+            _get_crosscorrelation(&context->cross_args[x]);
+    } else {
+        pool_run(context, &context->pool, _get_crosscorrelation, context->cross_args, ahp_xc_get_nbaselines());
+    }
+    for(x = 0; x < ahp_xc_get_nlines(); x++) {
+        thread_argument *arg = &context->auto_args[x];
+        arg->sample = autocorrelations != NULL ? &autocorrelations[x] : NULL;
+        arg->planes = auto_planes;
+        arg->row = x;
+        arg->phase_mode = phase_mode;
+        arg->index = x;
+        arg->data = data;
+        arg->lag = ahp_xc_get_current_channel_auto(x, data) * ahp_xc_get_packettime();
+    }
+    pool_run(context, &context->pool, _get_autocorrelation, context->auto_args, ahp_xc_get_nlines());
     ret = 0;
-    goto free_end;
-err_end:
-    fprintf(stderr, "%s: %s\n", __func__, strerror(-ret));
-free_end:
-    free(sample);
-    free(data);
 end:
-    pthread_mutex_unlock(((pthread_mutex_t*)packet->lock));
+    context->packed_source = NULL;
+    pthread_mutex_unlock(((pthread_mutex_t*)lock));
+    return ret;
+}
+
+int32_t ahp_xc_get_packet(ahp_xc_packet *packet)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    if(packet == NULL) {
+        return -EINVAL;
+    }
+    int32_t ret = decode_packet(context, packet->lock, (char*)packet->buf, &packet->timestamp, packet->counts, packet->autocorrelations, packet->crosscorrelations, NULL, NULL, packet->phase_mode);
+    if(!ret)
+        packet->phase_pending = (packet->phase_mode == PHASE_LAZY);
+    return ret;
+}
+
+int32_t ahp_xc_get_planar_packet(ahp_xc_planar_packet *packet)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    if(packet == NULL) {
+        return -EINVAL;
+    }
+    int32_t ret = decode_packet(context, packet->lock, (char*)packet->buf, &packet->timestamp, packet->counts, NULL, NULL, &packet->autocorrelations, &packet->crosscorrelations, packet->phase_mode);
+    if(!ret)
+        packet->phase_pending = (packet->phase_mode == PHASE_LAZY);
     return ret;
 }
 
+void ahp_xc_compute_phase_magnitude(ahp_xc_packet *packet)
+{
+    uint64_t x;
+    if(packet == NULL)
+        return;
+    pthread_mutex_lock(((pthread_mutex_t*)packet->lock));
+    if(packet->phase_pending) {
+        for(x = 0; x < packet->n_lines; x++)
+            correlations_phase_magnitude(packet->autocorrelations[x].correlations, packet->auto_lag);
+        for(x = 0; x < packet->n_baselines; x++)
+            correlations_phase_magnitude(packet->crosscorrelations[x].correlations, packet->cross_lag);
+        packet->phase_pending = 0;
+    }
+    pthread_mutex_unlock(((pthread_mutex_t*)packet->lock));
+}
+
+void ahp_xc_compute_planar_phase_magnitude(ahp_xc_planar_packet *packet)
+{
+    if(packet == NULL)
+        return;
+    pthread_mutex_lock(((pthread_mutex_t*)packet->lock));
+    if(packet->phase_pending) {
+        planes_phase_magnitude(&packet->autocorrelations, 0, packet->n_lines * packet->auto_lag);
+        planes_phase_magnitude(&packet->crosscorrelations, 0, packet->n_baselines * packet->cross_lag);
+        packet->phase_pending = 0;
+    }
+    pthread_mutex_unlock(((pthread_mutex_t*)packet->lock));
+}
+
+static int32_t header_field(const char **buf, int32_t *value, int32_t *len)
+{
+    char n[17];
+    strncpy(n, *buf, 2);
+    n[2] = 0;
+    if(sscanf(n, "%X", len) < 1 || *len < 1 || *len > 16)
+        return -EINVAL;
+    strncpy(n, *buf + 2, *len);
+    n[*len] = 0;
+    if(sscanf(n, "%X", value) < 1)
+        return -EINVAL;
+    *buf += *len + 2;
+    return 0;
+}
+
 int32_t ahp_xc_get_properties()
 {
-    if(!ahp_xc_connected) return -ENOENT;
-    if(ahp_xc_detected) return 0;
-    ahp_xc_header = (char*)malloc(1);
-    ahp_xc_header[0] = 0;
-    ahp_xc_header_len = 0;
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->connected) return -ENOENT;
+    if(context->detected) return 0;
+    hex_init();
+    context->header = (char*)malloc(1);
+    context->header[0] = 0;
+    context->header_len = 0;
     char *data = NULL;
-    int32_t n_read = 0;
+    char *packet = (char*)malloc(ahp_xc_get_packetsize());
+    uint32_t x;
     int32_t ntries = 5;
     int32_t _bps = -1, _nlines = -1, _delaysize = -1, _auto_lagsize = -1, _cross_lagsize = -1, _flags = -1, _tau = -1;
     ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_ENABLE);
     ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_ENABLE);
     while(ntries-- > 0) {
-        data = grab_packet(NULL);
+        data = grab_packet(context, packet, NULL, 1);
         if(data == NULL)
             continue;
         ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_ENABLE);
-        int len = 0;
-        char *n = (char*)malloc(2);
-        char *buf = data;
-        int xc_header_len = 0;
-        n = (char*)realloc(n, 3);
-        strncpy(n, buf, 2);
-        n[2] = 0;
-        int n_read = sscanf(n, "%X", &len);
-        if(n_read < 1)
-            return 1;
-        n = (char*)realloc(n, len+1);
-        buf += 2;
-        strncpy(n, buf, len);
-        n[len] = 0;
-        n_read = sscanf(n, "%X", &_nlines);
-        if(n_read < 1)
-            return 1;
-        xc_header_len += len + 2;
+        int32_t len = 0;
+        const char *buf = data;
+        if(header_field(&buf, &_nlines, &len))
+            break;
         _nlines++;
-        buf += len;
-        n = (char*)realloc(n, 3);
-        strncpy(n, buf, 2);
-        n[2] = 0;
-        n_read = sscanf(n, "%X", &len);
-        if(n_read < 1)
-            return 1;
-        n = (char*)realloc(n, len+1);
-        buf += 2;
-        strncpy(n, buf, len);
-        n[len] = 0;
-        n_read = sscanf(n, "%X", &_bps);
-        if(n_read < 1)
-            return 1;
-        xc_header_len += len + 2;
+        if(header_field(&buf, &_bps, &len))
+            break;
         _bps++;
-        buf += len;
-        n = (char*)realloc(n, 3);
-        strncpy(n, buf, 2);
-        n[2] = 0;
-        n_read = sscanf(n, "%X", &len);
-        if(n_read < 1)
-            return 1;
-        n = (char*)realloc(n, len+1);
-        buf += 2;
-        strncpy(n, buf, len);
-        n[len] = 0;
-        n_read = sscanf(n, "%X", &_delaysize);
-        if(n_read < 1)
-            return 1;
-        ahp_xc_delaysize_len = len;
-        xc_header_len += len + 2;
-        buf += len;
-        n = (char*)realloc(n, 3);
-        strncpy(n, buf, 2);
-        n[2] = 0;
-        n_read = sscanf(n, "%X", &len);
-        if(n_read < 1)
-            return 1;
-        n = (char*)realloc(n, len+1);
-        buf += 2;
-        strncpy(n, buf, len);
-        n[len] = 0;
-        n_read = sscanf(n, "%X", &_auto_lagsize);
-        if(n_read < 1)
-            return 1;
-        xc_header_len += len + 2;
+        if(header_field(&buf, &_delaysize, &len))
+            break;
+        context->delaysize_len = len;
+        if(header_field(&buf, &_auto_lagsize, &len))
+            break;
         _auto_lagsize++;
-        buf += len;
-        n = (char*)realloc(n, 3);
-        strncpy(n, buf, 2);
-        n[2] = 0;
-        n_read = sscanf(n, "%X", &len);
-        if(n_read < 1)
-            return 1;
-        n = (char*)realloc(n, len+1);
-        buf += 2;
-        strncpy(n, buf, len);
-        n[len] = 0;
-        n_read = sscanf(n, "%X", &_cross_lagsize);
-        if(n_read < 1)
-            return 1;
-        xc_header_len += len + 2;
+        if(header_field(&buf, &_cross_lagsize, &len))
+            break;
         _cross_lagsize++;
-        buf += len;
-        n_read = sscanf(buf, "%02X%04X", &_flags, &_tau);
-        if(n_read == 2) {
-            xc_header_len += 6;
-            ahp_xc_header_len = xc_header_len;
-            ahp_xc_header = (char*)realloc(ahp_xc_header, ahp_xc_header_len+1);
-            strncpy(ahp_xc_header, (char*)data, ahp_xc_header_len);
-            ahp_xc_header[ahp_xc_header_len] = 0;
-            free(data);
+        if(sscanf(buf, "%02X%04X", &_flags, &_tau) == 2) {
+            context->header_len = (int32_t)(buf - data) + 6;
+            context->header = (char*)realloc(context->header, context->header_len+1);
+            strncpy(context->header, (char*)data, context->header_len);
+            context->header[context->header_len] = 0;
             break;
         }
-        free(n);
-        free(data);
     }
+    free(packet);
     ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_ENABLE);
-    if(ahp_xc_header_len == 0)
+    frame_reset(context, 0);
+    if(context->header_len == 0)
         return -ENODEV;
-    ahp_xc_flags = _flags;
-    ahp_xc_bps = _bps;
-    ahp_xc_nlines = _nlines;
-    ahp_xc_nbaselines = (ahp_xc_flags & HAS_CROSSCORRELATOR) ? (ahp_xc_nlines*(ahp_xc_nlines-1)/2) : 0;
-    ahp_xc_delaysize = _delaysize;
-    ahp_xc_auto_lagsize = _auto_lagsize;
-    ahp_xc_cross_lagsize = _cross_lagsize;
-    ahp_xc_packetsize = (ahp_xc_nlines+ahp_xc_auto_lagsize*ahp_xc_nlines*2+(ahp_xc_cross_lagsize*2-1)*ahp_xc_nbaselines*2)*ahp_xc_bps/4+ahp_xc_delaysize_len*ahp_xc_nlines*2+ahp_xc_header_len+16+2+1;
-    ahp_xc_frequency = 1000000000000.0/(!_tau?1:_tau);
-    sign = (pow(2, ahp_xc_bps-1));
-    fill = sign|(sign - 1);
-
-    if(ahp_xc_mutexes_initialized) {
-        int nbaselines = ahp_xc_nlines * (ahp_xc_nlines - 1) / 2;
-        if(crosscorrelation_threads)
-            crosscorrelation_threads = (pthread_t*)realloc(crosscorrelation_threads, sizeof(pthread_t)*nbaselines);
+    context->flags = _flags;
+    context->bps = _bps;
+    context->nlines = _nlines;
+    context->nbaselines = (context->flags & HAS_CROSSCORRELATOR) ? (context->nlines*(context->nlines-1)/2) : 0;
+    context->delaysize = _delaysize;
+    context->auto_lagsize = _auto_lagsize;
+    context->cross_lagsize = _cross_lagsize;
+    context->packetsize = (context->nlines+context->auto_lagsize*context->nlines*2+(context->cross_lagsize*2-1)*context->nbaselines*2)*context->bps/4+context->delaysize_len*context->nlines*2+context->header_len+16+2+1;
+    context->frequency = 1000000000000.0/(!_tau?1:_tau);
+    context->packet_layout.packet_size = context->packetsize;
+    context->packet_layout.header_len = context->header_len;
+    context->packet_layout.field_len = context->bps/4;
+    context->packet_layout.counts_offset = context->header_len;
+    context->packet_layout.auto_offset = context->packet_layout.counts_offset+context->nlines*context->packet_layout.field_len;
+    context->packet_layout.auto_line_stride = context->auto_lagsize*2*context->packet_layout.field_len;
+    context->packet_layout.cross_offset = context->packet_layout.auto_offset+context->nlines*context->packet_layout.auto_line_stride;
+    context->packet_layout.cross_baseline_stride = (context->cross_lagsize*2-1)*2*context->packet_layout.field_len;
+    context->packet_layout.timestamp_offset = context->packetsize-19;
+    context->packet_layout.checksum_offset = context->packetsize-3;
+    context->packet_layout.channel_len = context->delaysize_len;
+    context->packet_layout.channel_stride = -context->delaysize_len;
+    context->packet_layout.cross_channel_offset = context->packet_layout.timestamp_offset-context->delaysize_len;
+    context->packet_layout.auto_channel_offset = context->packet_layout.cross_channel_offset-context->delaysize_len*context->nlines;
+    context->sign = (pow(2, context->bps-1));
+
+    if(context->mutexes_initialized) {
+        int nbaselines = context->nlines * (context->nlines - 1) / 2;
+        if(context->cross_threads)
+            context->cross_threads = (pthread_t*)realloc(context->cross_threads, sizeof(pthread_t)*nbaselines);
         else
-            crosscorrelation_threads = (pthread_t*)malloc(sizeof(pthread_t)*nbaselines);
-        memset(crosscorrelation_threads, 0, sizeof(pthread_t)*nbaselines);
-        if(crosscorrelation_thread_args)
-            crosscorrelation_thread_args = (thread_argument*)realloc(crosscorrelation_thread_args, sizeof(thread_argument)*nbaselines);
+            context->cross_threads = (pthread_t*)malloc(sizeof(pthread_t)*nbaselines);
+        memset(context->cross_threads, 0, sizeof(pthread_t)*nbaselines);
+        if(context->cross_args)
+            context->cross_args = (thread_argument*)realloc(context->cross_args, sizeof(thread_argument)*nbaselines);
         else
-            crosscorrelation_thread_args = (thread_argument*)malloc(sizeof(thread_argument)*nbaselines);
-        memset(crosscorrelation_thread_args, 0, sizeof(thread_argument)*nbaselines);
-        if(autocorrelation_threads)
-            autocorrelation_threads = (pthread_t*)realloc(autocorrelation_threads, sizeof(pthread_t)*ahp_xc_nlines);
+            context->cross_args = (thread_argument*)malloc(sizeof(thread_argument)*nbaselines);
+        memset(context->cross_args, 0, sizeof(thread_argument)*nbaselines);
+        if(context->auto_threads)
+            context->auto_threads = (pthread_t*)realloc(context->auto_threads, sizeof(pthread_t)*context->nlines);
         else
-            autocorrelation_threads = (pthread_t*)malloc(sizeof(pthread_t)*ahp_xc_nlines);
-        memset(autocorrelation_threads, 0, sizeof(pthread_t)*ahp_xc_nlines);
-        if(autocorrelation_thread_args)
-            autocorrelation_thread_args = (thread_argument*)realloc(autocorrelation_thread_args, sizeof(thread_argument)*ahp_xc_nlines);
+            context->auto_threads = (pthread_t*)malloc(sizeof(pthread_t)*context->nlines);
+        memset(context->auto_threads, 0, sizeof(pthread_t)*context->nlines);
+        if(context->auto_args)
+            context->auto_args = (thread_argument*)realloc(context->auto_args, sizeof(thread_argument)*context->nlines);
         else
-            autocorrelation_thread_args = (thread_argument*)malloc(sizeof(thread_argument)*ahp_xc_nlines);
-        memset(autocorrelation_thread_args, 0, sizeof(thread_argument)*ahp_xc_nlines);
+            context->auto_args = (thread_argument*)malloc(sizeof(thread_argument)*context->nlines);
+        memset(context->auto_args, 0, sizeof(thread_argument)*context->nlines);
     }
-    nthreads = 0;
-    if(ahp_xc_auto_channel)
-        ahp_xc_auto_channel = (ahp_xc_scan_request*)realloc(ahp_xc_auto_channel, sizeof(ahp_xc_scan_request)*ahp_xc_nlines);
+    if(context->auto_channel)
+        context->auto_channel = (ahp_xc_scan_request*)realloc(context->auto_channel, sizeof(ahp_xc_scan_request)*context->nlines);
+    else
+        context->auto_channel = (ahp_xc_scan_request*)malloc(sizeof(ahp_xc_scan_request)*context->nlines);
+    memset(context->auto_channel, 0, sizeof(ahp_xc_scan_request)*context->nlines);
+    if(context->cross_channel)
+        context->cross_channel = (ahp_xc_scan_request*)realloc(context->cross_channel, sizeof(ahp_xc_scan_request)*context->nlines);
     else
-        ahp_xc_auto_channel = (ahp_xc_scan_request*)malloc(sizeof(ahp_xc_scan_request)*ahp_xc_nlines);
-    memset(ahp_xc_auto_channel, 0, sizeof(ahp_xc_scan_request)*ahp_xc_nlines);
-    if(ahp_xc_cross_channel)
-        ahp_xc_cross_channel = (ahp_xc_scan_request*)realloc(ahp_xc_cross_channel, sizeof(ahp_xc_scan_request)*ahp_xc_nlines);
+        context->cross_channel = (ahp_xc_scan_request*)malloc(sizeof(ahp_xc_scan_request)*context->nlines);
+    memset(context->cross_channel, 0, sizeof(ahp_xc_scan_request)*context->nlines);
+    if(context->test)
+        context->test = (unsigned char*)realloc(context->test, context->nlines);
     else
-        ahp_xc_cross_channel = (ahp_xc_scan_request*)malloc(sizeof(ahp_xc_scan_request)*ahp_xc_nlines);
-    memset(ahp_xc_cross_channel, 0, sizeof(ahp_xc_scan_request)*ahp_xc_nlines);
-    if(ahp_xc_test)
-        ahp_xc_test = (unsigned char*)realloc(ahp_xc_test, ahp_xc_nlines);
+        context->test = (unsigned char*)malloc(context->nlines);
+    memset(context->test, 0, context->nlines);
+    if(context->leds)
+        context->leds = (unsigned char*)realloc(context->leds, context->nlines);
     else
-        ahp_xc_test = (unsigned char*)malloc(ahp_xc_nlines);
-    memset(ahp_xc_test, 0, ahp_xc_nlines);
-    if(ahp_xc_leds)
-        ahp_xc_leds = (unsigned char*)realloc(ahp_xc_leds, ahp_xc_nlines);
+        context->leds = (unsigned char*)malloc(context->nlines);
+    memset(context->leds, 0, context->nlines);
+    shadow_alloc(context, context->nlines);
+    if(context->mutexes_initialized) {
+        int nbaselines = context->nlines * (context->nlines - 1) / 2;
+        size_t fields = fmax(context->nlines, fmax(context->auto_lagsize*2, (context->cross_lagsize*2-1)*2));
+        size_t packed = fields * (sizeof(int64_t) + sizeof(uint64_t)) + sizeof(uint64_t);
+        size_t stride = (packed + context->nlines * (sizeof(double) + sizeof(int32_t)) + 63) & ~63;
+        if(context->decode_scratch)
+            context->decode_scratch = (unsigned char*)realloc(context->decode_scratch, stride*(context->nlines+nbaselines+1));
+        else
+            context->decode_scratch = (unsigned char*)malloc(stride*(context->nlines+nbaselines+1));
+        unsigned char *scratch = context->decode_scratch;
+        for(x = 0; x < context->nlines; x++, scratch += stride) {
+            context->auto_args[x].context = context;
+            context->auto_args[x].values = (int64_t*)scratch;
+            context->auto_args[x].packed = scratch + fields * sizeof(int64_t);
+        }
+        for(x = 0; x < nbaselines; x++, scratch += stride) {
+            context->cross_args[x].context = context;
+            context->cross_args[x].values = (int64_t*)scratch;
+            context->cross_args[x].packed = scratch + fields * sizeof(int64_t);
+            context->cross_args[x].line_lags = (double*)(scratch + packed);
+            context->cross_args[x].line_indexes = (int32_t*)(scratch + packed + context->nlines * sizeof(double));
+        }
+        context->counts_values = (int64_t*)scratch;
+        context->counts_packed = scratch + fields * sizeof(int64_t);
+    }
+    if(context->packed_payload)
+        context->packed_payload = (unsigned char*)realloc(context->packed_payload, context->packetsize/2+sizeof(uint64_t));
     else
-        ahp_xc_leds = (unsigned char*)malloc(ahp_xc_nlines);
-    memset(ahp_xc_leds, 0, ahp_xc_nlines);
-    ahp_xc_detected = 1;
+        context->packed_payload = (unsigned char*)malloc(context->packetsize/2+sizeof(uint64_t));
+    ahp_xc_free_samples(context->line_samples_len, context->line_samples);
+    context->line_samples = ahp_xc_alloc_samples(context->nlines, context->auto_lagsize);
+    context->line_samples_len = context->nlines;
+    ahp_xc_free_samples(1, context->planar_sample);
+    context->planar_sample = ahp_xc_alloc_samples(1, context->cross_lagsize*2-1);
+    if(baselines_build(context, context->nlines, context->correlation_order) == -ENOMEM)
+        return -ENOMEM;
+    context->detected = 1;
     return 0;
 }
 
 int32_t ahp_xc_set_capture_flags(xc_capture_flags flags)
 {
-    if(!ahp_xc_connected) return -ENOENT;
-    ahp_xc_max_lost_packets = 1;
-    ahp_xc_capture_flags = flags;
-    return (int)ahp_xc_send_command(ENABLE_CAPTURE, (unsigned char)ahp_xc_capture_flags);
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->connected) return -ENOENT;
+    context->max_lost_packets = 1;
+    context->capture_flags = flags;
+    if(context->shadow.capture == (context->capture_flags&0xf)) {
+        context->shadow.suppressed++;
+        return 0;
+    }
+    context->shadow.capture = context->capture_flags&0xf;
+    return (int)ahp_xc_send_command(ENABLE_CAPTURE, (unsigned char)context->capture_flags);
 }
 
 xc_capture_flags ahp_xc_get_capture_flags()
 {
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_capture_flags;
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return context->capture_flags;
 }
 
-void ahp_xc_set_baudrate(baud_rate rate)
+static int32_t switch_baudrate(ahp_xc_context *context, int32_t rate)
 {
-    if(!ahp_xc_detected) return;
-    ahp_xc_rate = rate;
+    if(!context->detected) return -ENOENT;
+    if(context->replay.map != NULL) return -EINVAL;
+    if(rate < 0 || rate > 0xf) return -EINVAL;
+    if(ahp_serial_SetBaudrate(context->port, context->baserate << rate))
+        return -ENOTSUP;
+    ahp_serial_SetBaudrate(context->port, ahp_xc_get_baudrate());
     ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_EXTRA_CMD);
     ahp_xc_send_command(SET_BAUD_RATE, (unsigned char)rate);
-    ahp_serial_CloseComport();
-    ahp_serial_OpenComport(ahp_xc_comport);
-    ahp_serial_SetupPort(ahp_xc_baserate*pow(2, (int)ahp_xc_rate), "8N2", 0);
+    flush_commands(context);
+    context->rate = rate;
+    ahp_xc_invalidate_device_state();
+    ahp_serial_SetBaudrate(context->port, ahp_xc_get_baudrate());
+    if(!context->streaming)
+        frame_reset(context, 0);
+    context->link.switch_lost = 0;
+    context->link_switch_mark = rx_errors(context);
+    context->link_switch_pending = 1;
+    return 0;
+}
+
+void ahp_xc_set_baudrate(baud_rate rate)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    switch_baudrate(context, rate);
+}
+
+int32_t ahp_xc_set_baudrate_multiplier(uint32_t multiplier)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    int32_t rate = 0;
+    if(multiplier == 0 || (multiplier & (multiplier - 1)))
+        return -EINVAL;
+    while(multiplier >>= 1)
+        rate++;
+    return switch_baudrate(context, rate);
+}
+
+static double measure_link(ahp_xc_context *context, uint32_t burst, uint32_t *received)
+{
+    uint32_t good = 0, failed = 0, idle = 0;
+    char *buf = (char*)malloc(ahp_xc_get_packetsize());
+    if(buf == NULL)
+        return 1.0;
+    int flags = ahp_xc_get_capture_flags();
+    frame_reset(context, 1);
+    ahp_xc_set_capture_flags(flags|CAP_ENABLE);
+    uint64_t discarded = context->rx_discarded;
+    while(good + failed + (context->rx_discarded - discarded) < burst) {
+        if(grab_packet(context, buf, NULL, 1) != NULL)
+            good++;
+        else if(errno == EINVAL || errno == ERANGE)
+            failed++;
+        else if(++idle > burst)
+            failed = burst;
+    }
+    ahp_xc_set_capture_flags(flags);
+    free(buf);
+    uint64_t total = good + failed + (context->rx_discarded - discarded);
+    *received = good;
+    return (double)(total - good) / (double)total;
+}
+
+int32_t ahp_xc_negotiate_baudrate(uint32_t max_multiplier, uint32_t burst, double max_error_rate)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    int32_t rate, retry;
+    uint32_t received = 0;
+    if(!context->detected) return -ENOENT;
+    if(context->replay.map != NULL || context->streaming) return -EINVAL;
+    if(burst == 0)
+        burst = AHP_XC_LINK_BURST;
+    int32_t best = context->rate;
+    double error_rate = measure_link(context, burst, &received);
+    uint32_t best_received = received;
+    for(rate = best + 1; rate <= 0xf && (1u << rate) <= max_multiplier; rate++) {
+        if(switch_baudrate(context, rate))
+            break;
+        double measured = measure_link(context, burst, &received);
+        if(measured <= max_error_rate) {
+            best = rate;
+            error_rate = measured;
+            best_received = received;
+            continue;
+        }
+        for(retry = 0; retry < 3; retry++) {
+            if(retry > 0)
+                switch_baudrate(context, rate);
+            switch_baudrate(context, best);
+            error_rate = measure_link(context, burst, &best_received);
+            if(error_rate <= max_error_rate)
+                break;
+        }
+        break;
+    }
+    context->link.error_rate = error_rate;
+    context->link.packets = best_received;
+    return error_rate <= max_error_rate ? 0 : -EIO;
+}
+
+void ahp_xc_set_link_negotiation(uint32_t max_multiplier, uint32_t burst, double max_error_rate)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    context->link_max_multiplier = max_multiplier;
+    context->link_burst = burst;
+    context->link_max_error_rate = max_error_rate;
+}
+
+void ahp_xc_get_link_status(ahp_xc_link_status *status)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(status == NULL) return;
+    if(context->link_switch_pending)
+        link_switch_settle(context);
+    *status = context->link;
+    status->multiplier = 1u << context->rate;
+    status->baudrate = ahp_xc_get_actual_baudrate();
 }
 
-void ahp_xc_set_correlation_order(uint32_t order)
+int32_t ahp_xc_set_correlation_order(uint32_t order)
 {
-    if(!ahp_xc_detected) return;
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return -ENOENT;
     int32_t idx = 0;
     if(order >= ahp_xc_get_nlines())
-        return;
-    ahp_xc_correlation_order = fmax(2, order);
+        return -EINVAL;
+    uint32_t previous = context->correlation_order;
+    context->correlation_order = fmax(2, order);
+    if(context->baselines.order != context->correlation_order) {
+        int32_t err = baselines_build(context, context->nlines, context->correlation_order);
+        if(err) {
+            context->correlation_order = previous;
+            baselines_build(context, context->nlines, previous);
+            return err;
+        }
+    }
     order -= 2;
+    int len = nibble_count(order);
+    if(context->shadow.order == (int32_t)order) {
+        context->shadow.suppressed += len + 2;
+        return 0;
+    }
+    context->shadow.order = order;
+    ahp_xc_begin_commands();
     ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_EXTRA_CMD);
-    int len = (((int)log2(order) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
     ahp_xc_send_command(CLEAR, SET_BAUD_RATE);
     ahp_xc_send_command(SET_BAUD_RATE, (unsigned char)(len&0xf));
     for(idx = 0; idx < len; idx ++) {
@@ -1311,169 +4349,192 @@ void ahp_xc_set_correlation_order(uint32_t order)
         order >>= 4;
     }
     ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_EXTRA_CMD);
+    return ahp_xc_commit_commands();
 }
 
 int32_t ahp_xc_get_correlation_order()
 {
-    return ahp_xc_correlation_order;
+    ahp_xc_context *context = ahp_xc_current;
+    return context->correlation_order;
 }
 
 unsigned char ahp_xc_get_test_flags(uint32_t index)
 {
-    if(!ahp_xc_detected) return 0;
-    return ahp_xc_test[index];
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
+    return context->test[index];
 }
 
 unsigned char ahp_xc_get_leds(uint32_t index)
 {
-    if(!ahp_xc_detected) return 0;
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return 0;
     if(!ahp_xc_has_leds())
         return 0;
-    return ahp_xc_leds[index];
+    return context->leds[index];
 }
 
 void ahp_xc_set_leds(uint32_t index, int32_t leds)
 {
-    if(!ahp_xc_detected) return;
-    ahp_xc_leds[index] = (unsigned char)leds;
-    ahp_xc_select_input(index);
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_EXTRA_CMD);
-    ahp_xc_send_command(SET_LEDS, (unsigned char)((leds & (0xf & ~AHP_XC_LEDS_MASK)) | (ahp_xc_has_leds() ? leds & AHP_XC_LEDS_MASK : 0)));
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
+    if(index >= ahp_xc_get_nlines())
+        return;
+    context->leds[index] = (unsigned char)leds;
+    int32_t low = (leds & (0xf & ~AHP_XC_LEDS_MASK)) | (ahp_xc_has_leds() ? leds & AHP_XC_LEDS_MASK : 0);
     leds >>= 4;
-    ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_EXTRA_CMD);
-    ahp_xc_send_command(SET_LEDS, (unsigned char)((leds & (0xf & ~AHP_XC_LEDS_MASK)) | (ahp_xc_has_leds() ? leds & AHP_XC_LEDS_MASK : 0)));
+    int32_t high = (leds & (0xf & ~AHP_XC_LEDS_MASK)) | (ahp_xc_has_leds() ? leds & AHP_XC_LEDS_MASK : 0);
+    int32_t shadow = index < context->shadow.lines ? context->shadow.leds[index] : -1;
+    int32_t send_low = shadow < 0 || (shadow & 0xf) != low;
+    int32_t send_high = shadow < 0 || ((shadow >> 4) & 0xf) != high;
+    context->shadow.suppressed += !send_low + !send_high;
+    if(!send_low && !send_high)
+        return;
+    if(index < context->shadow.lines)
+        context->shadow.leds[index] = low | (high << 4);
+    ahp_xc_begin_commands();
+    ahp_xc_select_input(index);
+    if(send_low) {
+        ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_EXTRA_CMD);
+        ahp_xc_send_command(SET_LEDS, (unsigned char)low);
+    }
+    if(send_high) {
+        ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()|CAP_EXTRA_CMD);
+        ahp_xc_send_command(SET_LEDS, (unsigned char)high);
+    }
     ahp_xc_set_capture_flags(ahp_xc_get_capture_flags()&~CAP_EXTRA_CMD);
+    ahp_xc_commit_commands();
 }
 
-void ahp_xc_set_channel_cross(uint32_t index, off_t value, size_t size, size_t step)
+static void set_delay_register(ahp_xc_context *context, uint32_t index, int32_t reg, int32_t flags, int32_t bank, uint64_t value, int64_t *shadow)
 {
-    if(!ahp_xc_detected) return;
     int32_t idx = 0;
-    if(value+size >= ahp_xc_get_delaysize())
+    int32_t len = nibble_count(value);
+    if(*shadow == (int64_t)value) {
+        context->shadow.suppressed += len + 2;
         return;
-    ahp_xc_cross_channel[index].start = value;
-    ahp_xc_cross_channel[index].len = size;
-    ahp_xc_cross_channel[index].step = step;
-    int capture_flags = ahp_xc_get_capture_flags();
-    int flags = ahp_xc_get_test_flags(index)&~TEST_STEP;
-    int len = (((int)log2(step) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_set_test_flags(index, flags);
-    ahp_xc_set_capture_flags(CAP_EXTRA_CMD);
-    ahp_xc_select_input(index);
-    ahp_xc_send_command(CLEAR, SET_DELAY);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(step&0xf));
-        step >>= 4;
     }
-    len = (((int)log2(size) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
+    *shadow = (int64_t)value;
     ahp_xc_select_input(index);
-    ahp_xc_set_test_flags(index, flags|0x10);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(size&0xf));
-        size >>= 4;
-    }
-    len = (((int)log2(value) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_select_input(index);
-    ahp_xc_set_test_flags(index, flags|0x20);
+    ahp_xc_set_test_flags(index, flags|(reg<<4));
+    ahp_xc_set_capture_flags(bank);
     ahp_xc_send_command(CLEAR, CLEAR);
     ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
     for(idx = 0; idx < len; idx ++) {
         ahp_xc_send_command(SET_DELAY, (unsigned char)(value&0xf));
         value >>= 4;
     }
-    ahp_xc_set_test_flags(index, flags|TEST_STEP);
-    ahp_xc_set_capture_flags(capture_flags);
 }
 
-void ahp_xc_set_channel_auto(uint32_t index, off_t value, size_t size, size_t step)
+static void set_channel(ahp_xc_context *context, uint32_t index, int32_t cross, off_t value, size_t size, size_t step)
 {
-    if(!ahp_xc_detected) return;
-    int32_t idx = 0;
-    if(value+size >= ahp_xc_get_delaysize())
-        return;
-    ahp_xc_auto_channel[index].start = value;
-    ahp_xc_auto_channel[index].len = size;
-    ahp_xc_auto_channel[index].step = step;
+    int64_t unshadowed[3] = { -1, -1, -1 };
+    int64_t *shadow = index < context->shadow.lines ? &context->shadow.delay[(index*2+cross)*3] : unshadowed;
     int capture_flags = ahp_xc_get_capture_flags();
     int flags = ahp_xc_get_test_flags(index)&~TEST_STEP;
-    int len = (((int)log2(step) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_set_test_flags(index, flags);
-    ahp_xc_set_capture_flags(0);
-    ahp_xc_select_input(index);
-    ahp_xc_send_command(CLEAR, SET_DELAY);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(step&0xf));
-        step >>= 4;
-    }
-    len = (((int)log2(size) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_select_input(index);
-    ahp_xc_set_test_flags(index, flags|0x10);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(size&0xf));
-        size >>= 4;
-    }
-    len = (((int)log2(value) & ~3) + 4) / 4;
-    if(len < 0) len = 1;
-    ahp_xc_select_input(index);
-    ahp_xc_set_test_flags(index, flags|0x20);
-    ahp_xc_send_command(CLEAR, CLEAR);
-    ahp_xc_send_command(SET_DELAY, (unsigned char)(len&0xf));
-    for(idx = 0; idx < len; idx ++) {
-        ahp_xc_send_command(SET_DELAY, (unsigned char)(value&0xf));
-        value >>= 4;
+    int bank = cross ? CAP_EXTRA_CMD : 0;
+    ahp_xc_begin_commands();
+    if(shadow[0] < 0 || shadow[1] < 0 || shadow[2] < 0) {
+        ahp_xc_set_test_flags(index, flags);
+        ahp_xc_set_capture_flags(bank);
+        ahp_xc_select_input(index);
+        ahp_xc_send_command(CLEAR, SET_DELAY);
     }
+    set_delay_register(context, index, 0, flags, bank, step, &shadow[0]);
+    set_delay_register(context, index, 1, flags, bank, size, &shadow[1]);
+    set_delay_register(context, index, 2, flags, bank, value, &shadow[2]);
     ahp_xc_set_test_flags(index, flags|TEST_STEP);
     ahp_xc_set_capture_flags(capture_flags);
+    ahp_xc_commit_commands();
+}
+
+void ahp_xc_set_channel_cross(uint32_t index, off_t value, size_t size, size_t step)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
+    if(index >= ahp_xc_get_nlines())
+        return;
+    if(value+size >= ahp_xc_get_delaysize())
+        return;
+    context->cross_channel[index].start = value;
+    context->cross_channel[index].len = size;
+    context->cross_channel[index].step = step;
+    set_channel(context, index, 1, value, size, step);
+}
+
+void ahp_xc_set_channel_auto(uint32_t index, off_t value, size_t size, size_t step)
+{
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
+    if(index >= ahp_xc_get_nlines())
+        return;
+    if(value+size >= ahp_xc_get_delaysize())
+        return;
+    context->auto_channel[index].start = value;
+    context->auto_channel[index].len = size;
+    context->auto_channel[index].step = step;
+    set_channel(context, index, 0, value, size, step);
 }
 
 void ahp_xc_set_voltage(uint32_t index, unsigned char value)
 {
-    if(!ahp_xc_detected) return;
-    ahp_xc_select_input(index);
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
+    if(index >= ahp_xc_get_nlines())
+        return;
     value = (unsigned char)(value < 0xff ? value : 0xff);
-    ahp_xc_voltage = value;
+    context->voltage = value;
+    int32_t shadow = index < context->shadow.lines ? context->shadow.voltage[index] : -1;
+    int32_t send_low = shadow < 0 || ((shadow ^ value) & 0xf);
+    int32_t send_high = shadow < 0 || ((shadow ^ value) & 0xf0);
+    context->shadow.suppressed += !send_low + !send_high;
+    if(!send_low && !send_high)
+        return;
+    if(index < context->shadow.lines)
+        context->shadow.voltage[index] = value;
     int flags = ahp_xc_get_capture_flags();
-    ahp_xc_set_capture_flags(0);
-    ahp_xc_send_command(SET_VOLTAGE, (unsigned char)(ahp_xc_voltage&0xf));
-    ahp_xc_set_capture_flags(CAP_EXTRA_CMD);
-    ahp_xc_send_command(SET_VOLTAGE, (unsigned char)((ahp_xc_voltage>>4)&0xf));
+    ahp_xc_begin_commands();
+    ahp_xc_select_input(index);
+    if(send_low) {
+        ahp_xc_set_capture_flags(flags&~CAP_EXTRA_CMD);
+        ahp_xc_send_command(SET_VOLTAGE, (unsigned char)(context->voltage&0xf));
+    }
+    if(send_high) {
+        ahp_xc_set_capture_flags(flags|CAP_EXTRA_CMD);
+        ahp_xc_send_command(SET_VOLTAGE, (unsigned char)((context->voltage>>4)&0xf));
+    }
     ahp_xc_set_capture_flags(flags);
+    ahp_xc_commit_commands();
 }
 
 void ahp_xc_set_test_flags(uint32_t index, int32_t value)
 {
-    if(!ahp_xc_detected) return;
-    ahp_xc_select_input(index);
-    ahp_xc_test[index] = value;
+    ahp_xc_context *context = ahp_xc_current;
+    if(!context->detected) return;
+    if(index >= ahp_xc_get_nlines())
+        return;
+    context->test[index] = value;
+    int32_t shadow = index < context->shadow.lines ? context->shadow.test[index] : -1;
+    int32_t send_low = shadow < 0 || ((shadow ^ context->test[index]) & 0xf);
+    int32_t send_high = shadow < 0 || ((shadow ^ context->test[index]) & 0xf0);
+    context->shadow.suppressed += !send_low + !send_high;
+    if(!send_low && !send_high)
+        return;
+    if(index < context->shadow.lines)
+        context->shadow.test[index] = context->test[index];
     int flags = ahp_xc_get_capture_flags();
-    ahp_xc_set_capture_flags(0);
-    ahp_xc_send_command(ENABLE_TEST, (unsigned char)(ahp_xc_test[index]&0xf));
-    ahp_xc_set_capture_flags(CAP_EXTRA_CMD);
-    ahp_xc_send_command(ENABLE_TEST, (unsigned char)((ahp_xc_test[index]>>4)&0xf));
+    ahp_xc_begin_commands();
+    ahp_xc_select_input(index);
+    if(send_low) {
+        ahp_xc_set_capture_flags(flags&~CAP_EXTRA_CMD);
+        ahp_xc_send_command(ENABLE_TEST, (unsigned char)(context->test[index]&0xf));
+    }
+    if(send_high) {
+        ahp_xc_set_capture_flags(flags|CAP_EXTRA_CMD);
+        ahp_xc_send_command(ENABLE_TEST, (unsigned char)((context->test[index]>>4)&0xf));
+    }
     ahp_xc_set_capture_flags(flags);
-}
-
- int32_t ahp_xc_send_command(xc_cmd cmd, unsigned char value)
-{
-    if(!ahp_xc_connected) return -ENOENT;
-    int32_t err = 0;
-    unsigned char c = (unsigned char)(cmd|(value<<4));
-    ahp_serial_flushTX();
-    err |= ahp_serial_SendByte(c);
-    return err;
+    ahp_xc_commit_commands();
 }
 
 double* ahp_xc_get_2d_projection(double alt, double az, double *baseline)
@@ -112,6 +112,14 @@ DLL_EXPORT void ahp_set_stderr(FILE *f);
 #define AHP_XC_VERSION @AHP_XC_VERSION@
 ///The base baud rate of the XC cross-correlators
 #define XC_BASE_RATE ((int)57600)
+///Default number of packets validated at each baud rate during negotiation
+#define AHP_XC_LINK_BURST 16
+///Packets buffered between acquisition and decoding during a streaming scan
+#define AHP_XC_SCAN_QUEUE_DEPTH 4
+///Magic bytes at the start of a scan file
+#define AHP_XC_SCAN_FILE_MAGIC "AHPXCSCN"
+///Layout version of the scan files
+#define AHP_XC_SCAN_FILE_VERSION 1
 ///The PLL frequency of the XC cross-correlators
 #define AHP_XC_PLL_FREQUENCY 400000000
 ///The bitwise mask of the led lines enabled when HAS_LEDS is true
@@ -203,6 +211,18 @@ TEST_STEP = 3<<4,
 TEST_ALL = 0xf,
 } xc_test_flags;
 
+/**
+* \brief Magnitude and phase computation modes of a packet
+*/
+typedef enum {
+///Compute magnitude and phase while decoding
+PHASE_EAGER = 0,
+///Compute magnitude and phase on the first call to ahp_xc_compute_phase_magnitude
+PHASE_LAZY = 1,
+///Never compute magnitude and phase, only raw real and imaginary values are decoded
+PHASE_SKIP = 2,
+} xc_phase_mode;
+
 /**
 * \brief Correlations structure
 */
@@ -255,6 +275,58 @@ uint64_t lag_size;
 ahp_xc_correlation *correlations;
 } ahp_xc_sample;
 
+/**
+* \brief Callback receiving the samples of a streaming scan
+* \param request The scan request of the line the sample belongs to
+* \param channel The channel number within the request, starting from 0
+* \param sample The decoded sample, valid until the callback returns
+* \param user The user pointer passed to the scan function
+*/
+typedef void (*ahp_xc_scan_callback)(ahp_xc_scan_request *request, uint32_t channel, ahp_xc_sample *sample, void *user);
+
+/**
+* \brief Header of a scan file written by ahp_xc_scan_autocorrelations_to_file
+*/
+typedef struct {
+///AHP_XC_SCAN_FILE_MAGIC, not null terminated
+char magic[8];
+///AHP_XC_SCAN_FILE_VERSION
+uint32_t version;
+///Size of each ahp_xc_scan_record
+uint32_t record_size;
+///Records of each channel, the autocorrelator lag size
+uint32_t lag_size;
+///Number of scan requests
+uint32_t nlines;
+///File offset of the first record
+uint64_t data_offset;
+///Number of record slots in the file
+uint64_t records;
+///Number of samples written by the scan, channels not received are not counted
+uint64_t samples;
+} ahp_xc_scan_file_header;
+
+/**
+* \brief Record of a scan file, one for each lag of each channel of each scan request
+* Records are ordered by scan request, then by channel, then by lag, slots of channels not scanned or not received are zeroed.
+*/
+typedef struct {
+///Line index of the scan request
+uint32_t line;
+///Channel number within the scan request
+uint32_t channel;
+///Time lag offset (seconds)
+double lag;
+///I samples count
+int64_t real;
+///Q samples count
+int64_t imaginary;
+///Pulses count
+uint64_t counts;
+///Device timestamp of the packet (seconds)
+double timestamp;
+} ahp_xc_scan_record;
+
 /**
 * \brief Packet structure
 */
@@ -283,8 +355,214 @@ ahp_xc_sample* crosscorrelations;
 void *lock;
 ///Packet buffer string
 const char* buf;
+///Magnitude and phase computation mode, see xc_phase_mode
+int32_t phase_mode;
+///Non-zero while magnitude and phase of a PHASE_LAZY packet are not computed yet
+int32_t phase_pending;
+///Size of the packet buffer string
+uint64_t buf_len;
 } ahp_xc_packet;
 
+/**
+* \brief Packet pool, recycles preallocated packets of the same size
+*/
+typedef struct ahp_xc_packet_pool ahp_xc_packet_pool;
+
+/**
+* \brief Device context, holds the transport, the properties and the decoding buffers of one correlator
+* \sa ahp_xc_alloc_context
+*/
+typedef struct ahp_xc_context ahp_xc_context;
+
+/**
+* \brief Merge stage, aligns the packets of several contexts by device timestamp
+* \sa ahp_xc_merge_start
+*/
+typedef struct ahp_xc_merge ahp_xc_merge;
+
+/**
+* \brief Planar correlations structure
+* Each array is 64-byte aligned and indexed [row*lag_size+lag], rows being lines or baselines.
+*/
+typedef struct {
+///Number of lines or baselines
+uint64_t rows;
+///Lags of each line or baseline
+uint64_t lag_size;
+///I samples count
+int64_t *real;
+///Q samples count
+int64_t *imaginary;
+///Pulses count
+uint64_t *counts;
+///Magnitude of each sample
+double *magnitude;
+///Phase of each sample
+double *phase;
+///Time lag offset of each sample
+double *lag;
+///Lag offset from sample time of each line or baseline, indexed [row]
+double *offset;
+} ahp_xc_correlation_planes;
+
+/**
+* \brief Planar packet structure
+* Same content of ahp_xc_packet stored as contiguous arrays of each quantity.
+*/
+typedef struct {
+///Timestamp of the packet (seconds)
+double timestamp;
+///Number of lines in this correlator
+uint64_t n_lines;
+///Total number of baselines obtainable
+uint64_t n_baselines;
+///Bandwidth inverse frequency
+uint64_t tau;
+///Bits capacity in each sample
+uint64_t bps;
+///Crosscorrelators channels per packet
+uint64_t cross_lag;
+///Autocorrelators channels per packet
+uint64_t auto_lag;
+///Counts in the current packet
+uint64_t* counts;
+///Autocorrelations in the current packet, one row per line
+ahp_xc_correlation_planes autocorrelations;
+///Crosscorrelations in the current packet, one row per baseline
+ahp_xc_correlation_planes crosscorrelations;
+///Packet lock mutex
+void *lock;
+///Packet buffer string
+const char* buf;
+///Storage of the planar arrays
+void *storage;
+///Magnitude and phase computation mode, see xc_phase_mode
+int32_t phase_mode;
+///Non-zero while magnitude and phase of a PHASE_LAZY packet are not computed yet
+int32_t phase_pending;
+///Size of the packet buffer string
+uint64_t buf_len;
+} ahp_xc_planar_packet;
+
+/**
+* \brief Streaming ring status structure
+*/
+typedef struct {
+///Number of packet slots in the ring
+uint32_t depth;
+///Packets waiting to be decoded
+uint32_t occupancy;
+///Highest occupancy reached since streaming started
+uint32_t max_occupancy;
+///Packets queued since streaming started
+uint64_t packets;
+///Packets dropped because the ring was full
+uint64_t overflows;
+///Frames discarded because their length did not match the packet size
+uint64_t malformed;
+} ahp_xc_stream_status;
+
+/**
+* \brief Time-aligned group of packets, one slot for each stream of a merge stage
+* \sa ahp_xc_merge_get_group
+*/
+typedef struct {
+///Device timestamp of the group, the earliest among its packets (seconds)
+double timestamp;
+///Progressive number of the group since the merge stage started
+uint64_t sequence;
+///Number of streams
+uint32_t n_streams;
+///Number of streams without a packet in this group
+uint32_t missing;
+///Packets ordered as the contexts given to ahp_xc_merge_start, NULL where a stream has a gap
+ahp_xc_packet **packets;
+} ahp_xc_packet_group;
+
+/**
+* \brief Counters of a stream of a merge stage
+* \sa ahp_xc_merge_get_status
+*/
+typedef struct {
+///Packets queued for merging
+uint64_t packets;
+///Groups emitted without a packet of this stream
+uint64_t gaps;
+///Packets discarded because their group was already emitted
+uint64_t late;
+///Packets that failed to decode
+uint64_t errors;
+///Packets waiting in the reorder window
+uint32_t pending;
+///Non-zero once the stream has been disconnected or its replay has ended
+int32_t ended;
+} ahp_xc_merge_status;
+
+/**
+* \brief Command traffic counters
+* \sa ahp_xc_get_command_stats
+*/
+typedef struct {
+///Command bytes written to the device
+uint64_t sent;
+///Command bytes withheld because the device already holds the requested value
+uint64_t suppressed;
+} ahp_xc_command_stats;
+
+/**
+* \brief Serial link status
+* \sa ahp_xc_negotiate_baudrate
+*/
+typedef struct {
+///Baud rate multiplier of XC_BASE_RATE in use
+uint32_t multiplier;
+///Baud rate the serial port runs at
+int32_t baudrate;
+///Fraction of the packets of the last negotiation burst that failed the header, length or checksum validation
+double error_rate;
+///Valid packets received in the last negotiation burst
+uint32_t packets;
+///Frames discarded while resynchronising after the last baud rate switch
+uint32_t switch_lost;
+} ahp_xc_link_status;
+
+/**
+* \brief Packet layout structure
+* All offsets are in bytes from the start of the packet buffer.
+* Counts and correlation fields are field_len hexadecimal digits wide,
+* each correlation lag is a real field followed by an imaginary field.
+*/
+typedef struct {
+///Size of the packet including the trailing carriage return
+uint32_t packet_size;
+///Length of the header
+uint32_t header_len;
+///Hexadecimal digits of each counts and correlation field
+uint32_t field_len;
+///Offset of the counts field of line 0
+uint32_t counts_offset;
+///Offset of the autocorrelation of line 0
+uint32_t auto_offset;
+///Distance between the autocorrelations of consecutive lines
+uint32_t auto_line_stride;
+///Offset of the crosscorrelation of baseline 0
+uint32_t cross_offset;
+///Distance between the crosscorrelations of consecutive baselines
+uint32_t cross_baseline_stride;
+///Hexadecimal digits of each channel field
+uint32_t channel_len;
+///Offset of the autocorrelator channel field of line 0
+uint32_t auto_channel_offset;
+///Offset of the crosscorrelator channel field of line 0
+uint32_t cross_channel_offset;
+///Distance between the channel fields of consecutive lines, negative as lines are stored in reverse order
+int32_t channel_stride;
+///Offset of the timestamp field
+uint32_t timestamp_offset;
+///Offset of the checksum field
+uint32_t checksum_offset;
+} ahp_xc_layout;
+
 /**\}*/
 /**
  * \defgroup Utilities Utility functions
@@ -301,7 +579,8 @@ const char* buf;
 DLL_EXPORT double* ahp_xc_get_2d_projection(double alt, double az, double *baseline);
 
 /**
-* \brief Set or get the maximum number of concurrent threads
+* \brief Set or get the maximum number of concurrent threads of the current context
+* ahp_xc_get_packet splits the decoding of lines and baselines across this many threads, including the calling one.
 * \param value If non-zero set the maximum numnber of threads to this value, otherwise just return the current value
 * \return Returns The maximum number of threads
 */DLL_EXPORT uint64_t ahp_xc_max_threads(uint64_t value);
@@ -364,16 +643,68 @@ DLL_EXPORT uint32_t ahp_xc_is_detected(void);
 DLL_EXPORT int32_t ahp_xc_get_baudrate(void);
 
 /**
-* \brief Obtain the current baud rate
+* \brief Set the baud rate
+* The rate is changed on the open port, after the pending output is sent, the acquisition and the streaming
+* thread keep running and resynchronise on the next frame.
 * \param rate The new baud rate index
+* \sa ahp_xc_get_link_status
 */
 DLL_EXPORT void ahp_xc_set_baudrate(baud_rate rate);
 
+/**
+* \brief Set the baud rate as a multiple of XC_BASE_RATE, beyond the baud_rate indexes
+* The device encodes the rate as a power of two of the base rate, up to 32768 times.
+* Rates without a standard termios speed are set as custom speeds where the platform allows it.
+* \param multiplier The baud rate multiplier, a power of two
+* \return Returns 0 on success, -EINVAL if the multiplier is not available, -ENOTSUP if the serial port cannot
+* be set to the rate, in that case the device and the port keep the previous rate
+* \sa ahp_xc_get_actual_baudrate
+*/
+DLL_EXPORT int32_t ahp_xc_set_baudrate_multiplier(uint32_t multiplier);
+
+/**
+* \brief Obtain the baud rate the serial port actually runs at
+* The driver may round custom speeds to the nearest rate its clock can divide, ahp_xc_get_packettime uses this rate.
+* \return Returns the baud rate read back from the port, or ahp_xc_get_baudrate when it cannot be read
+*/
+DLL_EXPORT int32_t ahp_xc_get_actual_baudrate(void);
+
+/**
+* \brief Switch to the fastest baud rate whose packets pass the validation within an error budget
+* Starting from the current rate, successively doubled rates are tried, at each rate a burst of packets is captured
+* and checked for header, length and checksum, the first rate exceeding max_error_rate ends the search and the
+* last rate within the budget is restored.
+* \param max_multiplier The highest multiplier of XC_BASE_RATE to try
+* \param burst The packets validated at each rate, 0 uses AHP_XC_LINK_BURST
+* \param max_error_rate The highest fraction of failed packets accepted
+* \return Returns 0 on success, -EIO if even the settled rate exceeds the error budget, -ENOENT if not connected,
+* -EINVAL while streaming or replaying
+* \sa ahp_xc_get_link_status
+*/
+DLL_EXPORT int32_t ahp_xc_negotiate_baudrate(uint32_t max_multiplier, uint32_t burst, double max_error_rate);
+
+/**
+* \brief Make ahp_xc_connect and ahp_xc_connect_fd negotiate the baud rate after detecting the device
+* \param max_multiplier The highest multiplier of XC_BASE_RATE to try, 0 or 1 disables the negotiation
+* \param burst The packets validated at each rate, 0 uses AHP_XC_LINK_BURST
+* \param max_error_rate The highest fraction of failed packets accepted
+* \sa ahp_xc_negotiate_baudrate
+*/
+DLL_EXPORT void ahp_xc_set_link_negotiation(uint32_t max_multiplier, uint32_t burst, double max_error_rate);
+
+/**
+* \brief Obtain the baud rate in use and the error rate measured by the last negotiation
+* \param status The ahp_xc_link_status structure to be filled
+*/
+DLL_EXPORT void ahp_xc_get_link_status(ahp_xc_link_status *status);
+
 /**
 * \brief Set the crosscorrelation order
 * \param order The new crosscorrelation order
+* \return Returns 0 on success, -ENOENT if no device is detected, -EINVAL if order is not lower than the number of lines,
+* -ENOMEM if the baseline table cannot be rebuilt, the previous order being kept
 */
-DLL_EXPORT void ahp_xc_set_correlation_order(uint32_t order);
+DLL_EXPORT int32_t ahp_xc_set_correlation_order(uint32_t order);
 
 /**
 * \brief Get the crosscorrelation order
@@ -418,12 +749,23 @@ DLL_EXPORT uint32_t ahp_xc_get_nbaselines(void);
 
 /**
 * \brief Return the cross-correlation index of the polytopes correlating the lines array
+* Tuples of the current correlation order are resolved in constant time through a table built on detection
+* and rebuilt by ahp_xc_set_correlation_order, other tuples fall back to the closest matching baseline.
 * \param lines The line indexes array
 * \param order The crosscorrelation order and size of the lines array
 * \return Returns the corresponding cross-correlation index
 */
 DLL_EXPORT int32_t ahp_xc_get_crosscorrelation_index(int32_t *lines, int32_t order);
 
+/**
+* \brief Obtain the line indexes correlated by a baseline
+* \param idx The crosscorrelation index
+* \param lines The line indexes array, of size ahp_xc_get_correlation_order()
+* \return Returns the correlation order, or a negative error code
+* \sa ahp_xc_get_crosscorrelation_index
+*/
+DLL_EXPORT int32_t ahp_xc_get_baseline_lines(uint32_t idx, int32_t *lines);
+
 /**
 * \brief Return the cross-correlation index of the polytopes correlating the lines array
 * \param idx The crosscorrelation indexes
@@ -481,6 +823,13 @@ DLL_EXPORT double ahp_xc_get_packettime(void);
 */
 DLL_EXPORT uint32_t ahp_xc_get_packetsize(void);
 
+/**
+* \brief Obtain the layout of the packets sent by the correlator
+* \return Returns a pointer to the layout computed by ahp_xc_get_properties, or NULL if no correlator was detected
+* \sa ahp_xc_layout
+*/
+DLL_EXPORT const ahp_xc_layout *ahp_xc_get_layout(void);
+
 /**
 * \brief Enable the intensity cross-correlation feature
 * \param enable set to non-zero to enable the intensity crosscorrelator
@@ -531,22 +880,83 @@ DLL_EXPORT int32_t ahp_xc_has_cumulative_only();
 
 /**
 * \brief Allocate and return a packet structure
-* \return Returns a new ahp_xc_packet structure pointer
+* \return Returns a new ahp_xc_packet structure pointer, or NULL if out of memory
 */
 DLL_EXPORT ahp_xc_packet *ahp_xc_alloc_packet(void);
 
 /**
 * \brief Allocate and return a copy of a packet structure
-* \return Returns a new ahp_xc_packet structure pointer
+* The copy has the geometry of the source packet, which may come from a device other than the current one.
+* \param packet The packet to copy
+* \return Returns a new ahp_xc_packet structure pointer, or NULL if packet is NULL or out of memory
 */
 DLL_EXPORT ahp_xc_packet *ahp_xc_copy_packet(ahp_xc_packet *packet);
 
 /**
 * \brief Free a previously allocated packet structure
+* Packets obtained from a pool are given back to their pool.
 * \param packet pointer to the ahp_xc_packet structure to be freed
 */
 DLL_EXPORT void ahp_xc_free_packet(ahp_xc_packet *packet);
 
+/**
+* \brief Allocate a pool of packets sized for the connected correlator
+* \param size Number of packets in the pool
+* \return Returns a new ahp_xc_packet_pool pointer, or NULL if size is zero or out of memory
+*/
+DLL_EXPORT ahp_xc_packet_pool *ahp_xc_alloc_packet_pool(uint32_t size);
+
+/**
+* \brief Take a packet from a pool, this call never allocates and is safe to call from any thread
+* \param pool The packet pool
+* \return Returns a packet, or NULL if all the packets of the pool are in use
+*/
+DLL_EXPORT ahp_xc_packet *ahp_xc_packet_pool_get(ahp_xc_packet_pool *pool);
+
+/**
+* \brief Give a packet back to the pool it was taken from
+* \param pool The packet pool
+* \param packet The packet obtained from ahp_xc_packet_pool_get
+*/
+DLL_EXPORT void ahp_xc_packet_pool_put(ahp_xc_packet_pool *pool, ahp_xc_packet *packet);
+
+/**
+* \brief Free a pool and all of its packets, including the ones not given back yet
+* \param pool The packet pool to be freed
+*/
+DLL_EXPORT void ahp_xc_free_packet_pool(ahp_xc_packet_pool *pool);
+
+/**
+* \brief Allocate and return a planar packet structure
+* \return Returns a new ahp_xc_planar_packet structure pointer, or NULL if out of memory
+*/
+DLL_EXPORT ahp_xc_planar_packet *ahp_xc_alloc_planar_packet(void);
+
+/**
+* \brief Free a previously allocated planar packet structure
+* \param packet the planar packet structure to be freed
+*/
+DLL_EXPORT void ahp_xc_free_planar_packet(ahp_xc_planar_packet *packet);
+
+/**
+* \brief Copy the content of a packet into a planar packet
+* Lines, baselines and buffer are copied up to the smaller of the two packets.
+* \param src the packet to be converted
+* \param dst the planar packet to fill
+* \return Returns 0 on success, -EINVAL if a packet is NULL or the lag sizes differ
+*/
+DLL_EXPORT int32_t ahp_xc_packet_to_planar(ahp_xc_packet *src, ahp_xc_planar_packet *dst);
+
+/**
+* \brief Copy the content of a planar packet into a packet
+* The node indexes and lags of each correlation are left untouched.
+* Lines, baselines and buffer are copied up to the smaller of the two packets.
+* \param src the planar packet to be converted
+* \param dst the packet to fill
+* \return Returns 0 on success, -EINVAL if a packet is NULL or the lag sizes differ
+*/
+DLL_EXPORT int32_t ahp_xc_planar_to_packet(ahp_xc_planar_packet *src, ahp_xc_packet *dst);
+
 /**
 * \brief Allocate and return a samples array
 * \param nlines The Number of samples to be allocated.
@@ -595,6 +1005,124 @@ DLL_EXPORT void ahp_xc_free_samples(uint64_t nlines, ahp_xc_sample *samples);
 */
 DLL_EXPORT int32_t ahp_xc_get_packet(ahp_xc_packet *packet);
 
+/**
+* \brief Grab a data packet and decode it into planar arrays
+* \param packet The planar packet structure to be filled
+* \return Returns non-zero on error
+* \sa ahp_xc_alloc_planar_packet
+* \sa ahp_xc_free_planar_packet
+* \sa ahp_xc_get_packet
+*/
+DLL_EXPORT int32_t ahp_xc_get_planar_packet(ahp_xc_planar_packet *packet);
+
+/**
+* \brief Compute magnitude and phase of a packet decoded in PHASE_LAZY mode, does nothing if they are already computed
+* \param packet The packet
+* \sa xc_phase_mode
+*/
+DLL_EXPORT void ahp_xc_compute_phase_magnitude(ahp_xc_packet *packet);
+
+/**
+* \brief Compute magnitude and phase of a planar packet decoded in PHASE_LAZY mode, does nothing if they are already computed
+* \param packet The planar packet
+* \sa xc_phase_mode
+*/
+DLL_EXPORT void ahp_xc_compute_planar_phase_magnitude(ahp_xc_planar_packet *packet);
+
+/**
+* \brief Start the acquisition thread
+* A reader thread frames the incoming packets on the end of packet character and queues them into
+* a preallocated single-producer single-consumer ring, ahp_xc_get_packet then decodes from the ring.
+* Scans pause the acquisition thread while they run.
+* \param depth The number of packets the ring can hold, rounded up to a power of two
+* \return Returns non-zero on failure, -ENOMEM if the ring or the framing buffer cannot be allocated
+* \sa ahp_xc_stop_streaming
+* \sa ahp_xc_get_stream_status
+*/
+DLL_EXPORT int32_t ahp_xc_start_streaming(uint32_t depth);
+
+/**
+* \brief Stop the acquisition thread and release the ring
+* \sa ahp_xc_start_streaming
+*/
+DLL_EXPORT void ahp_xc_stop_streaming(void);
+
+/**
+* \brief Report if the acquisition thread is running
+* \return Returns non-zero if streaming
+*/
+DLL_EXPORT int32_t ahp_xc_is_streaming(void);
+
+/**
+* \brief Obtain the occupancy and overflow counters of the streaming ring
+* \param status The ahp_xc_stream_status structure to be filled
+* \sa ahp_xc_start_streaming
+*/
+DLL_EXPORT void ahp_xc_get_stream_status(ahp_xc_stream_status *status);
+
+/**
+* \brief Append every validated packet received by ahp_xc_get_packet and ahp_xc_get_planar_packet to a recording file
+* Each record carries the raw packet, its host CLOCK_MONOTONIC and CLOCK_REALTIME stamps and the device timestamp,
+* a sparse index of device timestamps to file offsets is appended when the recording is stopped.
+* A failed write stops the recording, the file keeps the records written before the failure.
+* The file layout is described in README.md.
+* \param filename The path of the recording file, truncated if it exists
+* \return Returns 0 on success, a negative errno value otherwise
+* \sa ahp_xc_stop_recording
+* \sa ahp_xc_connect_replay
+*/
+DLL_EXPORT int32_t ahp_xc_start_recording(const char *filename);
+
+/**
+* \brief Write the index of the current recording and close its file
+* \sa ahp_xc_start_recording
+*/
+DLL_EXPORT void ahp_xc_stop_recording(void);
+
+/**
+* \brief Report if packets are being recorded
+* \return Returns non-zero if recording
+* \sa ahp_xc_get_recording_error
+*/
+DLL_EXPORT int32_t ahp_xc_is_recording(void);
+
+/**
+* \brief Report why the last recording stopped
+* \return Returns 0 if the last recording is running or stopped on request,
+* the negative errno value of the write that stopped it otherwise
+* \sa ahp_xc_start_recording
+*/
+DLL_EXPORT int32_t ahp_xc_get_recording_error(void);
+
+/**
+* \brief Connect to a recording file instead of a device
+* The file is memory mapped and its packets are fed to ahp_xc_get_packet in recording order,
+* commands are accepted and discarded, streaming and scans are not available.
+* \param filename The path of a file written by ahp_xc_start_recording
+* \param speed 0 to return packets as fast as possible, otherwise the replay rate relative to real time
+* \return Returns non-zero on failure
+* \sa ahp_xc_close_replay
+*/
+DLL_EXPORT int32_t ahp_xc_connect_replay(const char *filename, double speed);
+
+/**
+* \brief Move the replay cursor to the first packet whose device timestamp is not earlier than timestamp
+* \param timestamp The device timestamp in seconds
+* \return Returns 0 on success, -ERANGE if no packet follows timestamp
+*/
+DLL_EXPORT int32_t ahp_xc_replay_seek(double timestamp);
+
+/**
+* \brief Obtain the number of packets of the current replay
+* \return The number of packets in the recording file
+*/
+DLL_EXPORT uint64_t ahp_xc_get_replay_length(void);
+
+/**
+* \brief Unmap the recording file, ahp_xc_disconnect calls this
+*/
+DLL_EXPORT void ahp_xc_close_replay(void);
+
 /**
 * \brief Initiate an autocorrelation scan
 * \param index The line index.
@@ -614,12 +1142,66 @@ DLL_EXPORT void ahp_xc_end_autocorrelation_scan(uint32_t index);
 * \param autocorrelations An ahp_xc_sample array pointer, can be NULL. Will be allocated by reference and filled by this function.
 * \param interrupt This should point32_t to an int32_t variable, when setting to 1, on a separate thread, scanning will be interrupted.
 * \param percent Like interrupt a variable, passed by reference that will be updated with the percent of completion.
-* \return Returns the number of channels scanned
+* \return Returns the number of channels scanned, or -ETIMEDOUT if no packet is received
 * \sa ahp_xc_get_delaysize
 * \sa ahp_xc_sample
 */
 DLL_EXPORT int32_t ahp_xc_scan_autocorrelations(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **autocorrelations, int32_t *interrupt, double *percent);
 
+/**
+* \brief Scan all available delay channels and deliver the autocorrelations of each input as they are received
+* Each packet is decoded on a separate thread while the next ones are acquired, at most AHP_XC_SCAN_QUEUE_DEPTH
+* packets are held in memory, the callback is invoked from the decoding thread once per line and channel.
+* Channels whose packet is not received are skipped.
+* \param lines the input lines structure array.
+* \param nlines the element size of the input lines array.
+* \param callback The function receiving each sample.
+* \param user A pointer passed to the callback.
+* \param interrupt This should point32_t to an int32_t variable, when setting to 1, on a separate thread, scanning will be interrupted.
+* \param percent Like interrupt a variable, passed by reference that will be updated with the percent of completion.
+* \return Returns the number of samples delivered, or -ETIMEDOUT if no packet is received
+* \sa ahp_xc_scan_autocorrelations
+* \sa ahp_xc_scan_callback
+*/
+DLL_EXPORT int32_t ahp_xc_scan_autocorrelations_stream(ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_scan_callback callback, void *user, int32_t *interrupt, double *percent);
+
+/**
+* \brief Scan the delay channels of each input coarse to fine around the correlation peaks
+* The channels of each request are first swept at the requested step, the magnitude threshold of each line is set
+* at its mean plus threshold times its standard deviation over this sweep, then each channel exceeding it is rescanned
+* within one step around it at a step divided by factor, until the step is 1 or no channel exceeds the threshold.
+* \param lines the input lines structure array, their step is the step of the first sweep.
+* \param nlines the element size of the input lines array.
+* \param factor The step reduction between successive passes, at least 2.
+* \param threshold The peak threshold in standard deviations of the magnitude of the first sweep.
+* \param autocorrelations An ahp_xc_sample array pointer. Will be allocated by reference and filled with the samples of all passes,
+* ordered by input and by channel, each channel appearing once. The channel of a sample is its lag divided by ahp_xc_get_sampletime().
+* \param counts An array of nlines elements, filled with the number of samples of each input: the samples of input x follow
+* those of the inputs before it. May be NULL.
+* \param interrupt This should point32_t to an int32_t variable, when setting to 1, on a separate thread, scanning will be interrupted.
+* \param percent Like interrupt a variable, passed by reference that will be updated with the estimated percent of completion.
+* \return Returns the number of samples in the autocorrelations array, or a negative error code
+* \sa ahp_xc_scan_autocorrelations_stream
+*/
+DLL_EXPORT int32_t ahp_xc_scan_autocorrelations_adaptive(ahp_xc_scan_request *lines, uint32_t nlines, uint32_t factor, double threshold, ahp_xc_sample **autocorrelations, uint32_t *counts, int32_t *interrupt, double *percent);
+
+/**
+* \brief Scan all available delay channels and write the autocorrelations of each input into a file
+* The file is sized for the whole scan and memory mapped, an ahp_xc_scan_file_header is followed by fixed size
+* ahp_xc_scan_record entries written in place as packets are decoded, so the scan is not bounded by the available memory
+* and the file can be mapped for analysis as it is.
+* \param lines the input lines structure array.
+* \param nlines the element size of the input lines array.
+* \param filename The path of the scan file, truncated if it exists
+* \param interrupt This should point32_t to an int32_t variable, when setting to 1, on a separate thread, scanning will be interrupted.
+* \param percent Like interrupt a variable, passed by reference that will be updated with the percent of completion.
+* \return Returns the number of samples written, or a negative error code if the file cannot be created
+* or -ETIMEDOUT if no packet is received
+* \sa ahp_xc_scan_file_header
+* \sa ahp_xc_scan_record
+*/
+DLL_EXPORT int32_t ahp_xc_scan_autocorrelations_to_file(ahp_xc_scan_request *lines, uint32_t nlines, const char *filename, int32_t *interrupt, double *percent);
+
 /**
 * \brief Initiate a crosscorrelation scan
 * \param index The line index.
@@ -639,7 +1221,7 @@ DLL_EXPORT void ahp_xc_end_crosscorrelation_scan(uint32_t index);
 * \param crosscorrelations An ahp_xc_sample array pointer, can be NULL. Will be allocated by reference and filled by this function.
 * \param interrupt This should point32_t to an int32_t variable, when setting to 1, on a separate thread, scanning will be interrupted.
 * \param percent Like interrupt a variable, passed by reference that will be updated with the percent of completion.
-* \return Returns the number of channels scanned
+* \return Returns the number of channels scanned, or a negative error code, -ETIMEDOUT if the packets stop being received
 * \sa ahp_xc_get_delaysize
 * \sa ahp_xc_sample
 */
@@ -742,12 +1324,369 @@ DLL_EXPORT uint32_t ahp_xc_current_input();
 */
 DLL_EXPORT int32_t ahp_xc_send_command(xc_cmd cmd, unsigned char value);
 
+/**
+* \brief Start collecting commands into the command buffer
+* Commands sent until the matching ahp_xc_commit_commands are queued and transmitted with a single write.
+* Calls can be nested, the buffer is transmitted when the outermost one is committed.
+* \sa ahp_xc_commit_commands
+*/
+DLL_EXPORT void ahp_xc_begin_commands(void);
+
+/**
+* \brief Append a command to the command buffer
+* \param cmd The command
+* \param value The command parameter
+* \return non-zero on failure
+*/
+DLL_EXPORT int32_t ahp_xc_append_command(xc_cmd cmd, unsigned char value);
+
+/**
+* \brief Close a command buffer opened with ahp_xc_begin_commands, transmitting it and waiting for its completion if it is the outermost one
+* \return non-zero on failure
+* \sa ahp_xc_begin_commands
+*/
+DLL_EXPORT int32_t ahp_xc_commit_commands(void);
+
+/**
+* \brief Obtain the counters of sent and suppressed command bytes
+* Setters keep a shadow copy of the device registers and skip the commands that would not change them.
+* \param stats The ahp_xc_command_stats structure to be filled
+*/
+DLL_EXPORT void ahp_xc_get_command_stats(ahp_xc_command_stats *stats);
+
+/**
+* \brief Forget the shadow copy of the device registers, so that the next setters transmit unconditionally
+* Call this after altering the device state with ahp_xc_send_command or ahp_xc_append_command.
+*/
+DLL_EXPORT void ahp_xc_invalidate_device_state(void);
+
 /**
 * \brief Obtain the current libahp-xc version
 * \return The current version code
 */
 DLL_EXPORT inline uint32_t ahp_xc_get_version(void) { return AHP_XC_VERSION; }
 
+/**\}*/
+/**
+ * \defgroup Context Multiple devices
+ * Every function of this API acts on the context bound to the calling thread, which is the default context unless
+ * ahp_xc_set_context is called. The ahp_xc_context_ functions bind the given context for the duration of the call,
+ * so that each correlator can be driven and streamed from its own thread.
+*/
+/**\{*/
+
+/**
+* \brief Allocate a new device context, not connected to any device
+* \return The new context, or NULL on failure
+* \sa ahp_xc_free_context
+*/
+DLL_EXPORT ahp_xc_context *ahp_xc_alloc_context(void);
+
+/**
+* \brief Disconnect the device of a context and free the context
+* \param context The context allocated by ahp_xc_alloc_context
+*/
+DLL_EXPORT void ahp_xc_free_context(ahp_xc_context *context);
+
+/**
+* \brief Bind a context to the calling thread
+* \param context The context, NULL binds the default context
+* \return The context previously bound to the calling thread
+*/
+DLL_EXPORT ahp_xc_context *ahp_xc_set_context(ahp_xc_context *context);
+
+/**
+* \brief Obtain the context bound to the calling thread
+* \return The current context
+*/
+DLL_EXPORT ahp_xc_context *ahp_xc_get_context(void);
+
+/**
+* \brief ahp_xc_connect on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_connect(ahp_xc_context *context, const char *port);
+
+/**
+* \brief ahp_xc_connect_fd on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_connect_fd(ahp_xc_context *context, int32_t fd);
+
+/**
+* \brief ahp_xc_connect_replay on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_connect_replay(ahp_xc_context *context, const char *filename, double speed);
+
+/**
+* \brief ahp_xc_disconnect on a context
+*/
+DLL_EXPORT void ahp_xc_context_disconnect(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_is_detected on a context
+*/
+DLL_EXPORT uint32_t ahp_xc_context_is_detected(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_nlines on a context
+*/
+DLL_EXPORT uint32_t ahp_xc_context_get_nlines(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_nbaselines on a context
+*/
+DLL_EXPORT uint32_t ahp_xc_context_get_nbaselines(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_delaysize on a context
+*/
+DLL_EXPORT uint32_t ahp_xc_context_get_delaysize(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_autocorrelator_lagsize on a context
+*/
+DLL_EXPORT uint32_t ahp_xc_context_get_autocorrelator_lagsize(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_crosscorrelator_lagsize on a context
+*/
+DLL_EXPORT uint32_t ahp_xc_context_get_crosscorrelator_lagsize(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_frequency on a context
+*/
+DLL_EXPORT double ahp_xc_context_get_frequency(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_packettime on a context
+*/
+DLL_EXPORT double ahp_xc_context_get_packettime(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_layout on a context
+*/
+DLL_EXPORT const ahp_xc_layout *ahp_xc_context_get_layout(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_max_threads on a context
+*/
+DLL_EXPORT uint64_t ahp_xc_context_max_threads(ahp_xc_context *context, uint64_t value);
+
+/**
+* \brief ahp_xc_alloc_packet on a context, the packet is sized for the device of the context
+*/
+DLL_EXPORT ahp_xc_packet *ahp_xc_context_alloc_packet(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_packet on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_get_packet(ahp_xc_context *context, ahp_xc_packet *packet);
+
+/**
+* \brief ahp_xc_alloc_planar_packet on a context, the packet is sized for the device of the context
+*/
+DLL_EXPORT ahp_xc_planar_packet *ahp_xc_context_alloc_planar_packet(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_planar_packet on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_get_planar_packet(ahp_xc_context *context, ahp_xc_planar_packet *packet);
+
+/**
+* \brief ahp_xc_start_streaming on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_start_streaming(ahp_xc_context *context, uint32_t depth);
+
+/**
+* \brief ahp_xc_stop_streaming on a context
+*/
+DLL_EXPORT void ahp_xc_context_stop_streaming(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_start_recording on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_start_recording(ahp_xc_context *context, const char *filename);
+
+/**
+* \brief ahp_xc_stop_recording on a context
+*/
+DLL_EXPORT void ahp_xc_context_stop_recording(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_is_recording on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_is_recording(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_get_recording_error on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_get_recording_error(ahp_xc_context *context);
+
+/**
+* \brief ahp_xc_scan_autocorrelations on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_scan_autocorrelations(ahp_xc_context *context, ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **autocorrelations, int32_t *interrupt, double *percent);
+
+/**
+* \brief ahp_xc_scan_autocorrelations_adaptive on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_scan_autocorrelations_adaptive(ahp_xc_context *context, ahp_xc_scan_request *lines, uint32_t nlines, uint32_t factor, double threshold, ahp_xc_sample **autocorrelations, uint32_t *counts, int32_t *interrupt, double *percent);
+
+/**
+* \brief ahp_xc_scan_autocorrelations_to_file on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_scan_autocorrelations_to_file(ahp_xc_context *context, ahp_xc_scan_request *lines, uint32_t nlines, const char *filename, int32_t *interrupt, double *percent);
+
+/**
+* \brief ahp_xc_scan_autocorrelations_stream on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_scan_autocorrelations_stream(ahp_xc_context *context, ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_scan_callback callback, void *user, int32_t *interrupt, double *percent);
+
+/**
+* \brief ahp_xc_scan_crosscorrelations on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_scan_crosscorrelations(ahp_xc_context *context, ahp_xc_scan_request *lines, uint32_t nlines, ahp_xc_sample **crosscorrelations, int32_t *interrupt, double *percent);
+
+/**
+* \brief ahp_xc_set_capture_flags on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_set_capture_flags(ahp_xc_context *context, xc_capture_flags flags);
+
+/**
+* \brief ahp_xc_set_test_flags on a context
+*/
+DLL_EXPORT void ahp_xc_context_set_test_flags(ahp_xc_context *context, uint32_t index, int32_t value);
+
+/**
+* \brief ahp_xc_set_channel_auto on a context
+*/
+DLL_EXPORT void ahp_xc_context_set_channel_auto(ahp_xc_context *context, uint32_t index, off_t value, size_t size, size_t step);
+
+/**
+* \brief ahp_xc_set_channel_cross on a context
+*/
+DLL_EXPORT void ahp_xc_context_set_channel_cross(ahp_xc_context *context, uint32_t index, off_t value, size_t size, size_t step);
+
+/**
+* \brief ahp_xc_select_input on a context
+*/
+DLL_EXPORT void ahp_xc_context_select_input(ahp_xc_context *context, uint32_t index);
+
+/**
+* \brief ahp_xc_set_leds on a context
+*/
+DLL_EXPORT void ahp_xc_context_set_leds(ahp_xc_context *context, uint32_t index, int32_t leds);
+
+/**
+* \brief ahp_xc_set_voltage on a context
+*/
+DLL_EXPORT void ahp_xc_context_set_voltage(ahp_xc_context *context, uint32_t index, unsigned char value);
+
+/**
+* \brief ahp_xc_set_baudrate on a context
+*/
+DLL_EXPORT void ahp_xc_context_set_baudrate(ahp_xc_context *context, baud_rate rate);
+
+/**
+* \brief ahp_xc_set_link_negotiation on a context
+*/
+DLL_EXPORT void ahp_xc_context_set_link_negotiation(ahp_xc_context *context, uint32_t max_multiplier, uint32_t burst, double max_error_rate);
+
+/**
+* \brief ahp_xc_negotiate_baudrate on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_negotiate_baudrate(ahp_xc_context *context, uint32_t max_multiplier, uint32_t burst, double max_error_rate);
+
+/**
+* \brief ahp_xc_get_link_status on a context
+*/
+DLL_EXPORT void ahp_xc_context_get_link_status(ahp_xc_context *context, ahp_xc_link_status *status);
+
+/**
+* \brief ahp_xc_set_correlation_order on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_set_correlation_order(ahp_xc_context *context, uint32_t order);
+
+/**
+* \brief ahp_xc_send_command on a context
+*/
+DLL_EXPORT int32_t ahp_xc_context_send_command(ahp_xc_context *context, xc_cmd cmd, unsigned char value);
+
+/**
+* \brief ahp_xc_get_command_stats on a context
+*/
+DLL_EXPORT void ahp_xc_context_get_command_stats(ahp_xc_context *context, ahp_xc_command_stats *stats);
+
+/**\}*/
+/**
+ * \defgroup Merge Multiple devices merging
+ * Correlators sharing the same clock (CAP_EXT_CLK) and whose timestamps were reset together produce packets
+ * with comparable device timestamps. A merge stage reads each context from its own thread, holds the packets
+ * in a reorder window and emits groups of packets taken at the same device time from a further thread.
+*/
+/**\{*/
+
+/**
+* \brief Start merging the packets of several contexts
+* Each context must be connected and must not be read by other threads until the merge stage is stopped.
+* A group is emitted once every stream has a packet at its timestamp, or a later packet, or it has ended,
+* or when the newest packet received is more than window seconds later, streams still lacking a packet
+* are then reported as gaps.
+* \param contexts The contexts to merge
+* \param n_streams The number of contexts
+* \param depth The packets preallocated for each stream, they bound the reorder window, the groups waiting
+* and the groups held by the caller
+* \param tolerance The largest timestamp difference (seconds) of packets of the same group, below half the packet time
+* \param window The largest delay (seconds of device time) a group waits for a missing packet
+* \return The merge stage, or NULL on invalid arguments or failure
+* \sa ahp_xc_merge_stop
+*/
+DLL_EXPORT ahp_xc_merge *ahp_xc_merge_start(ahp_xc_context **contexts, uint32_t n_streams, uint32_t depth, double tolerance, double window);
+
+/**
+* \brief Stop the threads of a merge stage and free it, packets of groups still held become invalid
+* \param merge The merge stage
+*/
+DLL_EXPORT void ahp_xc_merge_stop(ahp_xc_merge *merge);
+
+/**
+* \brief Allocate a packet group sized for a merge stage
+* \param merge The merge stage
+* \return The new group, or NULL on failure
+*/
+DLL_EXPORT ahp_xc_packet_group *ahp_xc_merge_alloc_group(ahp_xc_merge *merge);
+
+/**
+* \brief Return the packets of a group to the merge stage
+* \param merge The merge stage
+* \param group The group obtained with ahp_xc_merge_get_group
+*/
+DLL_EXPORT void ahp_xc_merge_release_group(ahp_xc_merge *merge, ahp_xc_packet_group *group);
+
+/**
+* \brief Release and free a packet group
+* \param merge The merge stage
+* \param group The group allocated by ahp_xc_merge_alloc_group
+*/
+DLL_EXPORT void ahp_xc_merge_free_group(ahp_xc_merge *merge, ahp_xc_packet_group *group);
+
+/**
+* \brief Obtain the next time-aligned group, the packets previously held by group are released first
+* \param merge The merge stage
+* \param group The group allocated by ahp_xc_merge_alloc_group
+* \param timeout The time to wait in milliseconds, negative waits indefinitely
+* \return Returns 0 on success, -ETIMEDOUT if no group is ready in time, -ENODATA once all streams ended
+*/
+DLL_EXPORT int32_t ahp_xc_merge_get_group(ahp_xc_merge *merge, ahp_xc_packet_group *group, int32_t timeout);
+
+/**
+* \brief Obtain the counters of a stream of a merge stage
+* \param merge The merge stage
+* \param stream The index of the stream
+* \param status The ahp_xc_merge_status structure to be filled
+* \return Returns 0 on success, -EINVAL on invalid arguments
+*/
+DLL_EXPORT int32_t ahp_xc_merge_get_status(ahp_xc_merge *merge, uint32_t stream, ahp_xc_merge_status *status);
+
 /**\}*/
 /**\}*/
 #ifdef __cplusplus
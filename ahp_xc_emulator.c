@@ -0,0 +1,488 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+* Pseudo-terminal XC device emulator.
+* Speaks the protocol documented in README.md on the master side of a pty pair,
+* ahp_xc_connect can be pointed at the printed slave device name.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <termios.h>
+
+#define XC_BASE_RATE 57600
+
+enum {
+    CLEAR = 0,
+    SET_INDEX = 1,
+    SET_LEDS = 2,
+    SET_BAUD_RATE = 3,
+    SET_VOLTAGE = 4,
+    SET_DELAY = 8,
+    ENABLE_TEST = 12,
+    ENABLE_CAPTURE = 13
+};
+
+enum {
+    CAP_ENABLE = 1,
+    CAP_EXT_CLK = 2,
+    CAP_RESET_TIMESTAMP = 4,
+    CAP_EXTRA_CMD = 8
+};
+
+enum {
+    SCAN_AUTO = 1<<1,
+    SCAN_CROSS = 1<<2,
+    TEST_STEP = 3<<4
+};
+
+typedef struct {
+    uint64_t start;
+    uint64_t len;
+    uint64_t step;
+    uint64_t cur;
+} emu_channel;
+
+typedef struct {
+    int expect_len;
+    int nibbles_left;
+    int shift;
+    uint64_t value;
+} emu_sequence;
+
+static int nlines = 8;
+static int bps = 24;
+static int auto_lagsize = 1;
+static int cross_lagsize = 1;
+static int flags = 0x1;
+static int tau = 10000;
+static int delaysize_len = 6;
+static int64_t baudrate = 0;
+static int quiet = 0;
+
+static int nbaselines = 0;
+static int header_len = 0;
+static size_t packetsize = 0;
+static char header[64];
+
+static unsigned char capture = 0;
+static uint32_t index_current = 0;
+static int baud_shift = 0;
+static unsigned char *test = NULL;
+static unsigned char *leds = NULL;
+static unsigned char *voltage = NULL;
+static emu_channel *auto_channel = NULL;
+static emu_channel *cross_channel = NULL;
+static emu_sequence seq_index, seq_delay, seq_order;
+static uint64_t packets_sent = 0;
+static uint64_t commands_received = 0;
+static struct timespec ts_start;
+static volatile sig_atomic_t running = 1;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void put_hex(char *dst, uint64_t value, int nibbles)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    int x;
+    for(x = nibbles - 1; x >= 0; x--) {
+        dst[x] = digits[value & 0xf];
+        value >>= 4;
+    }
+}
+
+static int hex_len(uint64_t value)
+{
+    int len = 1;
+    while(value >>= 4)
+        len++;
+    return len;
+}
+
+static int build_header()
+{
+    int len = 0;
+    int l;
+    l = hex_len(nlines - 1);
+    put_hex(header + len, l, 2); len += 2;
+    put_hex(header + len, nlines - 1, l); len += l;
+    l = hex_len(bps - 1);
+    put_hex(header + len, l, 2); len += 2;
+    put_hex(header + len, bps - 1, l); len += l;
+    put_hex(header + len, delaysize_len, 2); len += 2;
+    put_hex(header + len, 4, delaysize_len); len += delaysize_len;
+    l = hex_len(auto_lagsize - 1);
+    put_hex(header + len, l, 2); len += 2;
+    put_hex(header + len, auto_lagsize - 1, l); len += l;
+    l = hex_len(cross_lagsize - 1);
+    put_hex(header + len, l, 2); len += 2;
+    put_hex(header + len, cross_lagsize - 1, l); len += l;
+    put_hex(header + len, flags, 2); len += 2;
+    put_hex(header + len, tau, 4); len += 4;
+    header[len] = 0;
+    return len;
+}
+
+static int64_t fringe(double channel, double peak, double width, double amplitude, int64_t counts, double phase, int imaginary)
+{
+    double d = (channel - peak) / width;
+    double v = amplitude * exp(-d*d) * (imaginary ? sin(phase) : cos(phase));
+    return (int64_t)(v * counts) + (rand() % 9) - 4;
+}
+
+static size_t build_packet(char *buf)
+{
+    int n = bps / 4;
+    int x, y;
+    uint64_t mask = (bps >= 64 ? ~0ULL : ((1ULL << bps) - 1));
+    uint64_t *counts = (uint64_t*)malloc(sizeof(uint64_t) * nlines);
+    char *p = buf;
+    memcpy(p, header, header_len);
+    p += header_len;
+    for(x = 0; x < nlines; x++) {
+        counts[x] = (1000 + x * 10 + rand() % 100) & mask;
+        put_hex(p, counts[x], n);
+        p += n;
+    }
+    for(x = 0; x < nlines; x++) {
+        double ch = (double)(test[x] & SCAN_AUTO ? auto_channel[x].cur : auto_channel[x].start);
+        for(y = 0; y < auto_lagsize; y++) {
+            put_hex(p, (uint64_t)fringe(ch + y, 64 + x * 16, 8, 0.5, counts[x], 0.3 * x, 0) & mask, n);
+            p += n;
+            put_hex(p, (uint64_t)fringe(ch + y, 64 + x * 16, 8, 0.5, counts[x], 0.3 * x, 1) & mask, n);
+            p += n;
+        }
+    }
+    for(x = 0; x < nbaselines; x++) {
+        int a = x % nlines;
+        int b = (x + x / nlines + 1) % nlines;
+        double ch = (double)(test[a] & SCAN_CROSS ? cross_channel[a].cur : cross_channel[a].start) -
+                (double)(test[b] & SCAN_CROSS ? cross_channel[b].cur : cross_channel[b].start);
+        for(y = 0; y < cross_lagsize * 2 - 1; y++) {
+            double lag = ch + y - (cross_lagsize - 1);
+            put_hex(p, (uint64_t)fringe(lag, 32 + x, 4, 0.25, counts[a] + counts[b], 0.1 * x, 0) & mask, n);
+            p += n;
+            put_hex(p, (uint64_t)fringe(lag, 32 + x, 4, 0.25, counts[a] + counts[b], 0.1 * x, 1) & mask, n);
+            p += n;
+        }
+    }
+    for(x = nlines - 1; x >= 0; x--) {
+        put_hex(p, test[x] & SCAN_AUTO ? auto_channel[x].cur : auto_channel[x].start, delaysize_len);
+        p += delaysize_len;
+    }
+    for(x = nlines - 1; x >= 0; x--) {
+        put_hex(p, test[x] & SCAN_CROSS ? cross_channel[x].cur : cross_channel[x].start, delaysize_len);
+        p += delaysize_len;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ns = (uint64_t)(ts.tv_sec - ts_start.tv_sec) * 1000000000ULL + ts.tv_nsec - ts_start.tv_nsec;
+    put_hex(p, ns >> 32, 8);
+    put_hex(p + 8, ns & 0xffffffff, 8);
+    p += 16;
+    uint32_t checksum = 0;
+    const char *c;
+    for(c = buf + header_len; c < p; c++)
+        checksum += *c < 'A' ? (*c - '0') : (*c - 'A' + 10);
+    put_hex(p, checksum & 0xff, 2);
+    p += 2;
+    *p++ = '\r';
+    free(counts);
+    for(x = 0; x < nlines; x++) {
+        if(test[x] & SCAN_AUTO) {
+            auto_channel[x].cur += auto_channel[x].step ? auto_channel[x].step : 1;
+            if(auto_channel[x].cur >= auto_channel[x].start + auto_channel[x].len)
+                auto_channel[x].cur = auto_channel[x].start;
+        }
+        if(test[x] & SCAN_CROSS) {
+            cross_channel[x].cur += cross_channel[x].step ? cross_channel[x].step : 1;
+            if(cross_channel[x].cur >= cross_channel[x].start + cross_channel[x].len)
+                cross_channel[x].cur = cross_channel[x].start;
+        }
+    }
+    return (size_t)(p - buf);
+}
+
+static void sequence_reset(emu_sequence *s)
+{
+    memset(s, 0, sizeof(emu_sequence));
+    s->expect_len = 1;
+}
+
+static int sequence_push(emu_sequence *s, unsigned char nibble)
+{
+    if(s->expect_len) {
+        s->expect_len = 0;
+        s->nibbles_left = nibble ? nibble : 1;
+        s->shift = 0;
+        s->value = 0;
+        return 0;
+    }
+    if(s->nibbles_left <= 0)
+        return 0;
+    s->value |= (uint64_t)nibble << s->shift;
+    s->shift += 4;
+    return --s->nibbles_left == 0;
+}
+
+static void commit_delay(uint64_t value)
+{
+    if(index_current >= (uint32_t)nlines)
+        return;
+    emu_channel *ch = (capture & CAP_EXTRA_CMD) ? &cross_channel[index_current] : &auto_channel[index_current];
+    switch((test[index_current] >> 4) & 3) {
+    case 0:
+        ch->step = value;
+        break;
+    case 1:
+        ch->len = value;
+        break;
+    case 2:
+        ch->start = value;
+        ch->cur = value;
+        break;
+    default:
+        break;
+    }
+}
+
+static void parse_command(unsigned char c)
+{
+    unsigned char cmd = c & 0xf;
+    unsigned char value = c >> 4;
+    int extra = (capture & CAP_EXTRA_CMD) != 0;
+    commands_received++;
+    switch(cmd) {
+    case CLEAR:
+        switch(value) {
+        case SET_INDEX:
+            sequence_reset(&seq_index);
+            break;
+        case SET_DELAY:
+            if(index_current < (uint32_t)nlines) {
+                emu_channel *ch = extra ? &cross_channel[index_current] : &auto_channel[index_current];
+                memset(ch, 0, sizeof(emu_channel));
+            }
+            sequence_reset(&seq_delay);
+            break;
+        case SET_BAUD_RATE:
+            sequence_reset(&seq_order);
+            break;
+        case CLEAR:
+            sequence_reset(&seq_delay);
+            break;
+        default:
+            break;
+        }
+        break;
+    case SET_INDEX:
+        if(sequence_push(&seq_index, value))
+            index_current = (uint32_t)seq_index.value;
+        break;
+    case SET_LEDS:
+        if(index_current < (uint32_t)nlines)
+            leds[index_current] = extra ? ((leds[index_current] & 0xf) | (value << 4)) : ((leds[index_current] & 0xf0) | value);
+        break;
+    case SET_BAUD_RATE:
+        if(extra)
+            sequence_push(&seq_order, value);
+        else
+            baud_shift = value;
+        break;
+    case SET_VOLTAGE:
+        if(index_current < (uint32_t)nlines)
+            voltage[index_current] = extra ? ((voltage[index_current] & 0xf) | (value << 4)) : ((voltage[index_current] & 0xf0) | value);
+        break;
+    case SET_DELAY:
+        if(sequence_push(&seq_delay, value)) {
+            commit_delay(seq_delay.value);
+            sequence_reset(&seq_delay);
+        }
+        break;
+    case ENABLE_TEST:
+        if(index_current < (uint32_t)nlines) {
+            unsigned char old = test[index_current];
+            if(extra)
+                test[index_current] = (old & 0xf) | (value << 4);
+            else
+                test[index_current] = (old & 0xf0) | value;
+            if((test[index_current] & SCAN_AUTO) && !(old & SCAN_AUTO))
+                auto_channel[index_current].cur = auto_channel[index_current].start;
+            if((test[index_current] & SCAN_CROSS) && !(old & SCAN_CROSS))
+                cross_channel[index_current].cur = cross_channel[index_current].start;
+        }
+        break;
+    case ENABLE_CAPTURE:
+        if((value & CAP_ENABLE) && !(capture & CAP_ENABLE) && (value & CAP_RESET_TIMESTAMP))
+            clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        capture = value;
+        break;
+    default:
+        break;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-l nlines] [-b bps] [-a auto_lagsize] [-c cross_lagsize] [-f flags] [-t tau_ps] [-r baudrate] [-L link] [-q]\n", name);
+    fprintf(stderr, "  -r 0 streams as fast as the pty allows, otherwise packets are paced at baudrate<<SET_BAUD_RATE\n");
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    const char *link = NULL;
+    while((opt = getopt(argc, argv, "l:b:a:c:f:t:r:L:qh")) != -1) {
+        switch(opt) {
+        case 'l': nlines = atoi(optarg); break;
+        case 'b': bps = atoi(optarg); break;
+        case 'a': auto_lagsize = atoi(optarg); break;
+        case 'c': cross_lagsize = atoi(optarg); break;
+        case 'f': flags = (int)strtol(optarg, NULL, 0); break;
+        case 't': tau = atoi(optarg); break;
+        case 'r': baudrate = atoll(optarg); break;
+        case 'L': link = optarg; break;
+        case 'q': quiet = 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if(nlines < 1 || nlines > 256 || bps < 4 || bps > 64 || (bps % 4) || auto_lagsize < 1 || cross_lagsize < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    srand(1);
+    nbaselines = (flags & 1) ? nlines * (nlines - 1) / 2 : 0;
+    header_len = build_header();
+    packetsize = (nlines + auto_lagsize * nlines * 2 + (cross_lagsize * 2 - 1) * nbaselines * 2) * bps / 4 + delaysize_len * nlines * 2 + header_len + 16 + 2 + 1;
+    test = (unsigned char*)calloc(nlines, 1);
+    leds = (unsigned char*)calloc(nlines, 1);
+    voltage = (unsigned char*)calloc(nlines, 1);
+    auto_channel = (emu_channel*)calloc(nlines, sizeof(emu_channel));
+    cross_channel = (emu_channel*)calloc(nlines, sizeof(emu_channel));
+    sequence_reset(&seq_index);
+    sequence_reset(&seq_delay);
+    sequence_reset(&seq_order);
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(master < 0 || grantpt(master) || unlockpt(master)) {
+        perror("posix_openpt");
+        return 1;
+    }
+    const char *slave_name = ptsname(master);
+    /* keep the slave open so that the master never reads EIO between client sessions */
+    int slave = open(slave_name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    if(link != NULL) {
+        unlink(link);
+        if(symlink(slave_name, link))
+            perror("symlink");
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    printf("%s\n", slave_name);
+    if(!quiet)
+        fprintf(stderr, "header %s packetsize %zu\n", header, packetsize);
+    fflush(stdout);
+
+    char *out = (char*)malloc(packetsize + 1);
+    size_t out_len = 0, out_off = 0;
+    double next = now();
+    double t0 = now();
+    while(running) {
+        struct pollfd pfd = { master, POLLIN, 0 };
+        int timeout = -1;
+        if(capture & CAP_ENABLE) {
+            if(out_off < out_len) {
+                pfd.events |= POLLOUT;
+            } else {
+                double wait = next - now();
+                timeout = wait > 0 ? (int)(wait * 1000.0) : 0;
+            }
+        }
+        if(poll(&pfd, 1, timeout < 0 ? 100 : timeout) < 0 && errno != EINTR)
+            break;
+        if(pfd.revents & POLLIN) {
+            unsigned char cmds[256];
+            ssize_t r = read(master, cmds, sizeof(cmds));
+            ssize_t x;
+            for(x = 0; x < r; x++)
+                parse_command(cmds[x]);
+        }
+        if(!(capture & CAP_ENABLE)) {
+            out_len = out_off = 0;
+            next = now();
+            continue;
+        }
+        if(out_off >= out_len && now() >= next) {
+            out_len = build_packet(out);
+            out_off = 0;
+            packets_sent++;
+            if(baudrate > 0)
+                next += 10.0 * packetsize / (double)(baudrate << baud_shift);
+            if(next < now() - 1.0)
+                next = now();
+        }
+        if(out_off < out_len) {
+            ssize_t w = write(master, out + out_off, out_len - out_off);
+            if(w > 0)
+                out_off += w;
+        }
+    }
+    if(!quiet)
+        fprintf(stderr, "%llu packets sent, %llu command bytes received in %.3f seconds\n", (unsigned long long)packets_sent, (unsigned long long)commands_received, now() - t0);
+    if(!quiet) {
+        int x;
+        for(x = 0; x < nlines; x++)
+            fprintf(stderr, "line %d test %02x auto %llu/%llu/%llu cross %llu/%llu/%llu\n", x, test[x],
+                    (unsigned long long)auto_channel[x].start, (unsigned long long)auto_channel[x].len, (unsigned long long)auto_channel[x].step,
+                    (unsigned long long)cross_channel[x].start, (unsigned long long)cross_channel[x].len, (unsigned long long)cross_channel[x].step);
+    }
+    if(link != NULL)
+        unlink(link);
+    close(slave);
+    close(master);
+    return 0;
+}
@@ -41,10 +41,33 @@ extern "C" {
 #include <sys/stat.h>
 #include <limits.h>
 #include <sys/file.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#if defined(LINUX) && defined(TCGETS2) && (defined(__i386__) || defined(__x86_64__) || defined(__arm__) || defined(__aarch64__) || defined(__riscv))
+#define AHP_SERIAL_BOTHER
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16
+#endif
+///Kernel termios structure carrying the line speeds in bauds, the C library does not export it along with termios.h
+struct termios2 {
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+#endif
+
 #else
 #undef UNICODE
 #undef _UNICODE
@@ -141,102 +164,125 @@ ahp_print(x, str); \
 #define end_gettime
 #endif
 
-static pthread_mutexattr_t ahp_serial_mutex_attr;
-static pthread_mutex_t ahp_serial_mutex;
-static int ahp_serial_mutexes_initialized = 0;
-static int ahp_serial_baudrate = 230400;
-static char ahp_serial_mode[4] = { 0, 0, 0, 0 };
-static int ahp_serial_flowctrl = -1;
-static int ahp_serial_fd = -1;
-
+typedef struct {
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutex_t mutex;
+    int mutexes_initialized;
+    int baudrate;
+    char mode[4];
+    int flowctrl;
+    int fd;
+    int error;
 #ifndef WINDOWS
-static int ahp_serial_error = 0;
+    struct termios new_port_settings, old_port_settings;
+#else
+    DCB new_port_settings, old_port_settings;
+#endif
+} ahp_serial_port;
+
+#define AHP_SERIAL_PORT_INITIALIZER { .baudrate = 230400, .flowctrl = -1, .fd = -1 }
+
+static ahp_serial_port ahp_serial_default_port = AHP_SERIAL_PORT_INITIALIZER;
 
-static struct termios ahp_serial_new_port_settings, ahp_serial_old_port_settings;
+///Scheduling margin added to the transmission time of a buffer when waiting for it
+#define AHP_SERIAL_RECV_SLACK_MS 10
 
-static int ahp_serial_SetupPort(int bauds, const char *m, int fc)
+#ifndef WINDOWS
+
+static speed_t ahp_serial_SpeedCode(int bauds)
 {
-    strcpy(ahp_serial_mode, m);
-    ahp_serial_flowctrl = fc;
-    ahp_serial_baudrate = bauds;
-    int baudr, status;
-    switch(ahp_serial_baudrate)
+    switch(bauds)
     {
-    case      50 : baudr = B50;
-                   break;
-    case      75 : baudr = B75;
-                   break;
-    case     110 : baudr = B110;
-                   break;
-    case     134 : baudr = B134;
-                   break;
-    case     150 : baudr = B150;
-                   break;
-    case     200 : baudr = B200;
-                   break;
-    case     300 : baudr = B300;
-                   break;
-    case     600 : baudr = B600;
-                   break;
-    case    1200 : baudr = B1200;
-                   break;
-    case    1800 : baudr = B1800;
-                   break;
-    case    2400 : baudr = B2400;
-                   break;
-    case    4800 : baudr = B4800;
-                   break;
-    case    9600 : baudr = B9600;
-                   break;
-    case   19200 : baudr = B19200;
-                   break;
-    case   38400 : baudr = B38400;
-                   break;
-    case   57600 : baudr = B57600;
-                   break;
-    case  115200 : baudr = B115200;
-                   break;
-    case  230400 : baudr = B230400;
-                   break;
+    case      50 : return B50;
+    case      75 : return B75;
+    case     110 : return B110;
+    case     134 : return B134;
+    case     150 : return B150;
+    case     200 : return B200;
+    case     300 : return B300;
+    case     600 : return B600;
+    case    1200 : return B1200;
+    case    1800 : return B1800;
+    case    2400 : return B2400;
+    case    4800 : return B4800;
+    case    9600 : return B9600;
+    case   19200 : return B19200;
+    case   38400 : return B38400;
+    case   57600 : return B57600;
+    case  115200 : return B115200;
+    case  230400 : return B230400;
 #if defined(__linux__)
-    case  460800 : baudr = B460800;
-                   break;
-    case  500000 : baudr = B500000;
-                   break;
-    case  576000 : baudr = B576000;
-                   break;
-    case  921600 : baudr = B921600;
-                   break;
-    case 1000000 : baudr = B1000000;
-                   break;
-    case 1152000 : baudr = B1152000;
-                   break;
-    case 1500000 : baudr = B1500000;
-                   break;
-    case 2000000 : baudr = B2000000;
-                   break;
-    case 2500000 : baudr = B2500000;
-                   break;
-    case 3000000 : baudr = B3000000;
-                   break;
-    case 3500000 : baudr = B3500000;
-                   break;
-    case 4000000 : baudr = B4000000;
-                   break;
+    case  460800 : return B460800;
+    case  500000 : return B500000;
+    case  576000 : return B576000;
+    case  921600 : return B921600;
+    case 1000000 : return B1000000;
+    case 1152000 : return B1152000;
+    case 1500000 : return B1500000;
+    case 2000000 : return B2000000;
+    case 2500000 : return B2500000;
+    case 3000000 : return B3000000;
+    case 3500000 : return B3500000;
+    case 4000000 : return B4000000;
 #endif
-    default      : printf("invalid ahp_serial_baudrate\n");
-                   return 1;
-  }
+    default      : return B0;
+    }
+}
+
+static int ahp_serial_ApplySpeed(ahp_serial_port *port, int bauds, int custom)
+{
+#ifdef AHP_SERIAL_BOTHER
+    struct termios2 custom_settings;
+    port->error = ioctl(port->fd, TCGETS2, &custom_settings);
+    if(port->error != -1 && custom) {
+        custom_settings.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+        custom_settings.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+        custom_settings.c_ispeed = (speed_t)bauds;
+        custom_settings.c_ospeed = (speed_t)bauds;
+        port->error = ioctl(port->fd, TCSETS2, &custom_settings);
+        if(port->error != -1)
+            port->error = ioctl(port->fd, TCGETS2, &custom_settings);
+    }
+    if(port->error == -1 && custom)
+        return 1;
+    port->baudrate = bauds;
+    if(port->error != -1 && custom_settings.c_ospeed > 0)
+        port->baudrate = (int)custom_settings.c_ospeed;
+    port->error = 0;
+#else
+    (void)custom;
+    port->baudrate = bauds;
+#endif
+    return 0;
+}
+
+static int ahp_serial_SetupPort(ahp_serial_port *port, int bauds, const char *m, int fc)
+{
+    strcpy(port->mode, m);
+    port->flowctrl = fc;
+    port->baudrate = bauds;
+    int status, custom = 0;
+    speed_t baudr = ahp_serial_SpeedCode(port->baudrate);
+    if(baudr == B0)
+    {
+#ifdef AHP_SERIAL_BOTHER
+        baudr = B38400;
+        custom = 1;
+#else
+        printf("invalid ahp_serial_baudrate\n");
+        return 1;
+#endif
+    }
 
   int cbits=CS8,  cpar=0, ipar=IGNPAR, bstop=0;
 
-    if(strlen(ahp_serial_mode) != 3)
+    if(strlen(port->mode) != 3)
     {
-        printf("invalid ahp_serial_mode \"%s\"\n", ahp_serial_mode);
+        printf("invalid ahp_serial_mode \"%s\"\n", port->mode);
         return 1;
     }
 
-    switch(ahp_serial_mode[0])
+    switch(port->mode[0])
     {
     case '8': cbits = CS8;
               break;
@@ -246,11 +292,11 @@ static int ahp_serial_SetupPort(int bauds, const char *m, int fc)
               break;
     case '5': cbits = CS5;
               break;
-    default : printf("invalid number of data-bits '%c'\n", ahp_serial_mode[0]);
+    default : printf("invalid number of data-bits '%c'\n", port->mode[0]);
               return 1;
     }
 
-    switch(ahp_serial_mode[1])
+    switch(port->mode[1])
     {
     case 'N':
     case 'n': cpar = 0;
@@ -264,55 +310,64 @@ static int ahp_serial_SetupPort(int bauds, const char *m, int fc)
     case 'o': cpar = (PARENB | PARODD);
               ipar = INPCK;
               break;
-    default : printf("invalid parity '%c'\n", ahp_serial_mode[1]);
+    default : printf("invalid parity '%c'\n", port->mode[1]);
               return 1;
     }
 
-    switch(ahp_serial_mode[2])
+    switch(port->mode[2])
     {
     case '1': bstop = 0;
               break;
     case '2': bstop = CSTOPB;
               break;
-    default : printf("invalid number of stop bits '%c'\n", ahp_serial_mode[2]);
+    default : printf("invalid number of stop bits '%c'\n", port->mode[2]);
               return 1;
     }
 
-    ahp_serial_error = tcgetattr(ahp_serial_fd, &ahp_serial_old_port_settings);
-    if(ahp_serial_error==-1)
+    port->error = tcgetattr(port->fd, &port->old_port_settings);
+    if(port->error==-1)
     {
         perr("unable to read portsettings \n");
         return 1;
     }
-    memset(&ahp_serial_new_port_settings, 0, sizeof(ahp_serial_new_port_settings));  /* clear the new struct */
+    memset(&port->new_port_settings, 0, sizeof(port->new_port_settings));  /* clear the new struct */
 
-    ahp_serial_new_port_settings.c_cflag = (tcflag_t)(cbits | cpar | bstop | CLOCAL | CREAD);
-    if(ahp_serial_flowctrl)
+    port->new_port_settings.c_cflag = (tcflag_t)(cbits | cpar | bstop | CLOCAL | CREAD);
+    if(port->flowctrl)
     {
-        ahp_serial_new_port_settings.c_cflag |= CRTSCTS;
+        port->new_port_settings.c_cflag |= CRTSCTS;
     }
-    ahp_serial_new_port_settings.c_iflag = (tcflag_t)ipar;
-    ahp_serial_new_port_settings.c_oflag = 0;
-    ahp_serial_new_port_settings.c_lflag = 0;
-    ahp_serial_new_port_settings.c_cc[VMIN] = 0;      /* block untill n bytes are received */
-    ahp_serial_new_port_settings.c_cc[VTIME] = 0;     /* block untill a timer expires (n * 100 mSec.) */
+    port->new_port_settings.c_iflag = (tcflag_t)ipar;
+    port->new_port_settings.c_oflag = 0;
+    port->new_port_settings.c_lflag = 0;
+    port->new_port_settings.c_cc[VMIN] = 0;      /* block untill n bytes are received */
+    port->new_port_settings.c_cc[VTIME] = 0;     /* block untill a timer expires (n * 100 mSec.) */
 
-    cfsetispeed(&ahp_serial_new_port_settings, (speed_t)baudr);
-    cfsetospeed(&ahp_serial_new_port_settings, (speed_t)baudr);
+    cfsetispeed(&port->new_port_settings, (speed_t)baudr);
+    cfsetospeed(&port->new_port_settings, (speed_t)baudr);
 
-    ahp_serial_error = tcsetattr(ahp_serial_fd, TCSANOW, &ahp_serial_new_port_settings);
-    if(ahp_serial_error==-1)
+    port->error = tcsetattr(port->fd, TCSANOW, &port->new_port_settings);
+    if(port->error==-1)
     {
-        tcsetattr(ahp_serial_fd, TCSANOW, &ahp_serial_old_port_settings);
+        tcsetattr(port->fd, TCSANOW, &port->old_port_settings);
         perr("unable to adjust portsettings \n");
         return 1;
     }
 
+    if(ahp_serial_ApplySpeed(port, bauds, custom))
+    {
+        tcsetattr(port->fd, TCSANOW, &port->old_port_settings);
+        perr("unable to set custom baud rate %d\n", bauds);
+        return 1;
+    }
+
 /* http://man7.org/linux/man-pages/man4/tty_ioctl.4.html */
 
-    if(ioctl(ahp_serial_fd, TIOCMGET, &status) == -1)
+    if(ioctl(port->fd, TIOCMGET, &status) == -1)
     {
-        tcsetattr(ahp_serial_fd, TCSANOW, &ahp_serial_old_port_settings);
+        if(errno == ENOTTY || errno == EINVAL)
+            return 0;   /* no modem control lines, as on pseudo-terminals */
+        tcsetattr(port->fd, TCSANOW, &port->old_port_settings);
         perr("unable to get portstatus\n");
         return 1;
     }
@@ -320,9 +375,9 @@ static int ahp_serial_SetupPort(int bauds, const char *m, int fc)
     status |= TIOCM_DTR;    /* turn on DTR */
     status |= TIOCM_RTS;    /* turn on RTS */
 
-    if(ioctl(ahp_serial_fd, TIOCMSET, &status) == -1)
+    if(ioctl(port->fd, TIOCMSET, &status) == -1)
     {
-        tcsetattr(ahp_serial_fd, TCSANOW, &ahp_serial_old_port_settings);
+        tcsetattr(port->fd, TCSANOW, &port->old_port_settings);
         perr("unable to set portstatus\n");
         return 1;
     }
@@ -330,102 +385,138 @@ static int ahp_serial_SetupPort(int bauds, const char *m, int fc)
     return 0;
 }
 
-static void ahp_serial_flushRX()
+static int ahp_serial_SetBaudrate(ahp_serial_port *port, int bauds)
 {
-    tcflush(ahp_serial_fd, TCIFLUSH);
+    struct termios settings, previous_settings;
+    int custom = 0, ret = 0;
+    speed_t baudr = ahp_serial_SpeedCode(bauds);
+    if(baudr == B0)
+    {
+#ifdef AHP_SERIAL_BOTHER
+        baudr = B38400;
+        custom = 1;
+#else
+        printf("invalid ahp_serial_baudrate\n");
+        return 1;
+#endif
+    }
+    if(!port->mutexes_initialized || tcgetattr(port->fd, &previous_settings) == -1)
+        return 1;
+    while(pthread_mutex_trylock(&port->mutex))
+        usleep(100);
+    tcdrain(port->fd);
+    settings = previous_settings;
+    cfsetispeed(&settings, baudr);
+    cfsetospeed(&settings, baudr);
+    if(tcsetattr(port->fd, TCSANOW, &settings) == -1 || ahp_serial_ApplySpeed(port, bauds, custom))
+    {
+        tcsetattr(port->fd, TCSANOW, &previous_settings);
+        perr("unable to set baud rate %d\n", bauds);
+        ret = 1;
+    } else {
+        port->new_port_settings = settings;
+    }
+    pthread_mutex_unlock(&port->mutex);
+    return ret;
 }
 
+static void ahp_serial_flushRX(ahp_serial_port *port)
+{
+    tcflush(port->fd, TCIFLUSH);
+}
 
-static void ahp_serial_flushTX()
+
+static void ahp_serial_DrainTX(ahp_serial_port *port)
 {
-    tcflush(ahp_serial_fd, TCOFLUSH);
+    tcdrain(port->fd);
 }
 
 
-static void ahp_serial_flushRXTX()
+static void ahp_serial_flushRXTX(ahp_serial_port *port)
 {
-    tcflush(ahp_serial_fd, TCIOFLUSH);
+    tcflush(port->fd, TCIOFLUSH);
 }
 
 #else
 
-static DCB ahp_serial_new_port_settings, ahp_serial_old_port_settings;
 
-static int ahp_serial_SetupPort(int bauds, const char *m, int fc)
+static int ahp_serial_SetupPort(ahp_serial_port *port, int bauds, const char *m, int fc)
 {
-    strcpy(ahp_serial_mode, m);
-    ahp_serial_flowctrl = fc;
-    ahp_serial_baudrate = bauds;
-    HANDLE pHandle = (HANDLE)_get_osfhandle(ahp_serial_fd);
+    strcpy(port->mode, m);
+    port->flowctrl = fc;
+    port->baudrate = bauds;
+    HANDLE pHandle = (HANDLE)_get_osfhandle(port->fd);
 
-    memset(&ahp_serial_old_port_settings, 0, sizeof(DCB));
+    memset(&port->old_port_settings, 0, sizeof(DCB));
 
-    if(!GetCommState(pHandle, &ahp_serial_old_port_settings))
+    if(!GetCommState(pHandle, &port->old_port_settings))
     {
         printf("unable to get comport cfg settings\n");
         return 1;
     }
-    memset(&ahp_serial_new_port_settings, 0, sizeof(DCB));
-    ahp_serial_new_port_settings.DCBlength = sizeof(DCB);
-    ahp_serial_new_port_settings.BaudRate = ahp_serial_baudrate;
-    ahp_serial_new_port_settings.XonChar = 0x13;
-    ahp_serial_new_port_settings.XoffChar = 0x19;
-    ahp_serial_new_port_settings.fOutxCtsFlow = 0;
-    ahp_serial_new_port_settings.fOutxDsrFlow = 0;
-    ahp_serial_new_port_settings.fDsrSensitivity = 0;
-    ahp_serial_new_port_settings.fOutX = 0;
-    ahp_serial_new_port_settings.fInX = 0;
-    ahp_serial_new_port_settings.fErrorChar = 0;
-    ahp_serial_new_port_settings.fBinary = 1;
-    ahp_serial_new_port_settings.fNull = 0;
-    ahp_serial_new_port_settings.fAbortOnError = 0;
-    ahp_serial_new_port_settings.XonLim = 0;
-    ahp_serial_new_port_settings.XoffLim = 0;
-    ahp_serial_new_port_settings.fTXContinueOnXoff = 1;
-
-    switch(ahp_serial_mode[0]) {
-    case '5': ahp_serial_new_port_settings.ByteSize = DATABITS_5; break;
-    case '6': ahp_serial_new_port_settings.ByteSize = DATABITS_6; break;
-    case '7': ahp_serial_new_port_settings.ByteSize = DATABITS_7; break;
-    case '8': ahp_serial_new_port_settings.ByteSize = DATABITS_8; break;
+    memset(&port->new_port_settings, 0, sizeof(DCB));
+    port->new_port_settings.DCBlength = sizeof(DCB);
+    port->new_port_settings.BaudRate = port->baudrate;
+    port->new_port_settings.XonChar = 0x13;
+    port->new_port_settings.XoffChar = 0x19;
+    port->new_port_settings.fOutxCtsFlow = 0;
+    port->new_port_settings.fOutxDsrFlow = 0;
+    port->new_port_settings.fDsrSensitivity = 0;
+    port->new_port_settings.fOutX = 0;
+    port->new_port_settings.fInX = 0;
+    port->new_port_settings.fErrorChar = 0;
+    port->new_port_settings.fBinary = 1;
+    port->new_port_settings.fNull = 0;
+    port->new_port_settings.fAbortOnError = 0;
+    port->new_port_settings.XonLim = 0;
+    port->new_port_settings.XoffLim = 0;
+    port->new_port_settings.fTXContinueOnXoff = 1;
+
+    switch(port->mode[0]) {
+    case '5': port->new_port_settings.ByteSize = DATABITS_5; break;
+    case '6': port->new_port_settings.ByteSize = DATABITS_6; break;
+    case '7': port->new_port_settings.ByteSize = DATABITS_7; break;
+    case '8': port->new_port_settings.ByteSize = DATABITS_8; break;
     default:
         perr("invalid byte size\n");
     return 1;
     }
-    switch(tolower(ahp_serial_mode[1])) {
-    case 'n': ahp_serial_new_port_settings.Parity = NOPARITY; ahp_serial_new_port_settings.fParity = 0; break;
-    case 'o': ahp_serial_new_port_settings.Parity = ODDPARITY; ahp_serial_new_port_settings.fParity = 1; break;
-    case 'e': ahp_serial_new_port_settings.Parity = EVENPARITY; ahp_serial_new_port_settings.fParity = 1; break;
+    switch(tolower(port->mode[1])) {
+    case 'n': port->new_port_settings.Parity = NOPARITY; port->new_port_settings.fParity = 0; break;
+    case 'o': port->new_port_settings.Parity = ODDPARITY; port->new_port_settings.fParity = 1; break;
+    case 'e': port->new_port_settings.Parity = EVENPARITY; port->new_port_settings.fParity = 1; break;
     default:
         perr("invalid parity\n");
     return 1;
     }
-    switch(ahp_serial_mode[2]) {
-    case '1': ahp_serial_new_port_settings.StopBits = ONESTOPBIT; break;
-    case '2': ahp_serial_new_port_settings.StopBits = TWOSTOPBITS; break;
+    switch(port->mode[2]) {
+    case '1': port->new_port_settings.StopBits = ONESTOPBIT; break;
+    case '2': port->new_port_settings.StopBits = TWOSTOPBITS; break;
     default:
         perr("invalid stop bits\n");
     return 1;
     }
 
-    if(ahp_serial_flowctrl)
+    if(port->flowctrl)
     {
-        ahp_serial_new_port_settings.fOutxCtsFlow = TRUE;
-        ahp_serial_new_port_settings.fDtrControl = DTR_CONTROL_HANDSHAKE;
-        ahp_serial_new_port_settings.fRtsControl = RTS_CONTROL_HANDSHAKE;
+        port->new_port_settings.fOutxCtsFlow = TRUE;
+        port->new_port_settings.fDtrControl = DTR_CONTROL_HANDSHAKE;
+        port->new_port_settings.fRtsControl = RTS_CONTROL_HANDSHAKE;
     } else {
-        ahp_serial_new_port_settings.fOutxCtsFlow = FALSE;
-        ahp_serial_new_port_settings.fDtrControl = DTR_CONTROL_DISABLE;
-        ahp_serial_new_port_settings.fRtsControl = RTS_CONTROL_DISABLE;
+        port->new_port_settings.fOutxCtsFlow = FALSE;
+        port->new_port_settings.fDtrControl = DTR_CONTROL_DISABLE;
+        port->new_port_settings.fRtsControl = RTS_CONTROL_DISABLE;
     }
 
-    ahp_serial_new_port_settings.DCBlength = sizeof(ahp_serial_new_port_settings);
+    port->new_port_settings.DCBlength = sizeof(port->new_port_settings);
 
-    if(!SetCommState(pHandle, &ahp_serial_new_port_settings))
+    if(!SetCommState(pHandle, &port->new_port_settings))
     {
         perr("unable to set comport cfg settings\n");
         return 1;
     }
+    if(GetCommState(pHandle, &port->new_port_settings) && port->new_port_settings.BaudRate > 0)
+        port->baudrate = port->new_port_settings.BaudRate;
 
     COMMTIMEOUTS Cptimeouts;
     if(!GetCommTimeouts(pHandle, &Cptimeouts))
@@ -449,188 +540,326 @@ static int ahp_serial_SetupPort(int bauds, const char *m, int fc)
     return 0;
 }
 
+static int ahp_serial_SetBaudrate(ahp_serial_port *port, int bauds)
+{
+    HANDLE pHandle = (HANDLE)_get_osfhandle(port->fd);
+    DCB settings;
+    int ret = 0;
+    if(!port->mutexes_initialized)
+        return 1;
+    memset(&settings, 0, sizeof(DCB));
+    settings.DCBlength = sizeof(DCB);
+    if(!GetCommState(pHandle, &settings))
+        return 1;
+    while(pthread_mutex_trylock(&port->mutex))
+        usleep(100);
+    FlushFileBuffers(pHandle);
+    settings.BaudRate = bauds;
+    if(!SetCommState(pHandle, &settings)) {
+        perr("unable to set baud rate %d\n", bauds);
+        ret = 1;
+    } else {
+        port->baudrate = bauds;
+        if(GetCommState(pHandle, &settings) && settings.BaudRate > 0)
+            port->baudrate = settings.BaudRate;
+        port->new_port_settings = settings;
+    }
+    pthread_mutex_unlock(&port->mutex);
+    return ret;
+}
+
 /*
 https://msdn.microsoft.com/en-us/library/windows/desktop/aa363428%28v=vs.85%29.aspx
 */
 
-static void ahp_serial_flushRX()
+static void ahp_serial_flushRX(ahp_serial_port *port)
 {
-    HANDLE pHandle = (HANDLE)_get_osfhandle(ahp_serial_fd);
+    HANDLE pHandle = (HANDLE)_get_osfhandle(port->fd);
     PurgeComm(pHandle, PURGE_RXCLEAR | PURGE_RXABORT);
 }
 
 
-static void ahp_serial_flushTX()
+static void ahp_serial_DrainTX(ahp_serial_port *port)
 {
-    HANDLE pHandle = (HANDLE)_get_osfhandle(ahp_serial_fd);
-    PurgeComm(pHandle, PURGE_TXCLEAR | PURGE_TXABORT);
+    HANDLE pHandle = (HANDLE)_get_osfhandle(port->fd);
+    FlushFileBuffers(pHandle);
 }
 
 
-static void ahp_serial_flushRXTX()
+static void ahp_serial_flushRXTX(ahp_serial_port *port)
 {
-    HANDLE pHandle = (HANDLE)_get_osfhandle(ahp_serial_fd);
+    HANDLE pHandle = (HANDLE)_get_osfhandle(port->fd);
     PurgeComm(pHandle, PURGE_RXCLEAR | PURGE_RXABORT);
     PurgeComm(pHandle, PURGE_TXCLEAR | PURGE_TXABORT);
 }
 
 #endif
 
-static int ahp_serial_OpenComport(const char* dev_name)
+static void ahp_serial_InitMutexes(ahp_serial_port *port)
+{
+    if(!port->mutexes_initialized) {
+        pthread_mutexattr_init(&port->mutex_attr);
+        pthread_mutexattr_settype(&port->mutex_attr, PTHREAD_MUTEX_ERRORCHECK);
+        pthread_mutex_init(&port->mutex, &port->mutex_attr);
+        port->mutexes_initialized = 1;
+    }
+}
+
+static int ahp_serial_OpenComport(ahp_serial_port *port, const char* dev_name)
 {
-    if(ahp_serial_fd == -1)
-        ahp_serial_fd = open(dev_name, O_RDWR);
+    if(port->fd == -1)
+        port->fd = open(dev_name, O_RDWR);
 
-    if(ahp_serial_fd==-1) {
+    if(port->fd==-1) {
         perr("unable to open comport: %s\n", strerror(errno));
         return 1;
     }
-    if(!ahp_serial_mutexes_initialized) {
-        pthread_mutexattr_init(&ahp_serial_mutex_attr);
-        pthread_mutexattr_settype(&ahp_serial_mutex_attr, PTHREAD_MUTEX_ERRORCHECK);
-        pthread_mutex_init(&ahp_serial_mutex, &ahp_serial_mutex_attr);
-        ahp_serial_mutexes_initialized = 1;
-    }
+    ahp_serial_InitMutexes(port);
 #ifdef WINDOWS
     unsigned long nonblocking = 1;
-    ioctlsocket(ahp_serial_fd, FIONBIO, &nonblocking);
+    ioctlsocket(port->fd, FIONBIO, &nonblocking);
 #else
-    int flags = fcntl(ahp_serial_fd, F_GETFL);
-    fcntl(ahp_serial_fd, F_SETFL, flags | O_NONBLOCK);
+    int flags = fcntl(port->fd, F_GETFL);
+    fcntl(port->fd, F_SETFL, flags | O_NONBLOCK);
 #endif
     return 0;
 }
 
-static void ahp_serial_CloseComport()
+static void ahp_serial_CloseComport(ahp_serial_port *port)
+{
+    if(port->fd != -1)
+        close(port->fd);
+    if(port->mutexes_initialized) {
+        pthread_mutex_unlock(&port->mutex);
+        pthread_mutex_destroy(&port->mutex);
+        pthread_mutexattr_destroy(&port->mutex_attr);
+        port->mutexes_initialized = 0;
+
+    }
+    strcpy(port->mode, "   ");
+    port->flowctrl = -1;
+    port->baudrate = -1;
+    port->fd = -1;
+}
+
+static int ahp_serial_RecvTimeout(ahp_serial_port *port, int size)
+{
+    int bauds = port->baudrate > 0 ? port->baudrate : 9600;
+    return (int)((int64_t)size * 12000 / bauds) + AHP_SERIAL_RECV_SLACK_MS;
+}
+
+#ifndef WINDOWS
+static int ahp_serial_RemainingMs(struct timespec *deadline)
 {
-    if(ahp_serial_fd != -1)
-        close(ahp_serial_fd);
-    if(ahp_serial_mutexes_initialized) {
-        pthread_mutex_unlock(&ahp_serial_mutex);
-        pthread_mutex_destroy(&ahp_serial_mutex);
-        pthread_mutexattr_destroy(&ahp_serial_mutex_attr);
-        ahp_serial_mutexes_initialized = 0;
-
-    }
-    strcpy(ahp_serial_mode, "   ");
-    ahp_serial_flowctrl = -1;
-    ahp_serial_baudrate = -1;
-    ahp_serial_fd = -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ms = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
 }
 
-static int ahp_serial_RecvBuf(unsigned char *buf, int size)
+static int ahp_serial_RecvBuf(ahp_serial_port *port, unsigned char *buf, int size)
 {
     int n = -ENODEV;
     int nbytes = 0;
-    int ntries = size;
     int bytes_left = size;
     int err = 0;
-    if(ahp_serial_mutexes_initialized) {
-        while(pthread_mutex_trylock(&ahp_serial_mutex))
+    struct timespec deadline;
+    struct pollfd pfd;
+    if(port->mutexes_initialized) {
+        while(pthread_mutex_trylock(&port->mutex))
             usleep(100);
-        while(bytes_left > 0 && ntries-->0) {
-            usleep(12000000/ahp_serial_baudrate);
-            n = read(ahp_serial_fd, buf+nbytes, bytes_left);
-            if(n<0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        int timeout = ahp_serial_RecvTimeout(port, size);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while(bytes_left > 0) {
+            pfd.fd = port->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            n = poll(&pfd, 1, ahp_serial_RemainingMs(&deadline));
+            if(n < 0) {
+                if(errno == EINTR)
+                    continue;
                 err = -errno;
-                continue;
+                break;
+            }
+            if(n == 0) {
+                err = -ETIMEDOUT;
+                break;
+            }
+            if(!(pfd.revents & POLLIN)) {
+                err = -EIO;
+                break;
+            }
+            n = read(port->fd, buf+nbytes, bytes_left);
+            if(n < 0) {
+                if(errno == EAGAIN || errno == EINTR)
+                    continue;
+                err = -errno;
+                break;
+            }
+            if(n == 0) {
+                err = -ENODATA;
+                break;
             }
             nbytes += n;
             bytes_left -= n;
         }
-        pthread_mutex_unlock(&ahp_serial_mutex);
+        pthread_mutex_unlock(&port->mutex);
     }
     if(nbytes < 1) {
-        if(ntries < 0)
+        if(err == -ETIMEDOUT)
             return -ENODATA;
         return err;
     }
     return nbytes;
 }
-
-static int ahp_serial_SendBuf(unsigned char *buf, int size)
+#else
+static int ahp_serial_RecvBuf(ahp_serial_port *port, unsigned char *buf, int size)
 {
     int n = -ENODEV;
     int nbytes = 0;
-    int ntries = size*2;
+    int ntries = size;
     int bytes_left = size;
     int err = 0;
-    if(ahp_serial_mutexes_initialized) {
-        while(pthread_mutex_trylock(&ahp_serial_mutex))
+    if(port->mutexes_initialized) {
+        while(pthread_mutex_trylock(&port->mutex))
             usleep(100);
         while(bytes_left > 0 && ntries-->0) {
-            usleep(12000000/ahp_serial_baudrate);
-            n = write(ahp_serial_fd, buf+nbytes, bytes_left);
-            if(n<1) {
+            usleep(12000000/port->baudrate);
+            n = read(port->fd, buf+nbytes, bytes_left);
+            if(n<0) {
                 err = -errno;
                 continue;
             }
             nbytes += n;
             bytes_left -= n;
         }
-        pthread_mutex_unlock(&ahp_serial_mutex);
+        pthread_mutex_unlock(&port->mutex);
     }
-    if(nbytes < size)
+    if(nbytes < 1) {
+        if(ntries < 0)
+            return -ENODATA;
         return err;
+    }
     return nbytes;
 }
 
-static int ahp_serial_RecvByte()
-{
-    int byte = 0;
-    int n = ahp_serial_RecvBuf((unsigned char*)&byte, 1);
-    if(n < 1)
-    {
-        return -errno;
-    }
-    return byte;
-}
+#endif
 
-static int ahp_serial_SendByte(unsigned char byte)
+static int ahp_serial_RecvAvailable(ahp_serial_port *port, unsigned char *buf, int size, int timeout_ms)
 {
-    int n = ahp_serial_SendBuf(&byte, 1);
-    if(n < 1)
-    {
-        return -errno;
+    int n = -ENODEV;
+    if(port->mutexes_initialized) {
+#ifndef WINDOWS
+        struct pollfd pfd;
+        pfd.fd = port->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        n = poll(&pfd, 1, timeout_ms);
+        if(n > 0) {
+            while(pthread_mutex_trylock(&port->mutex))
+                usleep(100);
+            n = read(port->fd, buf, size);
+            if(n < 0)
+                n = (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+            else if(n == 0)
+                n = -ENODATA;
+            pthread_mutex_unlock(&port->mutex);
+        } else if(n < 0) {
+            n = (errno == EINTR) ? 0 : -errno;
+        }
+#else
+        while(pthread_mutex_trylock(&port->mutex))
+            usleep(100);
+        n = read(port->fd, buf, size);
+        if(n < 0)
+            n = (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+        pthread_mutex_unlock(&port->mutex);
+        if(n == 0)
+            usleep(timeout_ms * 1000);
+#endif
     }
-    return 0;
+    return n;
 }
 
-static int ahp_serial_AlignFrame(int sof, int maxtries)
+static int ahp_serial_SendBuf(ahp_serial_port *port, unsigned char *buf, int size)
 {
-    int c = 0;
-    ahp_serial_flushRX();
-    while(c != sof && (maxtries > 0 ? maxtries-- > 0 : 1)) {
-        c = ahp_serial_RecvByte();
-        if(c < 0) {
-            continue;
+    int n = -ENODEV;
+    int nbytes = 0;
+    int bytes_left = size;
+    int err = 0;
+    if(port->mutexes_initialized) {
+        while(pthread_mutex_trylock(&port->mutex))
+            usleep(100);
+#ifndef WINDOWS
+        struct pollfd pfd;
+        pfd.fd = port->fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        while(bytes_left > 0) {
+            n = write(port->fd, buf+nbytes, bytes_left);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && errno != EAGAIN) {
+                err = -errno;
+                break;
+            }
+            if(n < 1) {
+                if(poll(&pfd, 1, ahp_serial_RecvTimeout(port, bytes_left)) < 1) {
+                    err = -ETIMEDOUT;
+                    break;
+                }
+                continue;
+            }
+            nbytes += n;
+            bytes_left -= n;
+        }
+#else
+        int ntries = size*2;
+        while(bytes_left > 0 && ntries-->0) {
+            n = write(port->fd, buf+nbytes, bytes_left);
+            if(n<1) {
+                err = -errno;
+                continue;
+            }
+            nbytes += n;
+            bytes_left -= n;
         }
+#endif
+        pthread_mutex_unlock(&port->mutex);
     }
-    return 0;
+    if(nbytes < size)
+        return err;
+    return nbytes;
 }
 
-static void ahp_serial_SetFD(int f, int bauds)
+static void ahp_serial_SetFD(ahp_serial_port *port, int f, int bauds)
 {
-    if(!ahp_serial_mutexes_initialized) {
-        pthread_mutexattr_init(&ahp_serial_mutex_attr);
-        pthread_mutexattr_settype(&ahp_serial_mutex_attr, PTHREAD_MUTEX_ERRORCHECK);
-        pthread_mutex_init(&ahp_serial_mutex, &ahp_serial_mutex_attr);
-        ahp_serial_mutexes_initialized = 1;
-    }
-    ahp_serial_fd = f;
-    ahp_serial_baudrate = bauds;
+    ahp_serial_InitMutexes(port);
+    port->fd = f;
+    port->baudrate = bauds;
 #ifdef WINDOWS
     unsigned long nonblocking = 1;
-    ioctlsocket(ahp_serial_fd, FIONBIO, &nonblocking);
+    ioctlsocket(port->fd, FIONBIO, &nonblocking);
 #else
-    int flags = fcntl(ahp_serial_fd, F_GETFL);
-    fcntl(ahp_serial_fd, F_SETFL, flags | O_NONBLOCK);
+    int flags = fcntl(port->fd, F_GETFL);
+    fcntl(port->fd, F_SETFL, flags | O_NONBLOCK);
 #endif
 }
 
-static int ahp_serial_GetFD()
+static int ahp_serial_GetFD(ahp_serial_port *port)
+{
+    return port->fd;
+}
+
+static int ahp_serial_GetBaudrate(ahp_serial_port *port)
 {
-    return ahp_serial_fd;
+    return port->baudrate;
 }
 
 #ifdef __cplusplus
@@ -0,0 +1,101 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+* Checks the baseline lookup against a scan of all baselines.
+* For each correlation order the tuples of the baselines and random tuples,
+* repeated lines included, must map to the baseline sharing most lines with
+* them, the lowest index winning ties. Pairs must map back to their baseline.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "ahp_xc.h"
+#include "emulator.h"
+
+#define EMULATED_LINES "12"
+#define MAX_ORDER 5
+#define RANDOM_TUPLES 2000
+
+static int failures = 0;
+
+static int32_t closest_baseline(int32_t *lines, int32_t order)
+{
+    int32_t idx, x, y;
+    int32_t best = 0, index = 0;
+    for(idx = 0; idx < (int32_t)ahp_xc_get_nbaselines(); idx++) {
+        int32_t matches = 0;
+        for(x = 0; x < order; x++)
+            for(y = 0; y < order; y++)
+                matches += lines[x] == ahp_xc_get_line_index(idx, y);
+        if(matches > best) {
+            best = matches;
+            index = idx;
+        }
+    }
+    return index;
+}
+
+int main(int argc, char **argv)
+{
+    char port[256];
+    int32_t lines[MAX_ORDER];
+    int32_t order, x;
+    uint32_t idx;
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s emulator\n", argv[0]);
+        return 1;
+    }
+    pid_t pid = emulator_start(argv[1], EMULATED_LINES, port, sizeof(port));
+    if(pid < 0) {
+        fprintf(stderr, "cannot start %s\n", argv[1]);
+        return 1;
+    }
+    if(ahp_xc_connect(port)) {
+        fprintf(stderr, "cannot connect to %s\n", port);
+        emulator_stop(pid);
+        return 1;
+    }
+    int32_t nlines = (int32_t)ahp_xc_get_nlines();
+    TEST_CHECK(nlines == atoi(EMULATED_LINES));
+    TEST_CHECK(ahp_xc_set_correlation_order(nlines) == -EINVAL);
+    srand(1);
+    for(order = 2; order <= MAX_ORDER; order++) {
+        int mismatches = 0;
+        TEST_CHECK(ahp_xc_set_correlation_order(order) == 0);
+        TEST_CHECK(ahp_xc_get_correlation_order() == order);
+        for(idx = 0; idx < ahp_xc_get_nbaselines(); idx++) {
+            TEST_CHECK(ahp_xc_get_baseline_lines(idx, lines) == order);
+            mismatches += ahp_xc_get_crosscorrelation_index(lines, order) != closest_baseline(lines, order);
+            if(order == 2)
+                mismatches += ahp_xc_get_crosscorrelation_index(lines, order) != (int32_t)idx;
+        }
+        for(idx = 0; idx < RANDOM_TUPLES; idx++) {
+            for(x = 0; x < order; x++)
+                lines[x] = rand() % nlines;
+            mismatches += ahp_xc_get_crosscorrelation_index(lines, order) != closest_baseline(lines, order);
+        }
+        TEST_CHECK(mismatches == 0);
+        printf("order %d: %u baselines, %d mismatches\n", order, ahp_xc_get_nbaselines(), mismatches);
+    }
+    ahp_xc_disconnect();
+    emulator_stop(pid);
+    return failures != 0;
+}
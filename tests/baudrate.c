@@ -0,0 +1,99 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+* Checks the baud rate negotiation and switching against the emulator.
+* The link negotiated on connection must reach the requested multiplier,
+* switching to each available multiplier must keep packets flowing and
+* multipliers the device cannot encode must leave the rate untouched.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "ahp_xc.h"
+#include "emulator.h"
+
+#define NEGOTIATED_MULTIPLIER 32
+#define CHECKED_PACKETS 20
+
+static int failures = 0;
+
+static int receive_packets(void)
+{
+    int x, received = 0;
+    ahp_xc_packet *packet = ahp_xc_alloc_packet();
+    if(packet == NULL)
+        return 0;
+    ahp_xc_set_capture_flags(CAP_ENABLE);
+    for(x = 0; x < CHECKED_PACKETS; x++)
+        received += !ahp_xc_get_packet(packet);
+    ahp_xc_set_capture_flags(0);
+    ahp_xc_free_packet(packet);
+    return received;
+}
+
+static void check_multiplier(uint32_t multiplier)
+{
+    TEST_CHECK(ahp_xc_set_baudrate_multiplier(multiplier) == 0);
+    TEST_CHECK(ahp_xc_get_baudrate() == (int32_t)(XC_BASE_RATE * multiplier));
+    TEST_CHECK(ahp_xc_get_actual_baudrate() == ahp_xc_get_baudrate());
+    int received = receive_packets();
+    TEST_CHECK(received == CHECKED_PACKETS);
+    printf("x%u: %d baud, %d packets\n", multiplier, ahp_xc_get_baudrate(), received);
+}
+
+int main(int argc, char **argv)
+{
+    char port[256];
+    ahp_xc_link_status link;
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s emulator\n", argv[0]);
+        return 1;
+    }
+    pid_t pid = emulator_start(argv[1], NULL, port, sizeof(port));
+    if(pid < 0) {
+        fprintf(stderr, "cannot start %s\n", argv[1]);
+        return 1;
+    }
+    ahp_xc_set_link_negotiation(NEGOTIATED_MULTIPLIER, 8, 0.1);
+    if(ahp_xc_connect(port)) {
+        fprintf(stderr, "cannot connect to %s\n", port);
+        emulator_stop(pid);
+        return 1;
+    }
+    ahp_xc_get_link_status(&link);
+    TEST_CHECK(link.multiplier == NEGOTIATED_MULTIPLIER);
+    TEST_CHECK(link.baudrate == XC_BASE_RATE * NEGOTIATED_MULTIPLIER);
+    TEST_CHECK(link.error_rate <= 0.1);
+    TEST_CHECK(receive_packets() == CHECKED_PACKETS);
+    printf("negotiated: x%u, %d baud\n", link.multiplier, link.baudrate);
+    check_multiplier(2);
+    TEST_CHECK(ahp_xc_set_baudrate_multiplier(3) == -EINVAL);
+    TEST_CHECK(ahp_xc_get_baudrate() == XC_BASE_RATE * 2);
+    check_multiplier(1024);
+    check_multiplier(1);
+    TEST_CHECK(ahp_xc_negotiate_baudrate(NEGOTIATED_MULTIPLIER, 8, 0.1) == 0);
+    ahp_xc_get_link_status(&link);
+    TEST_CHECK(link.multiplier == NEGOTIATED_MULTIPLIER);
+    TEST_CHECK(receive_packets() == CHECKED_PACKETS);
+    ahp_xc_disconnect();
+    emulator_stop(pid);
+    return failures != 0;
+}
@@ -0,0 +1,80 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+* Helpers shared by the tests: the emulator is spawned on a pty and prints
+* the pty path on its standard output, which is read back through a pipe.
+*/
+
+#ifndef AHP_XC_TEST_EMULATOR_H
+#define AHP_XC_TEST_EMULATOR_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/*
+* Count a failure of condition into the failures counter of the test and go on.
+*/
+#define TEST_CHECK(condition) do { \
+    if(!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while(0)
+
+/*
+* Start the emulator with nlines inputs, or its default when nlines is NULL,
+* and store its pty path into port.
+*/
+static pid_t emulator_start(const char *emulator, const char *nlines, char *port, size_t size)
+{
+    int fds[2];
+    if(pipe(fds))
+        return -1;
+    pid_t pid = fork();
+    if(pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if(nlines != NULL)
+            execl(emulator, emulator, "-q", "-l", nlines, (char*)NULL);
+        else
+            execl(emulator, emulator, "-q", (char*)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    FILE *out = fdopen(fds[0], "r");
+    if(pid < 0 || out == NULL || fgets(port, (int)size, out) == NULL) {
+        if(pid > 0)
+            kill(pid, SIGTERM);
+        return -1;
+    }
+    port[strcspn(port, "\n")] = 0;
+    return pid;
+}
+
+static void emulator_stop(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+#endif //AHP_XC_TEST_EMULATOR_H
@@ -0,0 +1,134 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+* Checks that a merge stage groups the packets taken at the same device time.
+* A recording of the emulator is replayed at a paced speed by two contexts,
+* the second one starting some packets later: every recorded packet must be
+* emitted in one group, the groups before the second stream starts must
+* report it missing and the packets of complete groups must share their
+* timestamp.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "ahp_xc.h"
+#include "emulator.h"
+
+#define RECORDED_PACKETS 300
+#define SKIPPED_PACKETS 20
+#define MERGED_STREAMS 2
+#define MERGE_DEPTH 64
+#define MERGE_TOLERANCE 4e-6
+#define MERGE_WINDOW 1.0
+#define REPLAY_SPEED 0.1
+
+static int failures = 0;
+
+static int record(const char *emulator, const char *filename)
+{
+    char port[256];
+    int x, recorded = 0;
+    pid_t pid = emulator_start(emulator, NULL, port, sizeof(port));
+    if(pid < 0) {
+        fprintf(stderr, "cannot start %s\n", emulator);
+        return 0;
+    }
+    if(ahp_xc_connect(port)) {
+        fprintf(stderr, "cannot connect to %s\n", port);
+        emulator_stop(pid);
+        return 0;
+    }
+    ahp_xc_packet *packet = ahp_xc_alloc_packet();
+    ahp_xc_set_capture_flags(CAP_ENABLE);
+    if(!ahp_xc_start_recording(filename)) {
+        for(x = 0; x < RECORDED_PACKETS * 2 && recorded < RECORDED_PACKETS; x++)
+            recorded += !ahp_xc_get_packet(packet);
+        ahp_xc_stop_recording();
+    }
+    ahp_xc_set_capture_flags(0);
+    ahp_xc_free_packet(packet);
+    ahp_xc_disconnect();
+    emulator_stop(pid);
+    return recorded;
+}
+
+int main(int argc, char **argv)
+{
+    char filename[] = "/tmp/ahp_xc_merge_XXXXXX";
+    ahp_xc_context *contexts[MERGED_STREAMS];
+    ahp_xc_merge_status status[MERGED_STREAMS];
+    uint32_t x;
+    int32_t err;
+    uint64_t groups = 0, missing = 0, misaligned = 0, unordered = 0;
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s emulator\n", argv[0]);
+        return 1;
+    }
+    int fd = mkstemp(filename);
+    if(fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    int recorded = record(argv[1], filename);
+    TEST_CHECK(recorded == RECORDED_PACKETS);
+    for(x = 0; x < MERGED_STREAMS; x++) {
+        contexts[x] = ahp_xc_alloc_context();
+        if(contexts[x] == NULL || ahp_xc_context_connect_replay(contexts[x], filename, REPLAY_SPEED)) {
+            fprintf(stderr, "cannot replay %s\n", filename);
+            unlink(filename);
+            return 1;
+        }
+    }
+    ahp_xc_packet *packet = ahp_xc_context_alloc_packet(contexts[1]);
+    for(x = 0; x < SKIPPED_PACKETS; x++)
+        ahp_xc_context_get_packet(contexts[1], packet);
+    ahp_xc_free_packet(packet);
+    ahp_xc_merge *merge = ahp_xc_merge_start(contexts, MERGED_STREAMS, MERGE_DEPTH, MERGE_TOLERANCE, MERGE_WINDOW);
+    TEST_CHECK(merge != NULL);
+    if(merge != NULL) {
+        ahp_xc_packet_group *group = ahp_xc_merge_alloc_group(merge);
+        while(!(err = ahp_xc_merge_get_group(merge, group, 2000))) {
+            unordered += group->sequence != groups;
+            missing += group->missing;
+            if(group->missing == 0)
+                misaligned += group->packets[0]->timestamp != group->packets[1]->timestamp;
+            groups++;
+        }
+        TEST_CHECK(err == -ENODATA);
+        for(x = 0; x < MERGED_STREAMS; x++)
+            TEST_CHECK(ahp_xc_merge_get_status(merge, x, &status[x]) == 0);
+        ahp_xc_merge_free_group(merge, group);
+        ahp_xc_merge_stop(merge);
+        TEST_CHECK(groups == (uint64_t)recorded);
+        TEST_CHECK(missing == SKIPPED_PACKETS);
+        TEST_CHECK(misaligned == 0);
+        TEST_CHECK(unordered == 0);
+        TEST_CHECK(status[0].packets == (uint64_t)recorded && status[0].gaps == 0);
+        TEST_CHECK(status[1].packets == (uint64_t)(recorded - SKIPPED_PACKETS) && status[1].gaps == SKIPPED_PACKETS);
+        TEST_CHECK(status[0].ended && status[1].ended);
+    }
+    for(x = 0; x < MERGED_STREAMS; x++)
+        ahp_xc_free_context(contexts[x]);
+    unlink(filename);
+    printf("merged: %lu groups, %lu missing packets\n", (unsigned long)groups, (unsigned long)missing);
+    return failures != 0;
+}
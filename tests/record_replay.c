@@ -0,0 +1,112 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+* Checks that a recording replays the packets it captured.
+* Packets of the emulator passed as first argument are recorded, the file is
+* then replayed and every packet must match the captured one, seeking to a
+* recorded timestamp must return the packet taken at that time.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "ahp_xc.h"
+#include "emulator.h"
+
+#define RECORDED_PACKETS 300
+
+static int failures = 0;
+static double timestamps[RECORDED_PACKETS];
+static uint64_t counts[RECORDED_PACKETS];
+
+int main(int argc, char **argv)
+{
+    char port[256];
+    char filename[] = "/tmp/ahp_xc_record_XXXXXX";
+    int x, recorded = 0, replayed = 0, matching = 0;
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s emulator\n", argv[0]);
+        return 1;
+    }
+    int fd = mkstemp(filename);
+    if(fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    pid_t pid = emulator_start(argv[1], NULL, port, sizeof(port));
+    if(pid < 0) {
+        fprintf(stderr, "cannot start %s\n", argv[1]);
+        return 1;
+    }
+    if(ahp_xc_connect(port)) {
+        fprintf(stderr, "cannot connect to %s\n", port);
+        emulator_stop(pid);
+        return 1;
+    }
+    uint32_t nlines = ahp_xc_get_nlines();
+    ahp_xc_packet *packet = ahp_xc_alloc_packet();
+    ahp_xc_set_capture_flags(CAP_ENABLE);
+    TEST_CHECK(ahp_xc_start_recording(filename) == 0);
+    TEST_CHECK(ahp_xc_is_recording());
+    for(x = 0; x < RECORDED_PACKETS * 2 && recorded < RECORDED_PACKETS; x++) {
+        if(ahp_xc_get_packet(packet))
+            continue;
+        timestamps[recorded] = packet->timestamp;
+        counts[recorded] = packet->counts[0];
+        recorded++;
+    }
+    ahp_xc_stop_recording();
+    TEST_CHECK(!ahp_xc_is_recording());
+    TEST_CHECK(ahp_xc_get_recording_error() == 0);
+    ahp_xc_set_capture_flags(0);
+    ahp_xc_free_packet(packet);
+    ahp_xc_disconnect();
+    emulator_stop(pid);
+    TEST_CHECK(recorded == RECORDED_PACKETS);
+
+    if(ahp_xc_connect_replay(filename, 0)) {
+        fprintf(stderr, "cannot replay %s\n", filename);
+        unlink(filename);
+        return 1;
+    }
+    TEST_CHECK(ahp_xc_get_nlines() == nlines);
+    TEST_CHECK(ahp_xc_get_replay_length() == (uint64_t)recorded);
+    packet = ahp_xc_alloc_packet();
+    for(x = 0; x < recorded; x++) {
+        if(ahp_xc_get_packet(packet))
+            break;
+        replayed++;
+        matching += packet->timestamp == timestamps[x] && packet->counts[0] == counts[x];
+    }
+    TEST_CHECK(replayed == recorded);
+    TEST_CHECK(matching == recorded);
+    TEST_CHECK(ahp_xc_get_packet(packet) != 0);
+    TEST_CHECK(ahp_xc_replay_seek(timestamps[recorded / 2]) == 0);
+    TEST_CHECK(ahp_xc_get_packet(packet) == 0 && packet->timestamp == timestamps[recorded / 2]);
+    TEST_CHECK(ahp_xc_replay_seek(timestamps[0]) == 0);
+    TEST_CHECK(ahp_xc_get_packet(packet) == 0 && packet->timestamp == timestamps[0]);
+    TEST_CHECK(ahp_xc_replay_seek(timestamps[recorded - 1] + 1.0) == -ERANGE);
+    ahp_xc_free_packet(packet);
+    ahp_xc_disconnect();
+    unlink(filename);
+    printf("recorded: %d packets, replayed: %d, matching: %d\n", recorded, replayed, matching);
+    return failures != 0;
+}
@@ -0,0 +1,197 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+* Checks the autocorrelation scans against the emulator.
+* The same requests are scanned into memory, through a callback and into a
+* file, each must deliver every channel once. The adaptive scan must return
+* the samples of each input in channel order, counted by input.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ahp_xc.h"
+#include "emulator.h"
+
+#define SCANNED_LINES 2
+#define SCAN_LEN 16
+#define ADAPTIVE_LEN 64
+#define ADAPTIVE_STEP 8
+
+static int failures = 0;
+
+typedef struct {
+    int calls;
+    int misplaced;
+    int seen[SCANNED_LINES][SCAN_LEN];
+} stream_result;
+
+static void stream_sample(ahp_xc_scan_request *request, uint32_t channel, ahp_xc_sample *sample, void *user)
+{
+    stream_result *result = (stream_result*)user;
+    result->calls++;
+    if(request->index >= SCANNED_LINES || channel >= SCAN_LEN || sample == NULL) {
+        result->misplaced++;
+        return;
+    }
+    result->seen[request->index][channel]++;
+}
+
+static void scan_requests(ahp_xc_scan_request *lines, size_t len, size_t step)
+{
+    uint32_t x;
+    memset(lines, 0, sizeof(ahp_xc_scan_request) * SCANNED_LINES);
+    for(x = 0; x < SCANNED_LINES; x++) {
+        lines[x].index = x;
+        lines[x].start = 0;
+        lines[x].len = len;
+        lines[x].step = step;
+    }
+}
+
+static void check_scan(ahp_xc_scan_request *lines)
+{
+    ahp_xc_sample *samples = NULL;
+    int32_t interrupt = 0;
+    double percent = 0;
+    int32_t scanned = ahp_xc_scan_autocorrelations(lines, SCANNED_LINES, &samples, &interrupt, &percent);
+    TEST_CHECK(scanned == SCANNED_LINES * SCAN_LEN);
+    TEST_CHECK(percent > 99.0);
+    if(scanned > 0)
+        ahp_xc_free_samples(scanned, samples);
+    printf("scan: %d channels\n", scanned);
+}
+
+static void check_stream(ahp_xc_scan_request *lines)
+{
+    stream_result result;
+    int32_t interrupt = 0;
+    double percent = 0;
+    int x, y, repeated = 0;
+    memset(&result, 0, sizeof(result));
+    int32_t delivered = ahp_xc_scan_autocorrelations_stream(lines, SCANNED_LINES, stream_sample, &result, &interrupt, &percent);
+    TEST_CHECK(delivered == SCANNED_LINES * SCAN_LEN);
+    TEST_CHECK(result.calls == delivered);
+    TEST_CHECK(result.misplaced == 0);
+    for(x = 0; x < SCANNED_LINES; x++)
+        for(y = 0; y < SCAN_LEN; y++)
+            repeated += result.seen[x][y] != 1;
+    TEST_CHECK(repeated == 0);
+    printf("stream: %d samples, %d callbacks\n", delivered, result.calls);
+}
+
+static void check_file(ahp_xc_scan_request *lines)
+{
+    char filename[] = "/tmp/ahp_xc_scan_XXXXXX";
+    ahp_xc_scan_file_header header;
+    ahp_xc_scan_record record;
+    int32_t interrupt = 0;
+    double percent = 0;
+    uint64_t x;
+    int misplaced = 0;
+    int fd = mkstemp(filename);
+    if(fd < 0) {
+        perror("mkstemp");
+        failures++;
+        return;
+    }
+    close(fd);
+    int32_t written = ahp_xc_scan_autocorrelations_to_file(lines, SCANNED_LINES, filename, &interrupt, &percent);
+    TEST_CHECK(written == SCANNED_LINES * SCAN_LEN);
+    FILE *file = fopen(filename, "rb");
+    TEST_CHECK(file != NULL);
+    if(file != NULL) {
+        TEST_CHECK(fread(&header, sizeof(header), 1, file) == 1);
+        TEST_CHECK(!memcmp(header.magic, AHP_XC_SCAN_FILE_MAGIC, sizeof(header.magic)));
+        TEST_CHECK(header.record_size == sizeof(ahp_xc_scan_record));
+        TEST_CHECK(header.nlines == SCANNED_LINES);
+        TEST_CHECK(header.samples == (uint64_t)written);
+        TEST_CHECK(header.records == (uint64_t)SCANNED_LINES * SCAN_LEN * header.lag_size);
+        fseek(file, (long)header.data_offset, SEEK_SET);
+        for(x = 0; x < header.records && header.lag_size > 0; x++) {
+            uint64_t channel = x / header.lag_size;
+            if(fread(&record, sizeof(record), 1, file) != 1) {
+                misplaced++;
+                break;
+            }
+            misplaced += record.line != channel / SCAN_LEN || record.channel != channel % SCAN_LEN;
+        }
+        TEST_CHECK(misplaced == 0);
+        fclose(file);
+    }
+    unlink(filename);
+    printf("file: %d samples\n", written);
+}
+
+static void check_adaptive(ahp_xc_scan_request *lines)
+{
+    ahp_xc_sample *samples = NULL;
+    uint32_t counts[SCANNED_LINES];
+    int32_t interrupt = 0;
+    double percent = 0;
+    uint32_t x, y, total = 0;
+    int unordered = 0;
+    int32_t found = ahp_xc_scan_autocorrelations_adaptive(lines, SCANNED_LINES, 4, 2.0, &samples, counts, &interrupt, &percent);
+    TEST_CHECK(found > 0);
+    if(found <= 0)
+        return;
+    double sampletime = ahp_xc_get_sampletime();
+    for(x = 0; x < SCANNED_LINES; x++) {
+        TEST_CHECK(counts[x] >= ADAPTIVE_LEN / ADAPTIVE_STEP);
+        for(y = 1; y < counts[x] && total + y < (uint32_t)found; y++)
+            unordered += samples[total + y].lag / sampletime <= samples[total + y - 1].lag / sampletime;
+        total += counts[x];
+    }
+    TEST_CHECK(total == (uint32_t)found);
+    TEST_CHECK(unordered == 0);
+    ahp_xc_free_samples(found, samples);
+    printf("adaptive: %d samples, %u and %u by input\n", found, counts[0], counts[1]);
+}
+
+int main(int argc, char **argv)
+{
+    char port[256];
+    ahp_xc_scan_request lines[SCANNED_LINES];
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s emulator\n", argv[0]);
+        return 1;
+    }
+    pid_t pid = emulator_start(argv[1], NULL, port, sizeof(port));
+    if(pid < 0) {
+        fprintf(stderr, "cannot start %s\n", argv[1]);
+        return 1;
+    }
+    if(ahp_xc_connect(port)) {
+        fprintf(stderr, "cannot connect to %s\n", port);
+        emulator_stop(pid);
+        return 1;
+    }
+    scan_requests(lines, SCAN_LEN, 1);
+    check_scan(lines);
+    scan_requests(lines, SCAN_LEN, 1);
+    check_stream(lines);
+    scan_requests(lines, SCAN_LEN, 1);
+    check_file(lines);
+    scan_requests(lines, ADAPTIVE_LEN, ADAPTIVE_STEP);
+    check_adaptive(lines);
+    ahp_xc_disconnect();
+    emulator_stop(pid);
+    return failures != 0;
+}
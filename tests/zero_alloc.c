@@ -0,0 +1,110 @@
+/*
+*    XC Quantum correlators driver library
+*    Copyright (C) 2015-2023  Ilia Platone <info@iliaplatone.com>
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+* Checks that packets are acquired and decoded without heap allocations.
+* The emulator passed as first argument is spawned on a pty, the allocator is
+* wrapped with a counter and every packet received after the warm up, polled
+* or streamed, must leave the counter untouched.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include "ahp_xc.h"
+#include "emulator.h"
+
+#define WARMUP_PACKETS 20
+#define COUNTED_PACKETS 200
+#define STREAM_DEPTH 16
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile int counting = 0;
+static volatile long allocations = 0;
+
+void *malloc(size_t size)
+{
+    if(counting)
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if(counting)
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if(counting)
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+static long count_allocations(ahp_xc_packet *packet, int *received)
+{
+    int x;
+    for(x = 0; x < WARMUP_PACKETS; x++)
+        ahp_xc_get_packet(packet);
+    allocations = 0;
+    counting = 1;
+    for(x = 0; x < COUNTED_PACKETS; x++)
+        *received += !ahp_xc_get_packet(packet);
+    counting = 0;
+    return allocations;
+}
+
+int main(int argc, char **argv)
+{
+    char port[256];
+    int polled = 0, streamed = 0;
+    long polled_allocations, streamed_allocations;
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s emulator\n", argv[0]);
+        return 1;
+    }
+    pid_t pid = emulator_start(argv[1], NULL, port, sizeof(port));
+    if(pid < 0) {
+        fprintf(stderr, "cannot start %s\n", argv[1]);
+        return 1;
+    }
+    if(ahp_xc_connect(port)) {
+        fprintf(stderr, "cannot connect to %s\n", port);
+        emulator_stop(pid);
+        return 1;
+    }
+    ahp_xc_set_correlation_order(2);
+    ahp_xc_packet *packet = ahp_xc_alloc_packet();
+    ahp_xc_set_capture_flags(CAP_ENABLE);
+    polled_allocations = count_allocations(packet, &polled);
+    ahp_xc_start_streaming(STREAM_DEPTH);
+    streamed_allocations = count_allocations(packet, &streamed);
+    ahp_xc_stop_streaming();
+    ahp_xc_set_capture_flags(0);
+    ahp_xc_free_packet(packet);
+    ahp_xc_disconnect();
+    emulator_stop(pid);
+    printf("polled: %d packets, %ld allocations\n", polled, polled_allocations);
+    printf("streamed: %d packets, %ld allocations\n", streamed, streamed_allocations);
+    return polled == 0 || streamed == 0 || polled_allocations != 0 || streamed_allocations != 0;
+}